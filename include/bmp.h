@@ -34,9 +34,9 @@ typedef struct BmpObject {
 } BmpObject;
 
 int write_bmp_cpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer);
+                  uint32_t stride, uint32_t bytes_per_pixel, uint8_t *pixels);
 
 int write_bmp_dpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer);
+                  uint32_t mcu_width, uint32_t num_color_components, short *MCU_buffer);
 
 #endif // _BMP__H
@@ -0,0 +1,417 @@
+#ifndef _CPU_JPEG_H
+#define _CPU_JPEG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "jpeg-common.h"
+
+#define HUFF_LOOKAHEAD 9 // number of bits huff_decode resolves with a single table lookup
+
+#define IDCT_LOW4_LAST_INDEX 9 // zigzag indices 0 to 9 are the top left 4x4 coefficients of a block
+
+#define ENTROPY_SEGMENT_PADDING 8 // zero bytes after the data of an EntropySegment, so loads of 8 bytes never overrun
+
+#define ARENA_ALIGNMENT 64              // alignment of every JpegCpuArena allocation, a cache line
+#define ARENA_HUGE_PAGE_SIZE (2u << 20) // size and alignment of a transparent huge page
+
+#define TABLE_CACHE_ENTRIES 16                // tables of each kind kept by a JpegCpuTableCache
+#define HUFFMAN_TABLE_KEY_SIZE (16 + 256)     // code counts and symbols of a DHT table
+#define QUANTIZATION_TABLE_KEY_SIZE (64 * 2)  // steps of a 16-bit DQT table
+
+/**
+ * Multipliers of the first (column) pass of the inverse DCT for each row of coefficients
+ */
+static const uint8_t IDCT_ROW_MULTIPLIERS[8] = {181, 251, 59, 213, 181, 71, 49, 25};
+
+/**
+ * Fold the quantization steps into the multipliers of the inverse DCT, so that coefficients are stored as decoded
+ * and scaled by a single multiplication in the first pass
+ */
+static inline void form_idct_prescale(QuantizationTable *q_table) {
+  for (int i = 0; i < 64; i++) {
+    q_table->prescale[i] = q_table->table[i] * IDCT_ROW_MULTIPLIERS[i >> 3];
+  }
+}
+
+/**
+ * Decoding tables derived from a HuffmanTable by build_huffman_lookup
+ */
+typedef struct HuffmanLookup {
+  // Indexed by the next HUFF_LOOKAHEAD bits of the bitstream: code length in the upper byte and symbol in the
+  // lower byte, or 0 if the code is longer than HUFF_LOOKAHEAD bits
+  uint16_t lookup[1 << HUFF_LOOKAHEAD];
+
+  int32_t maxcode[18];   // largest code of length k, -1 if there are no codes of that length
+  int32_t valoffset[18]; // huffval index of the first code of length k minus that code
+} HuffmanLookup;
+
+/**
+ * Huffman table and lookups built from the bytes of a DHT table definition
+ */
+typedef struct CachedHuffmanTable {
+  uint64_t hash;
+  uint32_t length; // bytes of key in use, 0 for an empty entry
+  uint8_t key[HUFFMAN_TABLE_KEY_SIZE];
+  HuffmanTable table;
+  HuffmanLookup lookup;
+} CachedHuffmanTable;
+
+/**
+ * Quantization table formed from the bytes of a DQT table definition, the length tells the precision apart
+ */
+typedef struct CachedQuantizationTable {
+  uint64_t hash;
+  uint32_t length;
+  uint8_t key[QUANTIZATION_TABLE_KEY_SIZE];
+  QuantizationTable table;
+} CachedQuantizationTable;
+
+/**
+ * Tables already built for earlier files, shared by the contexts of a batch (see cpu-jpeg-tables.c)
+ */
+struct JpegCpuTableCache {
+  pthread_mutex_t lock;
+  CachedHuffmanTable huffman[TABLE_CACHE_ENTRIES];
+  CachedQuantizationTable quantization[TABLE_CACHE_ENTRIES];
+  uint32_t next_huffman; // entries replaced by the next insertions
+  uint32_t next_quantization;
+};
+
+/**
+ * Inverse DCT output for a band of MCU rows, one plane per color component
+ */
+typedef struct SamplePlanes {
+  short *planes[3];       // NULL for components that are not in the image
+  uint32_t strides[3];    // shorts per row of each plane
+  uint32_t first_mcu_row; // MCU row stored at the top of the planes
+} SamplePlanes;
+
+/**
+ * Destination of converted pixel rows, either the whole image or the MCU row handed to the row callback
+ */
+typedef struct OutputRows {
+  uint8_t *planes[3];  // RGB, gray or Y rows, the U and V planes are only used by planar YUV and coefficient output
+  uint32_t strides[3]; // bytes per row of each plane
+  uint32_t first_line; // image line at the top of planes[0], the U and V planes start at row (first_line + 1) / 2
+} OutputRows;
+
+/**
+ * Quantized DCT coefficients of every block of a progressive image, built up scan by scan (see
+ * decode_progressive_scans). A block keeps its first count coefficients in zigzag order, as many as the output reads,
+ * and a bit per coefficient past those that only tells whether it is non-zero, which is what refinement scans need
+ * The buffers are reused from one image to the next
+ */
+typedef struct CoefficientStore {
+  short *coefficients;      // count coefficients per block, the blocks of each component in raster order
+  uint64_t *nonzero;        // bit k is set once coefficient k (count or more) of the block is non-zero
+  size_t coefficients_size; // shorts allocated at coefficients
+  size_t nonzero_size;      // blocks allocated at nonzero
+  uint32_t count;           // coefficients kept per block, with 1 or 64 there are no nonzero bits
+  uint32_t offsets[3];      // first block of each component
+  uint32_t strides[3];      // blocks per row of each component, covering its blocks in every (padded) MCU
+} CoefficientStore;
+
+/**
+ * Entropy coded segment of a scan without its stuffed bytes and RSTn markers, which is what the bit reader of the CPU
+ * decoder reads (see cpu-jpeg-destuff.c). The buffers are reused from one scan to the next
+ */
+typedef struct EntropySegment {
+  char *data;                    // destuffed bytes, followed by ENTROPY_SEGMENT_PADDING zero bytes
+  size_t size;                   // bytes allocated at data
+  uint32_t length;               // destuffed bytes in use
+  uint32_t *restart_offsets;     // offset in data of every restart interval, the first one at 0
+  uint32_t restart_count;        // restart intervals found, one more than the RSTn markers
+  uint32_t restart_capacity;     // offsets allocated at restart_offsets
+  uint32_t restarts_in_sequence; // the RSTn markers are numbered in sequence, so no interval is missing
+  char *end;                     // marker that ends the segment in the file data, or the end of the data
+} EntropySegment;
+
+/**
+ * Scratch memory for the buffers of one image, bumped out of a block that is kept from one image to the next (see
+ * cpu-jpeg-arena.c)
+ */
+typedef struct JpegCpuArena {
+  uint8_t *base;
+  size_t size;         // bytes at base
+  size_t used;         // bytes asked for since the last reset, including those that did not fit
+  uint32_t huge_pages; // back blocks of several huge pages with transparent huge pages
+} JpegCpuArena;
+
+/**
+ * Copy bytes from src to dst up to the first 0xFF, at most length bytes. dst may be written up to length bytes
+ * Returns the number of bytes before the first 0xFF, length if there is none
+ */
+typedef uint32_t (*copy_entropy_bytes_function)(const uint8_t *src, uint32_t length, uint8_t *dst);
+
+/**
+ * Entropy decoding and inverse DCT of the MCUs [first_mcu, end_mcu) into sample planes, specialised for the sampling
+ * layout of the image (see select_mcu_decoder)
+ * Returns 0 on success, -1 if an MCU is invalid
+ */
+typedef int (*mcu_decode_function)(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                                   SamplePlanes *samples, short *previous_dcs);
+
+/**
+ * All state of one CPU decoder, each worker thread owns one
+ */
+struct JpegCpuContext {
+  JpegDecompressor decompressor;
+  JpegInfo jpegInfo;
+  HuffmanLookup dc_huffman_lookups[MAX_HUFFMAN_TABLES];
+  HuffmanLookup ac_huffman_lookups[MAX_HUFFMAN_TABLES];
+
+  mcu_decode_function decode_mcus; // set at SOF for the sampling layout of the image
+
+  uint32_t num_threads; // threads that may work on a single image
+  uint32_t block_size;  // samples per side of a decoded block: 8 at full size, 4, 2 or 1 when scaling down
+
+  jpeg_cpu_row_callback row_callback; // receives the image one MCU row at a time if set
+  void *row_callback_data;
+  jpeg_cpu_header_callback header_callback; // sets up the output of every image from its header if set
+  void *header_callback_data;
+  JpegOutputFormat output_format;
+  uint32_t coefficient_count; // zigzag coefficients kept per block by coefficient output, 1 to 64
+  uint32_t dc_only;           // only the DC coefficient of each block is needed, set when decoding starts
+
+  uint8_t *output_pixels; // caller buffer the image is decoded into, NULL to decode into a buffer of our own
+  uint32_t output_pixels_stride;
+  size_t output_pixels_size;
+
+  JpegResize resize;   // crop and resize of the decoded pixels, width 0 unless set
+  JpegRegion region;   // rectangle of the full size image to decode, width 0 for the whole image
+  uint32_t line_limit; // lines of the output its consumer needs, the rest is left undecoded, 0 for all of them
+
+  JpegPyramidLevel pyramid[JPEG_PYRAMID_MAX_LEVELS]; // levels decoded from a single pass over the bitstream
+  uint32_t pyramid_levels;                           // levels in use, 0 to decode a single image
+
+  JpegCpuTableCache *table_cache; // shared with other contexts, NULL to build the tables of every file
+
+  uint32_t progressive; // the frame is progressive (SOF2), its scans are decoded into coefficient_store
+
+  uint8_t scan_components[3]; // color indices of the components of the current scan, in scan order
+  uint32_t scan_num_components;
+  CoefficientStore coefficient_store; // scans of a progressive image decoded so far
+  EntropySegment entropy_segment;     // destuffed data of the scan being decoded
+  JpegCpuArena arena;                 // buffers of the image being decoded, reset by jpeg_cpu_scale
+};
+
+/**
+ * Resampling of one axis by the resize stage: output pixel i is the weighted sum of counts[i] source pixels from
+ * starts[i] onwards, with fixed point weights that add up to one
+ */
+typedef struct ResizeAxis {
+  uint32_t *starts;
+  uint32_t *counts;
+  uint16_t *weights; // max_taps per output pixel
+  uint32_t max_taps; // largest count
+} ResizeAxis;
+
+/**
+ * Crop and resize of one image, fed with its pixel rows by resize_rows (see cpu-jpeg-resize.c)
+ */
+typedef struct JpegCpuResizer {
+  ResizeAxis horizontal;
+  ResizeAxis vertical;
+  uint32_t width; // size of the output image
+  uint32_t height;
+  uint32_t pixel_size; // bytes per pixel of the source and output rows
+  uint16_t *ring;      // the last vertical.max_taps source rows, resampled horizontally
+  uint32_t *sums;      // vertical sums of one output row
+  uint32_t next_row;   // next output row to produce
+
+  // Where output rows go, set by the caller: the rows of the image stride bytes apart, or a single row handed to
+  // row_callback when it is set
+  uint8_t *pixels;
+  uint32_t stride;
+  jpeg_cpu_row_callback row_callback;
+  void *row_callback_data;
+} JpegCpuResizer;
+
+/**
+ * Inverse DCT of one 8x8 block of coefficients as decoded, in place, dequantized with q_table
+ */
+typedef void (*idct_function)(short *buffer, const QuantizationTable *q_table);
+
+/**
+ * YCbCr to RGB conversion of one pixel row, chroma is upsampled horizontally by 1 << h_shift
+ * There is one function per packed pixel format (RGB, BGR and RGBA), which only differ in how a pixel is stored
+ */
+typedef void (*color_convert_function)(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                                       uint8_t *rgb, uint32_t width);
+
+/**
+ * Level shift and clamp one pixel row of a grayscale image, one byte per pixel
+ */
+typedef void (*gray_convert_function)(const short *y_row, uint8_t *gray, uint32_t width);
+
+// Load 8 bytes of the bitstream as a big endian word
+static inline uint64_t load_bit_word(const char *ptr) {
+  uint64_t word;
+  memcpy(&word, ptr, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+// Make sure at least num_bits (at most 57) bits are available in the bit reservoir
+// The data is destuffed (see load_entropy_segment), so whole bytes are loaded without looking at them. Past its end
+// the reservoir is topped up with zeros, and ENTROPY_SEGMENT_PADDING covers loads that start just before the end
+static inline void fill_bit_buffer(JpegDecompressor *d, uint32_t num_bits) {
+  if (d->bits_left >= num_bits) {
+    return;
+  }
+
+  uint32_t num_bytes = (64 - d->bits_left) >> 3;
+  if (d->ptr >= d->data + d->length) {
+    d->bits_left += num_bytes << 3;
+    d->padding_bits += num_bytes << 3;
+    return;
+  }
+
+  uint64_t word = load_bit_word(d->ptr) & (~0ULL << (64 - (num_bytes << 3)));
+  d->bit_reservoir |= word >> d->bits_left;
+  d->bits_left += num_bytes << 3;
+  d->ptr += num_bytes;
+}
+
+static inline int get_num_bits(JpegDecompressor *d, uint32_t num_bits) {
+  int bits = 0;
+  if (num_bits == 0) {
+    return bits;
+  }
+
+  fill_bit_buffer(d, num_bits);
+
+  bits = d->bit_reservoir >> (64 - num_bits);
+  d->bit_reservoir <<= num_bits;
+  d->bits_left -= num_bits;
+  return bits;
+}
+
+static inline uint8_t huff_decode(JpegDecompressor *d, HuffmanTable *h_table, HuffmanLookup *lookup) {
+  fill_bit_buffer(d, 16);
+
+  // Fast path: codes of up to HUFF_LOOKAHEAD bits are resolved with a single lookup
+  uint16_t entry = lookup->lookup[d->bit_reservoir >> (64 - HUFF_LOOKAHEAD)];
+  if (entry != 0) {
+    uint32_t length = entry >> 8;
+    d->bit_reservoir <<= length;
+    d->bits_left -= length;
+    return entry & 0xFF;
+  }
+
+  // Slow path: compare against the largest code of each length, canonical codes of the same length are consecutive
+  uint32_t length = HUFF_LOOKAHEAD + 1;
+  int32_t code = d->bit_reservoir >> (64 - length);
+  while (length <= 16 && code > lookup->maxcode[length]) {
+    length++;
+    code = d->bit_reservoir >> (64 - length);
+  }
+  if (length > 16) {
+    d->bit_reservoir <<= 16;
+    d->bits_left -= 16;
+    return -1;
+  }
+
+  d->bit_reservoir <<= length;
+  d->bits_left -= length;
+  return h_table->huffval[code + lookup->valoffset[length]];
+}
+
+char *load_entropy_segment(JpegCpuContext *ctx);
+void report_mcu_error(JpegDecompressor *d, const char *format, ...);
+int decode_dc(JpegCpuContext *ctx, JpegDecompressor *d, ColorComponentInfo *component, short *buffer,
+              short *previous_dc);
+int decode_block(JpegCpuContext *ctx, JpegDecompressor *d, int component_index, short *buffer, short *previous_dc);
+void free_sample_planes(JpegCpuContext *ctx, SamplePlanes *samples);
+int alloc_sample_planes(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t mcu_rows);
+idct_function select_idct(JpegCpuContext *ctx);
+void transform_block(idct_function idct, const QuantizationTable *q_table, uint32_t block_size, short *buffer,
+                     int last_index, short *block, uint32_t plane_stride);
+void store_coefficients(JpegCpuContext *ctx, const QuantizationTable *q_table, const short *buffer,
+                        short *coefficients);
+int skip_mcus(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu, short *previous_dcs);
+int entropy_decode_mcus(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                        short *blocks, int *last_indices, short *previous_dcs);
+void transform_mcus(JpegCpuContext *ctx, uint32_t first_mcu, uint32_t end_mcu, const short *blocks,
+                    const int *last_indices, SamplePlanes *samples);
+void output_region(JpegCpuContext *ctx, uint32_t *left, uint32_t *top, uint32_t *right, uint32_t *bottom);
+uint32_t output_block_lines(JpegCpuContext *ctx);
+uint32_t output_line_count(JpegCpuContext *ctx);
+size_t output_size(JpegCpuContext *ctx, uint32_t line_count);
+void init_output_rows(JpegCpuContext *ctx, uint8_t *pixels, uint32_t first_line, uint32_t line_count,
+                      OutputRows *output);
+void convert_mcu_rows(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t first_row, uint32_t end_row,
+                      OutputRows *output);
+void run_on_threads(uint32_t num_threads, void *(*function)(void *), void *arg);
+void emit_mcu_row(JpegCpuContext *ctx, OutputRows *output);
+int read_next_marker(JpegCpuContext *ctx);
+
+void init_idct_dispatch(void);
+void inverse_dct_component_scalar(short *buffer, const QuantizationTable *q_table);
+void inverse_dct_component_low4_scalar(short *buffer, const QuantizationTable *q_table);
+short inverse_dct_dc(short dc, const QuantizationTable *q_table);
+void inverse_dct_component_4x4(short *buffer, const QuantizationTable *q_table);
+void inverse_dct_component_2x2(short *buffer, const QuantizationTable *q_table);
+void inverse_dct_component_1x1(short *buffer, const QuantizationTable *q_table);
+idct_function scaled_idct_function(uint32_t block_size);
+
+void init_color_dispatch(void);
+void ycbcr_to_rgb_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                             uint8_t *rgb, uint32_t width);
+void ycbcr_to_bgr_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                             uint8_t *bgr, uint32_t width);
+void ycbcr_to_rgba_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                              uint8_t *rgba, uint32_t width);
+void gray_row_scalar(const short *y_row, uint8_t *gray, uint32_t width);
+void gray_to_pixels_row(const short *y_row, uint8_t *pixels, uint32_t width, uint32_t pixel_size);
+
+int init_resizer(JpegCpuResizer *resizer, const JpegResize *resize, uint32_t pixel_size, uint32_t source_width,
+                 uint32_t source_height, double crop_x, double crop_y, double crop_width, double crop_height);
+void free_resizer(JpegCpuResizer *resizer);
+uint32_t resizer_source_rows(JpegCpuResizer *resizer);
+void resize_rows(void *user_data, const uint8_t *rows, uint32_t first_row, uint32_t row_count, uint32_t width,
+                 uint32_t stride);
+
+void init_destuff_dispatch(void);
+uint32_t copy_entropy_bytes_scalar(const uint8_t *src, uint32_t length, uint8_t *dst);
+int destuff_entropy_segment(EntropySegment *segment, const char *start, const char *end);
+void free_entropy_segment(EntropySegment *segment);
+
+int arena_reset(JpegCpuArena *arena, size_t size);
+void *arena_alloc(JpegCpuArena *arena, size_t size);
+void arena_free(JpegCpuArena *arena, void *ptr);
+void free_arena(JpegCpuArena *arena);
+
+int find_cached_huffman_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length, HuffmanTable *h_table,
+                              HuffmanLookup *lookup);
+void cache_huffman_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length, const HuffmanTable *h_table,
+                         const HuffmanLookup *lookup);
+int find_cached_quantization_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length,
+                                   QuantizationTable *q_table);
+void cache_quantization_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length,
+                              const QuantizationTable *q_table);
+
+void free_coefficient_store(CoefficientStore *store);
+int decode_progressive_scans(JpegCpuContext *ctx);
+int decode_mcus_progressive(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                            SamplePlanes *samples, short *previous_dcs);
+void load_stored_mcus(JpegCpuContext *ctx, uint32_t first_mcu, uint32_t end_mcu, short *blocks, int *last_indices);
+
+int decompress_speculative(JpegCpuContext *ctx, OutputRows *output);
+
+int decompress_pipelined(JpegCpuContext *ctx, uint8_t *pixels, uint32_t mcu_rows, uint32_t first_mcu_row,
+                         uint32_t first_mcu_col, uint32_t end_mcu_col);
+
+extern idct_function inverse_dct_component;
+extern idct_function inverse_dct_component_low4;
+extern color_convert_function ycbcr_to_rgb_row;
+extern color_convert_function ycbcr_to_bgr_row;
+extern color_convert_function ycbcr_to_rgba_row;
+extern gray_convert_function gray_row;
+extern copy_entropy_bytes_function copy_entropy_bytes;
+
+#endif // _CPU_JPEG_H
@@ -10,12 +10,19 @@
 #define NR_TASKLETS 16
 #endif
 
+#define MCU_BUFFER_LENGTH 16776960 // shorts of MRAM holding the decoded blocks, split between the tasklets
+
 typedef struct JpegInfoDpu {
   uint32_t mcu_end_index[NR_TASKLETS];   // end index of each tasklet in the 2D MRAM MCU buffer
   uint32_t mcu_start_index[NR_TASKLETS]; // start index of each tasklet in the 2D MRAM MCU buffer
   int dc_offset[NR_TASKLETS - 1][3];     // offset to the 3 DC coefficients from tasklet i to tasklet i + 1
   uint32_t rows_per_tasklet;
   uint32_t sum_rgb[3];
+  uint32_t output_format;     // JpegOutputFormat requested by the host
+  uint32_t coefficient_count; // zigzag coefficients kept per block by coefficient output, a multiple of 4 for DMA
+  uint32_t coefficient_size;  // shorts of packed coefficients of the whole image
+  uint32_t plane_start;       // planar YUV output stages the U and V planes and the first Y rows from this index on
+  uint32_t chroma_size;       // shorts of each of the U and V planes of planar YUV output
 } JpegInfoDpu;
 
 void init_file_reader_index(JpegDecompressor *d);
@@ -35,6 +42,11 @@ int process_SOS(JpegDecompressor *d);
 
 void decode_bitstream(JpegDecompressor *d);
 void inverse_dct_convert(JpegDecompressor *d);
+void pack_coefficients(JpegDecompressor *d);
+void move_coefficients(JpegDecompressor *d);
+void move_luma_blocks(JpegDecompressor *d, int first);
+void gather_luma_plane(JpegDecompressor *d, int first);
+void move_yuv_planes(JpegDecompressor *d);
 
 void crop(JpegDecompressor *d, int start_x, int start_y, int new_width, int new_height);
 void jpeg_scale(JpegDecompressor *d, int x_scale_factor, int y_scale_factor);
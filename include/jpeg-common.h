@@ -1,6 +1,7 @@
 #ifndef _JPEG_CPU_H
 #define _JPEG_CPU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAX_HUFFMAN_TABLES 2
@@ -67,6 +68,7 @@ typedef struct QuantizationTable {
   uint8_t exists;
 
   uint32_t table[64];
+  int32_t prescale[64]; // CPU decoder only: table[] times the first pass multiplier of its inverse DCT
 } QuantizationTable;
 
 /**
@@ -109,6 +111,12 @@ typedef struct JpegDecompressor {
   // bit buffer
   uint32_t bit_buffer;
   uint32_t bits_left;
+
+  // 64-bit bit reservoir used by the CPU decoder in place of bit_buffer, refilled several bytes at a time
+  uint64_t bit_reservoir;
+  uint32_t padding_bits; // zero bits the CPU decoder appended to bit_reservoir past the end of the data
+  uint32_t quiet;        // set when the CPU decoder decodes speculatively, invalid data is not reported
+
 } JpegDecompressor;
 
 typedef struct JpegInfo {
@@ -151,7 +159,140 @@ typedef struct JpegInfo {
   uint32_t max_v_samp_factor; // maximum value of vertical sampling factors amongst all color components
 } JpegInfo;
 
-void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer);
+// Opaque decoder state of the CPU path, defined in cpu-jpeg.h
+typedef struct JpegCpuContext JpegCpuContext;
+// Opaque cache of decoded tables that contexts can share, defined in cpu-jpeg.h
+typedef struct JpegCpuTableCache JpegCpuTableCache;
+
+/**
+ * What the decoders turn an image into
+ *
+ * Coefficient output skips the inverse DCT and color conversion. It holds one plane per component, each with the
+ * blocks of the component in raster order, every block of the padded MCUs included. A block is a run of int16
+ * coefficients in zigzag order, truncated to the count set with jpeg_cpu_set_coefficient_count
+ */
+typedef enum JpegOutputFormat {
+  JPEG_OUTPUT_RGB,                    // 3 bytes of RGB per pixel, 1 byte of gray for single-component images
+  JPEG_OUTPUT_LUMA,                   // 1 byte of Y per pixel, chroma is entropy decoded to stay in sync only
+  JPEG_OUTPUT_YUV420,                 // planar Y, then U and V at half the width and height
+  JPEG_OUTPUT_COEFFICIENTS,           // DCT coefficients multiplied by their quantization steps
+  JPEG_OUTPUT_QUANTIZED_COEFFICIENTS, // DCT coefficients as coded in the file
+  JPEG_OUTPUT_BGR,                    // 3 bytes of BGR per pixel, gray is repeated in every channel
+  JPEG_OUTPUT_RGBA,                   // 4 bytes of RGB and an opaque alpha per pixel, gray is repeated like BGR
+} JpegOutputFormat;
+
+static inline int is_coefficient_output(uint32_t format) {
+  return format == JPEG_OUTPUT_COEFFICIENTS || format == JPEG_OUTPUT_QUANTIZED_COEFFICIENTS;
+}
+
+// Formats holding color converted pixels, which only differ in the order and number of bytes of a pixel
+static inline int is_rgb_output(uint32_t format) {
+  return format == JPEG_OUTPUT_RGB || format == JPEG_OUTPUT_BGR || format == JPEG_OUTPUT_RGBA;
+}
+
+/**
+ * Receives pixel rows [first_row, first_row + row_count) of the decoded image, stride bytes apart (see
+ * JpegOutputFormat). With planar YUV the Y rows are followed by the U rows and then the V rows that cover them:
+ * chroma rows (first_row + 1) / 2 up to (first_row + row_count + 1) / 2, (stride + 1) / 2 bytes each
+ * With coefficient output a row is a row of luminance blocks and width counts blocks. The block rows of the other
+ * components for the same MCU row follow, with as many blocks as their sampling factors give them
+ * The rows are only valid during the call
+ */
+typedef void (*jpeg_cpu_row_callback)(void *user_data, const uint8_t *rows, uint32_t first_row, uint32_t row_count,
+                                      uint32_t width, uint32_t stride);
+
+/**
+ * What jpeg_cpu_probe learns about a file from its markers, without decoding the image
+ */
+typedef struct JpegProbeInfo {
+  uint32_t valid;       // the markers up to SOS are well formed
+  uint32_t progressive; // SOF2 frame, otherwise baseline
+  uint32_t image_width;
+  uint32_t image_height;
+  uint32_t num_color_components;
+  uint8_t h_samp_factors[3];
+  uint8_t v_samp_factors[3];
+  uint32_t restart_interval; // MCUs per restart interval, 0 without restart markers
+  uint64_t entropy_offset;   // offset of the entropy coded data of the first scan in the file
+} JpegProbeInfo;
+
+/**
+ * Called by jpeg_cpu_scale once the markers of a file are read and before anything is decoded, with what
+ * jpeg_cpu_probe would report, so that the caller can size and set the output buffer or pyramid of the image
+ * The info is only valid during the call
+ */
+typedef void (*jpeg_cpu_header_callback)(void *user_data, JpegCpuContext *ctx, const JpegProbeInfo *info);
+
+/**
+ * Resampling of the resize stage of the CPU decoder
+ */
+typedef enum JpegResizeFilter {
+  JPEG_RESIZE_AREA,     // average of the source pixels an output pixel covers, meant for shrinking
+  JPEG_RESIZE_BILINEAR, // interpolation of the 2x2 source pixels around the center of an output pixel
+} JpegResizeFilter;
+
+/**
+ * Crop and resize the CPU decoder applies to the pixel rows as it decodes them (see jpeg_cpu_set_resize)
+ */
+typedef struct JpegResize {
+  uint32_t width; // size of the output image, 0 to decode the image as it is
+  uint32_t height;
+  JpegResizeFilter filter;
+  uint32_t center_crop; // keep the largest rectangle in the middle of the image with the aspect ratio of the output
+  uint32_t crop_x;      // otherwise keep this rectangle of the full size image, all of it if crop_width is 0
+  uint32_t crop_y;
+  uint32_t crop_width;
+  uint32_t crop_height;
+} JpegResize;
+
+/**
+ * Rectangle of the full size image the CPU decoder decodes instead of the whole image (see jpeg_cpu_set_region)
+ */
+typedef struct JpegRegion {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width; // 0 to decode the whole image
+  uint32_t height;
+} JpegRegion;
+
+#define JPEG_PYRAMID_MAX_LEVELS 4 // one level per DCT scale: 1/1, 1/2, 1/4 and 1/8
+
+/**
+ * One level of a pyramid decode (see jpeg_cpu_set_pyramid): the image at 1/scale_denom of its size, decoded into a
+ * buffer of the caller of size bytes in rows stride bytes apart
+ */
+typedef struct JpegPyramidLevel {
+  uint32_t scale_denom; // 1, 2, 4 or 8, other values are rounded down like jpeg_cpu_set_scale does
+  uint8_t *pixels;
+  uint32_t stride;
+  size_t size;
+} JpegPyramidLevel;
+
+#define JPEG_PROBE_NEED_MORE 1 // jpeg_cpu_probe ran out of data before SOS, probe again with more of the file
+
+void jpeg_cpu_init(void);
+JpegCpuContext *jpeg_cpu_create_context(void);
+void jpeg_cpu_destroy_context(JpegCpuContext *ctx);
+void jpeg_cpu_set_threads(JpegCpuContext *ctx, uint32_t num_threads);
+void jpeg_cpu_set_scale(JpegCpuContext *ctx, uint32_t scale_denom);
+void jpeg_cpu_set_row_callback(JpegCpuContext *ctx, jpeg_cpu_row_callback callback, void *user_data);
+void jpeg_cpu_set_header_callback(JpegCpuContext *ctx, jpeg_cpu_header_callback callback, void *user_data);
+void jpeg_cpu_set_output_format(JpegCpuContext *ctx, JpegOutputFormat format);
+void jpeg_cpu_set_coefficient_count(JpegCpuContext *ctx, uint32_t count);
+void jpeg_cpu_set_output_buffer(JpegCpuContext *ctx, uint8_t *pixels, uint32_t stride, size_t size);
+void jpeg_cpu_set_resize(JpegCpuContext *ctx, const JpegResize *resize);
+void jpeg_cpu_set_region(JpegCpuContext *ctx, const JpegRegion *region);
+void jpeg_cpu_set_pyramid(JpegCpuContext *ctx, const JpegPyramidLevel *levels, uint32_t count);
+JpegCpuTableCache *jpeg_cpu_create_table_cache(void);
+void jpeg_cpu_destroy_table_cache(JpegCpuTableCache *cache);
+void jpeg_cpu_set_table_cache(JpegCpuContext *ctx, JpegCpuTableCache *cache);
+void jpeg_cpu_set_huge_pages(JpegCpuContext *ctx, uint32_t enable);
+void jpeg_cpu_scale(JpegCpuContext *ctx, uint64_t file_length, char *filename, char *buffer);
+int jpeg_cpu_probe(JpegCpuContext *ctx, uint64_t file_length, char *buffer, JpegProbeInfo *info);
+void jpeg_cpu_output_geometry(JpegCpuContext *ctx, const JpegProbeInfo *info, uint32_t *width, uint32_t *height,
+                              uint32_t *pixel_size);
+void jpeg_cpu_pyramid_geometry(JpegCpuContext *ctx, const JpegProbeInfo *info, uint32_t scale_denom, uint32_t *width,
+                               uint32_t *height, uint32_t *pixel_size);
 
 /**
  * Helper array for filling in quantization table in zigzag order
@@ -2,6 +2,7 @@
 #define _JPEG_HOST__H
 
 #include "common.h"
+#include "jpeg-common.h"
 
 #ifndef MAX_FILES_PER_DPU
 #define MAX_FILES_PER_DPU 64
@@ -12,6 +13,7 @@
 #endif
 
 #define MAX_INPUT_LENGTH MEGABYTE(16)
+#define PROBE_READ_LENGTH KILOBYTE(64) // bytes of each file read by --probe, unless its markers run past them
 
 enum { PROG_OK = 0, PROG_INVALID_INPUT, PROG_BUFFER_TOO_SMALL, PROG_OUTPUT_ERROR, PROG_FAULT };
 
@@ -19,6 +21,8 @@ enum option_flags {
   OPTION_FLAG_COUNT_MATCHES,
   OPTION_FLAG_OUT_BYTE,
   OPTION_FLAG_MULTIPLE_FILES, // multiple files per DPU
+  OPTION_FLAG_PROBE,          // only parse the markers of each file and report them
+  OPTION_FLAG_HUGE_PAGES,     // back the scratch memory of the CPU decoder with transparent huge pages
 };
 
 struct jpeg_options {
@@ -33,6 +37,14 @@ struct jpeg_options {
   uint32_t horizontal_flip;
   uint32_t num_dpus;
   uint32_t num_ranks;
+  uint32_t num_threads;       /* CPU decoding threads, 0 for one per core */
+  uint32_t image_threads;     /* CPU threads decoding a single image */
+  uint32_t output_format;     /* JpegOutputFormat of the decoded images */
+  uint32_t coefficient_count; /* zigzag coefficients per block kept by coefficient output */
+  JpegResize resize;          /* crop and resize of the CPU decoder */
+  JpegRegion region;          /* part of each image the CPU decoder decodes, when cropping without resizing */
+  uint32_t pyramid_denoms[JPEG_PYRAMID_MAX_LEVELS]; /* scales of the pyramid levels decoded by the CPU */
+  uint32_t pyramid_levels;                          /* 0 to decode a single image */
 } __attribute__((aligned(8)));
 
 typedef struct file_stats {
@@ -74,13 +86,17 @@ typedef struct dpu_settings_t {
   char *filename;
   uint32_t scale_width;
   uint32_t horizontal_flip;
+  uint32_t output_format;
+  uint32_t coefficient_count;
 } dpu_settings_t;
 
 typedef struct dpu_inputs_t {
   uint64_t file_length;
   uint32_t scale_width;
   uint32_t horizontal_flip;
-} dpu_inputs_t;
+  uint32_t output_format;     // JpegOutputFormat
+  uint32_t coefficient_count; // zigzag coefficients per block kept by coefficient output
+} __attribute__((aligned(8))) dpu_inputs_t;
 
 typedef struct dpu_output_t {
   uint16_t image_width;
@@ -88,6 +104,10 @@ typedef struct dpu_output_t {
   uint32_t padding;
   uint32_t mcu_width_real;
   uint32_t sum_rgb[3];
-} dpu_output_t;
+  uint32_t num_color_components; // 1 for grayscale and luma-only output, one luma block per block position
+  uint32_t coefficient_count;    // coefficients per block of coefficient output, a multiple of 4
+  uint32_t coefficient_bytes;    // coefficient output fills this many bytes of MCU_buffer (see JpegOutputFormat)
+  uint32_t plane_bytes;          // planar YUV output fills this many bytes of MCU_buffer with the Y, U and V planes
+} __attribute__((aligned(8))) dpu_output_t;
 
 #endif /* _JPEG_HOST__H */
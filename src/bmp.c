@@ -17,7 +17,8 @@ static char *form_bmp_filename(const char *filename, int is_dpu) {
   return filename_copy;
 }
 
-static void initialize_window_info_header(BmpObject *image, uint32_t image_width, uint32_t image_height) {
+static void initialize_window_info_header(BmpObject *image, uint32_t image_width, uint32_t image_height,
+                                          uint32_t image_padding) {
   image->win_header.width = image_width;
   image->win_header.height = image_height;
 
@@ -25,8 +26,9 @@ static void initialize_window_info_header(BmpObject *image, uint32_t image_width
   image->win_header.planes = 1;
   image->win_header.bits_per_pixel = 24;
   image->win_header.compression = BI_RGB;
+  // Every row is padded to a multiple of 4 bytes
   image->win_header.length =
-      image->win_header.width * image->win_header.height * (image->win_header.bits_per_pixel >> 3);
+      (image->win_header.width * (image->win_header.bits_per_pixel >> 3) + image_padding) * image->win_header.height;
   image->win_header.hres = 1;
   image->win_header.vres = 1;
   image->win_header.palette = 0;
@@ -40,7 +42,12 @@ static void initialize_bmp_header(BmpObject *image) {
   image->header.size = image->header.data + image->win_header.length;
 }
 
-static void initialize_bmp_body(BmpObject *image, uint32_t image_padding, uint32_t mcu_width, short *MCU_buffer) {
+static void initialize_bmp_body(BmpObject *image, uint32_t image_padding, uint32_t mcu_width,
+                                uint32_t num_color_components, short *MCU_buffer) {
+  // Grayscale blocks only hold luminance, which goes to all three channels, and are packed one per block position
+  uint32_t slots = num_color_components == 1 ? 1 : 3;
+  uint32_t g_offset = num_color_components == 1 ? 0 : 1;
+  uint32_t b_offset = num_color_components == 1 ? 0 : 2;
   uint8_t *ptr = (uint8_t *) malloc(image->win_header.height * (image->win_header.width * 3 + image_padding));
   image->data = ptr;
 
@@ -53,9 +60,34 @@ static void initialize_bmp_body(BmpObject *image, uint32_t image_padding, uint32
       uint32_t pixel_column = x % 8;
       uint32_t mcu_index = mcu_row * mcu_width + mcu_column;
       uint32_t pixel_index = pixel_row * 8 + pixel_column;
-      ptr[0] = MCU_buffer[(mcu_index * 3 + 2) * 64 + pixel_index];
-      ptr[1] = MCU_buffer[(mcu_index * 3 + 1) * 64 + pixel_index];
-      ptr[2] = MCU_buffer[(mcu_index * 3 + 0) * 64 + pixel_index];
+      ptr[0] = MCU_buffer[(mcu_index * slots + b_offset) * 64 + pixel_index];
+      ptr[1] = MCU_buffer[(mcu_index * slots + g_offset) * 64 + pixel_index];
+      ptr[2] = MCU_buffer[(mcu_index * slots + 0) * 64 + pixel_index];
+      ptr += 3;
+    }
+
+    for (uint32_t i = 0; i < image_padding; i++) {
+      ptr[0] = 0;
+      ptr++;
+    }
+  }
+}
+
+static void initialize_bmp_body_rgb(BmpObject *image, uint32_t image_padding, uint32_t stride,
+                                    uint32_t bytes_per_pixel, uint8_t *pixels) {
+  uint8_t *ptr = (uint8_t *) malloc(image->win_header.height * (image->win_header.width * 3 + image_padding));
+  image->data = ptr;
+  // Grayscale pixels are a single byte, which goes to all three channels
+  uint32_t g_offset = bytes_per_pixel == 1 ? 0 : 1;
+  uint32_t b_offset = bytes_per_pixel == 1 ? 0 : 2;
+
+  for (int y = image->win_header.height - 1; y >= 0; y--) {
+    uint8_t *row = &pixels[y * stride];
+
+    for (int x = 0; x < image->win_header.width; x++) {
+      ptr[0] = row[x * bytes_per_pixel + b_offset];
+      ptr[1] = row[x * bytes_per_pixel + g_offset];
+      ptr[2] = row[x * bytes_per_pixel + 0];
       ptr += 3;
     }
 
@@ -83,32 +115,37 @@ static int write_bmp_to_file(const char *filename, BmpObject *picture) {
   return 0;
 }
 
-static int write_bmp(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                     uint32_t mcu_width, short *MCU_buffer, int is_dpu) {
-  BmpObject image;
-
-  initialize_window_info_header(&image, image_width, image_height);
-  initialize_bmp_header(&image);
-  initialize_bmp_body(&image, image_padding, mcu_width, MCU_buffer);
-
+static int write_bmp(const char *filename, BmpObject *image, int is_dpu) {
   char *filename_dpu = form_bmp_filename(filename, is_dpu);
   printf("Filename: %s\n", filename_dpu);
 
-  int result = write_bmp_to_file(filename_dpu, &image);
-  free(image.data);
+  int result = write_bmp_to_file(filename_dpu, image);
+  free(image->data);
   free(filename_dpu);
 
   return result;
 }
 
 int write_bmp_cpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer) {
-  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, MCU_buffer, 0);
+                  uint32_t stride, uint32_t bytes_per_pixel, uint8_t *pixels) {
+  BmpObject image;
+
+  initialize_window_info_header(&image, image_width, image_height, image_padding);
+  initialize_bmp_header(&image);
+  initialize_bmp_body_rgb(&image, image_padding, stride, bytes_per_pixel, pixels);
+
+  return write_bmp(filename, &image, 0);
 }
 
 int write_bmp_dpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer) {
-  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, MCU_buffer, 1);
+                  uint32_t mcu_width, uint32_t num_color_components, short *MCU_buffer) {
+  BmpObject image;
+
+  initialize_window_info_header(&image, image_width, image_height, image_padding);
+  initialize_bmp_header(&image);
+  initialize_bmp_body(&image, image_padding, mcu_width, num_color_components, MCU_buffer);
+
+  return write_bmp(filename, &image, 1);
 }
 
 /*
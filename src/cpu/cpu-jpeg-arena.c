@@ -0,0 +1,99 @@
+#define _DEFAULT_SOURCE // needed for posix_memalign and madvise
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Scratch memory of the CPU decoder for the buffers of one image: sample planes, rows of pixels, queues of blocks.
+ *
+ * Every context owns an arena, a single block that allocations are bumped out of and that is handed back as a whole
+ * when the next image starts. The block stays mapped from image to image, so a batch of small images no longer goes
+ * through malloc and free and fresh page faults for every one of them. The helper threads of a context allocate from
+ * the same arena, which is why the bump is atomic, but only the thread decoding the image resets it.
+ *
+ * Allocations that do not fit come from posix_memalign instead. Everything asked for counts towards the size of the
+ * block, so the next reset grows it to what the last image needed and the arena settles on the largest image of the
+ * batch. Memory from the arena is ARENA_ALIGNMENT aligned, ready for aligned SIMD loads.
+ */
+
+static void *aligned_alloc_bytes(size_t size, size_t alignment) {
+  void *ptr;
+  return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+static void free_arena_block(JpegCpuArena *arena) {
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+}
+
+/**
+ * Start a new image: give back everything allocated from the arena, and grow its block to at least size bytes, or to
+ * what was asked for since the last reset if that is more
+ * Returns 0 on success, -1 if the block could not be grown, allocations then all come from posix_memalign
+ */
+int arena_reset(JpegCpuArena *arena, size_t size) {
+  if (size < arena->used) {
+    size = arena->used;
+  }
+  arena->used = 0;
+  if (size <= arena->size) {
+    return 0;
+  }
+
+  // Huge pages only pay off for blocks that span several of them
+  size_t alignment = ARENA_ALIGNMENT;
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (arena->huge_pages && size >= ARENA_HUGE_PAGE_SIZE) {
+    alignment = ARENA_HUGE_PAGE_SIZE;
+    size = (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+  }
+
+  free_arena_block(arena);
+  arena->base = (uint8_t *) aligned_alloc_bytes(size, alignment);
+  if (arena->base == NULL) {
+    return -1;
+  }
+  arena->size = size;
+#ifdef MADV_HUGEPAGE
+  if (alignment == ARENA_HUGE_PAGE_SIZE) {
+    // Only a hint, the block works the same with normal pages
+    madvise(arena->base, size, MADV_HUGEPAGE);
+  }
+#endif
+  return 0;
+}
+
+/**
+ * Allocate size bytes, ARENA_ALIGNMENT aligned, that stay valid until the next reset. Safe to call from several
+ * threads at once
+ * Returns NULL if out of memory
+ */
+void *arena_alloc(JpegCpuArena *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  size_t offset = __atomic_fetch_add(&arena->used, size, __ATOMIC_RELAXED);
+  if (arena->base != NULL && offset + size <= arena->size) {
+    return arena->base + offset;
+  }
+  return aligned_alloc_bytes(size, ARENA_ALIGNMENT);
+}
+
+/**
+ * Free memory from arena_alloc. Memory within the block only comes back at the next reset
+ */
+void arena_free(JpegCpuArena *arena, void *ptr) {
+  uint8_t *bytes = (uint8_t *) ptr;
+  if (arena->base != NULL && bytes >= arena->base && bytes < arena->base + arena->size) {
+    return;
+  }
+  free(ptr);
+}
+
+void free_arena(JpegCpuArena *arena) {
+  free_arena_block(arena);
+  memset(arena, 0, sizeof(JpegCpuArena));
+}
@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "cpu-jpeg.h"
+
+/*
+ * YCbCr to RGB conversion of the CPU decoder, fused with nearest neighbour upsampling of the chroma planes.
+ *
+ * A call converts one pixel row of an MCU row. Chroma components always have sampling factors of 1, so the chroma
+ * row is either used as is (4:4:4) or every chroma sample covers two luma samples (4:2:2 and 4:2:0), which is
+ * h_shift. Vertical upsampling is done by the caller handing the same chroma row to two consecutive calls.
+ *
+ * https://en.wikipedia.org/wiki/YUV Y'UV444 to RGB888 conversion, integer only with the same constants as the DPU
+ * version. Results are computed in 32 bits and truncated to short before clamping, exactly like the scalar code.
+ *
+ * Grayscale images have no chroma to convert, their luma rows are only level shifted and clamped to one byte per pixel,
+ * or repeated in every channel when the caller asks for BGR or RGBA pixels.
+ */
+
+color_convert_function ycbcr_to_rgb_row = ycbcr_to_rgb_row_scalar;
+color_convert_function ycbcr_to_bgr_row = ycbcr_to_bgr_row_scalar;
+color_convert_function ycbcr_to_rgba_row = ycbcr_to_rgba_row_scalar;
+gray_convert_function gray_row = gray_row_scalar;
+
+static inline uint8_t clamp_pixel(short value) {
+  if (value < 0) {
+    return 0;
+  }
+  if (value > 255) {
+    return 255;
+  }
+  return value;
+}
+
+/**
+ * Conversion of one pixel row into the packed pixel format format, instantiated once per format so that the format
+ * checks are resolved at compile time
+ */
+static inline __attribute__((always_inline)) void ycbcr_to_pixels_scalar(const short *y_row, const short *cb_row,
+                                                                          const short *cr_row, uint32_t h_shift,
+                                                                          uint8_t *pixels, uint32_t width,
+                                                                          JpegOutputFormat format) {
+  uint32_t pixel_size = format == JPEG_OUTPUT_RGBA ? 4 : 3;
+  uint32_t r_offset = format == JPEG_OUTPUT_BGR ? 2 : 0;
+  uint32_t b_offset = 2 - r_offset;
+
+  for (uint32_t x = 0; x < width; x++) {
+    int cb = cb_row[x >> h_shift];
+    int cr = cr_row[x >> h_shift];
+
+    short r = y_row[x] + ((45 * cr) >> 5) + 128;
+    short g = y_row[x] - ((11 * cb + 23 * cr) >> 5) + 128;
+    short b = y_row[x] + ((113 * cb) >> 6) + 128;
+
+    pixels[r_offset] = clamp_pixel(r);
+    pixels[1] = clamp_pixel(g);
+    pixels[b_offset] = clamp_pixel(b);
+    if (format == JPEG_OUTPUT_RGBA) {
+      pixels[3] = 255;
+    }
+    pixels += pixel_size;
+  }
+}
+
+void ycbcr_to_rgb_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                             uint8_t *rgb, uint32_t width) {
+  ycbcr_to_pixels_scalar(y_row, cb_row, cr_row, h_shift, rgb, width, JPEG_OUTPUT_RGB);
+}
+
+void ycbcr_to_bgr_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                             uint8_t *bgr, uint32_t width) {
+  ycbcr_to_pixels_scalar(y_row, cb_row, cr_row, h_shift, bgr, width, JPEG_OUTPUT_BGR);
+}
+
+void ycbcr_to_rgba_row_scalar(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift,
+                              uint8_t *rgba, uint32_t width) {
+  ycbcr_to_pixels_scalar(y_row, cb_row, cr_row, h_shift, rgba, width, JPEG_OUTPUT_RGBA);
+}
+
+void gray_row_scalar(const short *y_row, uint8_t *gray, uint32_t width) {
+  for (uint32_t x = 0; x < width; x++) {
+    gray[x] = clamp_pixel(y_row[x] + 128);
+  }
+}
+
+/**
+ * Level shift and clamp one pixel row of a grayscale image into every channel of pixel_size byte pixels, the fourth
+ * byte of RGBA is an opaque alpha
+ */
+void gray_to_pixels_row(const short *y_row, uint8_t *pixels, uint32_t width, uint32_t pixel_size) {
+  for (uint32_t x = 0; x < width; x++) {
+    uint8_t gray = clamp_pixel(y_row[x] + 128);
+    pixels[0] = gray;
+    pixels[1] = gray;
+    pixels[2] = gray;
+    if (pixel_size == 4) {
+      pixels[3] = 255;
+    }
+    pixels += pixel_size;
+  }
+}
+
+#if HAVE_X86_SIMD
+
+// Truncate 32-bit lanes to 16 bits and pack them, like assigning an int to a short
+#define SSE2_PACK_TRUNCATE(lo, hi)                                                                                     \
+  _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32((lo), 16), 16), _mm_srai_epi32(_mm_slli_epi32((hi), 16), 16))
+
+/**
+ * Store 8 pixels held as R, G, B, 0 in lo (pixels 0-3) and hi (pixels 4-7) as 24 bytes of RGB
+ * Each pixel is written with a 4-byte store whose last byte is overwritten by the next pixel, except for the last one
+ */
+__attribute__((target("sse2"))) static inline void store_rgb_sse2(uint8_t *rgb, __m128i lo, __m128i hi) {
+  for (int i = 0; i < 4; i++) {
+    uint32_t pixel = _mm_cvtsi128_si32(lo);
+    memcpy(rgb + i * 3, &pixel, 4);
+    lo = _mm_srli_si128(lo, 4);
+  }
+  for (int i = 4; i < 7; i++) {
+    uint32_t pixel = _mm_cvtsi128_si32(hi);
+    memcpy(rgb + i * 3, &pixel, 4);
+    hi = _mm_srli_si128(hi, 4);
+  }
+  uint32_t pixel = _mm_cvtsi128_si32(hi);
+  memcpy(rgb + 21, &pixel, 3);
+}
+
+__attribute__((target("sse2"))) static inline __attribute__((always_inline)) void
+ycbcr_to_pixels_sse2(const short *y_row, const short *cb_row, const short *cr_row, uint32_t h_shift, uint8_t *pixels,
+                     uint32_t width, JpegOutputFormat format) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi8(-1);
+  const __m128i offset = _mm_set1_epi32(128);
+  // _mm_madd_epi16 on interleaved (cb, cr) pairs, the low 16 bits of each constant multiply cb and the high 16 cr
+  const __m128i r_factor = _mm_set1_epi32(45 << 16);
+  const __m128i g_factor = _mm_set1_epi32((23 << 16) | 11);
+  const __m128i b_factor = _mm_set1_epi32(113);
+  uint32_t x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    __m128i y = _mm_loadu_si128((const __m128i *) &y_row[x]);
+    __m128i cb, cr;
+    if (h_shift) {
+      cb = _mm_loadl_epi64((const __m128i *) &cb_row[x >> 1]);
+      cr = _mm_loadl_epi64((const __m128i *) &cr_row[x >> 1]);
+      cb = _mm_unpacklo_epi16(cb, cb);
+      cr = _mm_unpacklo_epi16(cr, cr);
+    } else {
+      cb = _mm_loadu_si128((const __m128i *) &cb_row[x]);
+      cr = _mm_loadu_si128((const __m128i *) &cr_row[x]);
+    }
+
+    __m128i cbcr_lo = _mm_unpacklo_epi16(cb, cr);
+    __m128i cbcr_hi = _mm_unpackhi_epi16(cb, cr);
+    // Sign extend luma to 32 bits
+    __m128i y_lo = _mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(y, y), 16), offset);
+    __m128i y_hi = _mm_add_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(y, y), 16), offset);
+
+    __m128i r_lo = _mm_add_epi32(y_lo, _mm_srai_epi32(_mm_madd_epi16(cbcr_lo, r_factor), 5));
+    __m128i r_hi = _mm_add_epi32(y_hi, _mm_srai_epi32(_mm_madd_epi16(cbcr_hi, r_factor), 5));
+    __m128i g_lo = _mm_sub_epi32(y_lo, _mm_srai_epi32(_mm_madd_epi16(cbcr_lo, g_factor), 5));
+    __m128i g_hi = _mm_sub_epi32(y_hi, _mm_srai_epi32(_mm_madd_epi16(cbcr_hi, g_factor), 5));
+    __m128i b_lo = _mm_add_epi32(y_lo, _mm_srai_epi32(_mm_madd_epi16(cbcr_lo, b_factor), 6));
+    __m128i b_hi = _mm_add_epi32(y_hi, _mm_srai_epi32(_mm_madd_epi16(cbcr_hi, b_factor), 6));
+
+    __m128i r = SSE2_PACK_TRUNCATE(r_lo, r_hi);
+    __m128i g = SSE2_PACK_TRUNCATE(g_lo, g_hi);
+    __m128i b = SSE2_PACK_TRUNCATE(b_lo, b_hi);
+    if (format == JPEG_OUTPUT_BGR) {
+      __m128i swap = r;
+      r = b;
+      b = swap;
+    }
+
+    // Saturating packs clamp to [0, 255], low half is R and high half is G
+    __m128i rg = _mm_packus_epi16(r, g);
+    rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+
+    if (format == JPEG_OUTPUT_RGBA) {
+      __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+      _mm_storeu_si128((__m128i *) (pixels + x * 4), _mm_unpacklo_epi16(rg, ba));
+      _mm_storeu_si128((__m128i *) (pixels + x * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+    } else {
+      __m128i b0 = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), zero);
+      store_rgb_sse2(pixels + x * 3, _mm_unpacklo_epi16(rg, b0), _mm_unpackhi_epi16(rg, b0));
+    }
+  }
+
+  if (x < width) {
+    uint32_t pixel_size = format == JPEG_OUTPUT_RGBA ? 4 : 3;
+    ycbcr_to_pixels_scalar(y_row + x, cb_row + (x >> h_shift), cr_row + (x >> h_shift), h_shift,
+                           pixels + x * pixel_size, width - x, format);
+  }
+}
+
+__attribute__((target("sse2"))) static void ycbcr_to_rgb_row_sse2(const short *y_row, const short *cb_row,
+                                                                   const short *cr_row, uint32_t h_shift, uint8_t *rgb,
+                                                                   uint32_t width) {
+  ycbcr_to_pixels_sse2(y_row, cb_row, cr_row, h_shift, rgb, width, JPEG_OUTPUT_RGB);
+}
+
+__attribute__((target("sse2"))) static void ycbcr_to_bgr_row_sse2(const short *y_row, const short *cb_row,
+                                                                   const short *cr_row, uint32_t h_shift, uint8_t *bgr,
+                                                                   uint32_t width) {
+  ycbcr_to_pixels_sse2(y_row, cb_row, cr_row, h_shift, bgr, width, JPEG_OUTPUT_BGR);
+}
+
+__attribute__((target("sse2"))) static void ycbcr_to_rgba_row_sse2(const short *y_row, const short *cb_row,
+                                                                    const short *cr_row, uint32_t h_shift,
+                                                                    uint8_t *rgba, uint32_t width) {
+  ycbcr_to_pixels_sse2(y_row, cb_row, cr_row, h_shift, rgba, width, JPEG_OUTPUT_RGBA);
+}
+
+__attribute__((target("sse2"))) static void gray_row_sse2(const short *y_row, uint8_t *gray, uint32_t width) {
+  const __m128i offset = _mm_set1_epi16(128);
+  uint32_t x = 0;
+
+  // Luma fits in 16 bits after the level shift, the saturating pack clamps it to [0, 255]
+  for (; x + 16 <= width; x += 16) {
+    __m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &y_row[x]), offset);
+    __m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &y_row[x + 8]), offset);
+    _mm_storeu_si128((__m128i *) &gray[x], _mm_packus_epi16(lo, hi));
+  }
+
+  if (x < width) {
+    gray_row_scalar(y_row + x, gray + x, width - x);
+  }
+}
+
+#endif // HAVE_X86_SIMD
+
+/**
+ * Pick the fastest color conversion kernel supported by the CPU we are running on
+ */
+void init_color_dispatch(void) {
+  ycbcr_to_rgb_row = ycbcr_to_rgb_row_scalar;
+  ycbcr_to_bgr_row = ycbcr_to_bgr_row_scalar;
+  ycbcr_to_rgba_row = ycbcr_to_rgba_row_scalar;
+  gray_row = gray_row_scalar;
+
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    ycbcr_to_rgb_row = ycbcr_to_rgb_row_sse2;
+    ycbcr_to_bgr_row = ycbcr_to_bgr_row_sse2;
+    ycbcr_to_rgba_row = ycbcr_to_rgba_row_sse2;
+    gray_row = gray_row_sse2;
+  }
+#endif
+}
@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "cpu-jpeg.h"
+
+/*
+ * Destuffing of entropy coded segments for the CPU decoder.
+ *
+ * Within entropy coded data a 0xFF byte is followed by a stuffed 0x00, by more 0xFF fill bytes, or by the code of a
+ * marker. Rather than have the bit reader test every byte it loads for 0xFF, a scan is copied once into an
+ * EntropySegment without its stuffed bytes and RSTn markers, and the bit reader loads 8 clean bytes at a time from
+ * there. Restart intervals end byte aligned, so taking the markers out leaves every interval at a byte boundary of
+ * the copy, where the offsets recorded along the way let threads start decoding.
+ *
+ * 0xFF bytes are rare in entropy coded data, so the copy is a run of long block copies found by a SIMD kernel that
+ * stops at the next 0xFF.
+ */
+
+copy_entropy_bytes_function copy_entropy_bytes = copy_entropy_bytes_scalar;
+
+uint32_t copy_entropy_bytes_scalar(const uint8_t *src, uint32_t length, uint8_t *dst) {
+  const uint8_t *marker = (const uint8_t *) memchr(src, 0xFF, length);
+  uint32_t count = marker != NULL ? (uint32_t)(marker - src) : length;
+  memcpy(dst, src, count);
+  return count;
+}
+
+#if HAVE_X86_SIMD
+
+/**
+ * Copy 64 bytes at a time as long as none of them is 0xFF, then 16 at a time, then the rest one by one
+ * Blocks are stored before they are checked, so dst receives whole blocks up to the one holding the 0xFF
+ */
+__attribute__((target("sse2"))) static uint32_t copy_entropy_bytes_sse2(const uint8_t *src, uint32_t length,
+                                                                        uint8_t *dst) {
+  const __m128i ff = _mm_set1_epi8((char) 0xFF);
+  uint32_t i = 0;
+
+  for (; i + 64 <= length; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *) (src + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *) (src + i + 48));
+    _mm_storeu_si128((__m128i *) (dst + i), a);
+    _mm_storeu_si128((__m128i *) (dst + i + 16), b);
+    _mm_storeu_si128((__m128i *) (dst + i + 32), c);
+    _mm_storeu_si128((__m128i *) (dst + i + 48), d);
+    __m128i any = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(a, ff), _mm_cmpeq_epi8(b, ff)),
+                               _mm_or_si128(_mm_cmpeq_epi8(c, ff), _mm_cmpeq_epi8(d, ff)));
+    if (_mm_movemask_epi8(any) != 0) {
+      break;
+    }
+  }
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dst + i), block);
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, ff));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  for (; i < length && src[i] != 0xFF; i++) {
+    dst[i] = src[i];
+  }
+  return i;
+}
+
+#endif
+
+/**
+ * Pick the fastest destuffing kernel supported by the CPU we are running on
+ */
+void init_destuff_dispatch(void) {
+  copy_entropy_bytes = copy_entropy_bytes_scalar;
+
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    copy_entropy_bytes = copy_entropy_bytes_sse2;
+  }
+#endif
+}
+
+static int add_restart_offset(EntropySegment *segment, uint32_t offset) {
+  if (segment->restart_count == segment->restart_capacity) {
+    uint32_t capacity = segment->restart_capacity != 0 ? segment->restart_capacity * 2 : 64;
+    uint32_t *offsets = (uint32_t *) realloc(segment->restart_offsets, capacity * sizeof(uint32_t));
+    if (offsets == NULL) {
+      return -1;
+    }
+    segment->restart_offsets = offsets;
+    segment->restart_capacity = capacity;
+  }
+  segment->restart_offsets[segment->restart_count++] = offset;
+  return 0;
+}
+
+/**
+ * Copy the entropy coded segment from start into segment, up to the first marker other than RSTn or up to end
+ * Stuffed 0x00 bytes and fill bytes are dropped, and every RSTn marker is replaced by the offset of the restart
+ * interval after it
+ * Returns 0 on success, -1 if out of memory
+ */
+int destuff_entropy_segment(EntropySegment *segment, const char *start, const char *end) {
+  size_t size = (size_t)(end - start) + ENTROPY_SEGMENT_PADDING;
+  if (segment->size < size) {
+    free(segment->data);
+    segment->data = (char *) malloc(size);
+    segment->size = segment->data != NULL ? size : 0;
+    if (segment->data == NULL) {
+      return -1;
+    }
+  }
+
+  const uint8_t *src = (const uint8_t *) start;
+  const uint8_t *src_end = (const uint8_t *) end;
+  uint8_t *dst = (uint8_t *) segment->data;
+  segment->restart_count = 0;
+  segment->restarts_in_sequence = 1;
+  if (add_restart_offset(segment, 0) != 0) {
+    return -1;
+  }
+
+  while (src < src_end) {
+    uint32_t count = copy_entropy_bytes(src, src_end - src, dst);
+    src += count;
+    dst += count;
+
+    // src is at a 0xFF or at the end, the code of a marker follows any number of 0xFF fill bytes
+    const uint8_t *code = src + 1;
+    while (code < src_end && *code == 0xFF) {
+      code++;
+    }
+    if (code >= src_end) {
+      src = src_end;
+      break;
+    }
+
+    if (*code == 0x00) {
+      *dst++ = 0xFF;
+    } else if (*code >= M_RST_FIRST && *code <= M_RST_LAST) {
+      // RSTn markers count modulo 8, a gap means data is missing
+      if (*code != M_RST_FIRST + ((segment->restart_count - 1) & 7)) {
+        segment->restarts_in_sequence = 0;
+      }
+      if (add_restart_offset(segment, dst - (uint8_t *) segment->data) != 0) {
+        return -1;
+      }
+    } else {
+      break;
+    }
+    src = code + 1;
+  }
+
+  segment->length = dst - (uint8_t *) segment->data;
+  segment->end = (char *) src;
+  memset(dst, 0, ENTROPY_SEGMENT_PADDING);
+  return 0;
+}
+
+void free_entropy_segment(EntropySegment *segment) {
+  free(segment->data);
+  free(segment->restart_offsets);
+  memset(segment, 0, sizeof(EntropySegment));
+}
@@ -0,0 +1,635 @@
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "cpu-jpeg.h"
+
+/*
+ * Integer inverse DCT kernels for the CPU decoder.
+ *
+ * All kernels compute exactly the same integer arithmetic as inverse_dct_component_scalar, including the truncation
+ * to 16 bits between the column and row pass, so their output is bit-for-bit identical to the scalar version (and
+ * therefore to the DPU kernel). The SIMD versions just compute several columns or rows at once in 32-bit lanes.
+ *
+ * Coefficients come in as decoded, the quantization steps are folded into the multipliers of the column pass
+ * (QuantizationTable.prescale), so dequantization costs nothing extra.
+ */
+
+idct_function inverse_dct_component = inverse_dct_component_scalar;
+idct_function inverse_dct_component_low4 = inverse_dct_component_low4_scalar;
+
+void inverse_dct_component_scalar(short *buffer, const QuantizationTable *q_table) {
+  const int32_t *prescale = q_table->prescale;
+
+  // ANN algorithm, intermediate values are bit shifted to the left to preserve precision
+  // and then bit shifted to the right at the end
+  for (int i = 0; i < 8; i++) {
+    // Higher accuracy, the multipliers include the quantization step
+    int g0 = (buffer[0 * 8 + i] * prescale[0 * 8 + i]) >> 5;
+    int g1 = (buffer[4 * 8 + i] * prescale[4 * 8 + i]) >> 5;
+    int g2 = (buffer[2 * 8 + i] * prescale[2 * 8 + i]) >> 3;
+    int g3 = (buffer[6 * 8 + i] * prescale[6 * 8 + i]) >> 4;
+    int g4 = (buffer[5 * 8 + i] * prescale[5 * 8 + i]) >> 4;
+    int g5 = (buffer[1 * 8 + i] * prescale[1 * 8 + i]) >> 5;
+    int g6 = (buffer[7 * 8 + i] * prescale[7 * 8 + i]) >> 4;
+    int g7 = (buffer[3 * 8 + i] * prescale[3 * 8 + i]) >> 5;
+
+    // Lower accuracy
+    // int g0 = (buffer[0 * 8 + i] * 22) >> 2;
+    // int g1 = (buffer[4 * 8 + i] * 22) >> 2;
+    // int g2 = (buffer[2 * 8 + i] * 30) >> 2;
+    // int g3 = (buffer[6 * 8 + i] * 12) >> 2;
+    // int g4 = (buffer[5 * 8 + i] * 18) >> 2;
+    // int g5 = (buffer[1 * 8 + i] * 31) >> 2;
+    // int g6 = (buffer[7 * 8 + i] * 6) >> 2;
+    // int g7 = (buffer[3 * 8 + i] * 27) >> 2;
+
+    int f4 = g4 - g7;
+    int f5 = g5 + g6;
+    int f6 = g5 - g6;
+    int f7 = g4 + g7;
+
+    int e2 = g2 - g3;
+    int e3 = g2 + g3;
+    int e5 = f5 - f7;
+    int e7 = f5 + f7;
+    int e8 = f4 + f6;
+
+    // Higher accuracy
+    int d2 = (e2 * 181) >> 7;
+    int d4 = (f4 * 277) >> 8;
+    int d5 = (e5 * 181) >> 7;
+    int d6 = (f6 * 669) >> 8;
+    int d8 = (e8 * 49) >> 6;
+
+    // Lower accuracy
+    // int d2 = (e2 * 90) >> 6;
+    // int d4 = (f4 * 69) >> 6;
+    // int d5 = (e5 * 90) >> 6;
+    // int d6 = (f6 * 167) >> 6;
+    // int d8 = (e8 * 49) >> 6;
+
+    int c0 = g0 + g1;
+    int c1 = g0 - g1;
+    int c2 = d2 - e3;
+    int c4 = d4 + d8;
+    int c5 = d5 + e7;
+    int c6 = d6 - d8;
+    int c8 = c5 - c6;
+
+    int b0 = c0 + e3;
+    int b1 = c1 + c2;
+    int b2 = c1 - c2;
+    int b3 = c0 - e3;
+    int b4 = c4 - c8;
+    int b6 = c6 - e7;
+
+    buffer[0 * 8 + i] = (b0 + e7) >> 4;
+    buffer[1 * 8 + i] = (b1 + b6) >> 4;
+    buffer[2 * 8 + i] = (b2 + c8) >> 4;
+    buffer[3 * 8 + i] = (b3 + b4) >> 4;
+    buffer[4 * 8 + i] = (b3 - b4) >> 4;
+    buffer[5 * 8 + i] = (b2 - c8) >> 4;
+    buffer[6 * 8 + i] = (b1 - b6) >> 4;
+    buffer[7 * 8 + i] = (b0 - e7) >> 4;
+  }
+
+  for (int i = 0; i < 8; i++) {
+    // Higher accuracy
+    int g0 = (buffer[i * 8 + 0] * 181) >> 5;
+    int g1 = (buffer[i * 8 + 4] * 181) >> 5;
+    int g2 = (buffer[i * 8 + 2] * 59) >> 3;
+    int g3 = (buffer[i * 8 + 6] * 49) >> 4;
+    int g4 = (buffer[i * 8 + 5] * 71) >> 4;
+    int g5 = (buffer[i * 8 + 1] * 251) >> 5;
+    int g6 = (buffer[i * 8 + 7] * 25) >> 4;
+    int g7 = (buffer[i * 8 + 3] * 213) >> 5;
+
+    // Lower accuracy
+    // int g0 = (buffer[i * 8 + 0] * 22) >> 2;
+    // int g1 = (buffer[i * 8 + 4] * 22) >> 2;
+    // int g2 = (buffer[i * 8 + 2] * 30) >> 2;
+    // int g3 = (buffer[i * 8 + 6] * 12) >> 2;
+    // int g4 = (buffer[i * 8 + 5] * 18) >> 2;
+    // int g5 = (buffer[i * 8 + 1] * 31) >> 2;
+    // int g6 = (buffer[i * 8 + 7] * 6) >> 2;
+    // int g7 = (buffer[i * 8 + 3] * 27) >> 2;
+
+    int f4 = g4 - g7;
+    int f5 = g5 + g6;
+    int f6 = g5 - g6;
+    int f7 = g4 + g7;
+
+    int e2 = g2 - g3;
+    int e3 = g2 + g3;
+    int e5 = f5 - f7;
+    int e7 = f5 + f7;
+    int e8 = f4 + f6;
+
+    // Higher accuracy
+    int d2 = (e2 * 181) >> 7;
+    int d4 = (f4 * 277) >> 8;
+    int d5 = (e5 * 181) >> 7;
+    int d6 = (f6 * 669) >> 8;
+    int d8 = (e8 * 49) >> 6;
+
+    // Lower accuracy
+    // int d2 = (e2 * 90) >> 6;
+    // int d4 = (f4 * 69) >> 6;
+    // int d5 = (e5 * 90) >> 6;
+    // int d6 = (f6 * 167) >> 6;
+    // int d8 = (e8 * 49) >> 6;
+
+    int c0 = g0 + g1;
+    int c1 = g0 - g1;
+    int c2 = d2 - e3;
+    int c4 = d4 + d8;
+    int c5 = d5 + e7;
+    int c6 = d6 - d8;
+    int c8 = c5 - c6;
+
+    int b0 = c0 + e3;
+    int b1 = c1 + c2;
+    int b2 = c1 - c2;
+    int b3 = c0 - e3;
+    int b4 = c4 - c8;
+    int b6 = c6 - e7;
+
+    buffer[i * 8 + 0] = (b0 + e7) >> 4;
+    buffer[i * 8 + 1] = (b1 + b6) >> 4;
+    buffer[i * 8 + 2] = (b2 + c8) >> 4;
+    buffer[i * 8 + 3] = (b3 + b4) >> 4;
+    buffer[i * 8 + 4] = (b3 - b4) >> 4;
+    buffer[i * 8 + 5] = (b2 - c8) >> 4;
+    buffer[i * 8 + 6] = (b1 - b6) >> 4;
+    buffer[i * 8 + 7] = (b0 - e7) >> 4;
+  }
+}
+
+/*
+ * Shortcuts for sparse blocks, which give exactly the same samples as the full inverse DCT. With the entropy decoder
+ * telling us where the last non-zero coefficient is, the terms that are known to be zero are left out.
+ */
+
+/**
+ * One 1-D pass of the scalar transform over 8 values p[0], p[stride], ... of which only the first 4 may be non-zero,
+ * given the first 4 inputs already multiplied and shifted
+ */
+static inline void idct_1d_low4(short *p, int stride, int g0, int g5, int g2, int g7) {
+
+  int f4 = -g7;
+  int e5 = g5 - g7;
+  int e7 = g5 + g7;
+
+  int d2 = (g2 * 181) >> 7;
+  int d4 = (f4 * 277) >> 8;
+  int d5 = (e5 * 181) >> 7;
+  int d6 = (g5 * 669) >> 8;
+  int d8 = (e5 * 49) >> 6;
+
+  int c2 = d2 - g2;
+  int c4 = d4 + d8;
+  int c5 = d5 + e7;
+  int c6 = d6 - d8;
+  int c8 = c5 - c6;
+
+  int b0 = g0 + g2;
+  int b1 = g0 + c2;
+  int b2 = g0 - c2;
+  int b3 = g0 - g2;
+  int b4 = c4 - c8;
+  int b6 = c6 - e7;
+
+  p[0 * stride] = (b0 + e7) >> 4;
+  p[1 * stride] = (b1 + b6) >> 4;
+  p[2 * stride] = (b2 + c8) >> 4;
+  p[3 * stride] = (b3 + b4) >> 4;
+  p[4 * stride] = (b3 - b4) >> 4;
+  p[5 * stride] = (b2 - c8) >> 4;
+  p[6 * stride] = (b1 - b6) >> 4;
+  p[7 * stride] = (b0 - e7) >> 4;
+}
+
+/**
+ * Inverse DCT of a block whose non-zero coefficients all lie in the top left 4x4 corner (zigzag index up to
+ * IDCT_LOW4_LAST_INDEX). Columns 4 to 7 stay zero through the column pass, so only 4 columns are transformed.
+ * The SIMD versions below skip the multiplications by zero in both passes.
+ */
+void inverse_dct_component_low4_scalar(short *buffer, const QuantizationTable *q_table) {
+  const int32_t *prescale = q_table->prescale;
+
+  for (int i = 0; i < 4; i++) {
+    short *p = &buffer[i];
+    idct_1d_low4(p, 8, (p[0] * prescale[i]) >> 5, (p[8] * prescale[8 + i]) >> 5, (p[16] * prescale[16 + i]) >> 3,
+                 (p[24] * prescale[24 + i]) >> 5);
+  }
+  for (int i = 0; i < 8; i++) {
+    short *p = &buffer[i * 8];
+    idct_1d_low4(p, 1, (p[0] * 181) >> 5, (p[1] * 251) >> 5, (p[2] * 59) >> 3, (p[3] * 213) >> 5);
+  }
+}
+
+/**
+ * The single sample value of a block that only has a DC coefficient
+ */
+short inverse_dct_dc(short dc, const QuantizationTable *q_table) {
+  short sample = ((dc * q_table->prescale[0]) >> 5) >> 4;
+  return ((sample * 181) >> 5) >> 4;
+}
+
+/*
+ * Reduced size inverse DCTs for decoding at 1/2, 1/4 and 1/8 scale. An N-point transform of the N lowest
+ * frequencies gives the samples averaged over 8/N x 8/N pixels: the usual N-point constant of frequency u is weighted
+ * by the mean of the 8-point basis function over 8/N samples. Only the top left N x N coefficients are read, and
+ * dequantized as they are loaded, the output goes to the top left N x N samples of the buffer (row stride 8).
+ */
+#define SCALED_CONST_BITS 13
+#define SCALED_PASS_BITS 2 // extra precision kept between the column and row pass
+#define SCALED_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+// Basis function x of frequency u in 1 << SCALED_CONST_BITS, at [x * N + u]
+static const int SCALED_IDCT_4[4 * 4] = {
+    2896, 3712, 2676, 1303, 2896, 1537, -2676, -3146, 2896, -1537, -2676, 3146, 2896, -3712, 2676, -1303,
+};
+static const int SCALED_IDCT_2[2 * 2] = {2896, 2624, 2896, -2624};
+
+static inline void inverse_dct_component_scaled(short *buffer, const QuantizationTable *q_table, uint32_t size,
+                                                const int *basis) {
+  int workspace[4 * 4];
+
+  // Columns
+  for (uint32_t i = 0; i < size; i++) {
+    for (uint32_t x = 0; x < size; x++) {
+      int sum = 0;
+      for (uint32_t u = 0; u < size; u++) {
+        sum += buffer[u * 8 + i] * (int) q_table->table[u * 8 + i] * basis[x * size + u];
+      }
+      workspace[x * size + i] = SCALED_DESCALE(sum, SCALED_CONST_BITS - SCALED_PASS_BITS);
+    }
+  }
+
+  // Rows
+  for (uint32_t i = 0; i < size; i++) {
+    for (uint32_t x = 0; x < size; x++) {
+      int sum = 0;
+      for (uint32_t u = 0; u < size; u++) {
+        sum += workspace[i * size + u] * basis[x * size + u];
+      }
+      buffer[i * 8 + x] = SCALED_DESCALE(sum, SCALED_CONST_BITS + SCALED_PASS_BITS);
+    }
+  }
+}
+
+void inverse_dct_component_4x4(short *buffer, const QuantizationTable *q_table) {
+  inverse_dct_component_scaled(buffer, q_table, 4, SCALED_IDCT_4);
+}
+
+void inverse_dct_component_2x2(short *buffer, const QuantizationTable *q_table) {
+  inverse_dct_component_scaled(buffer, q_table, 2, SCALED_IDCT_2);
+}
+
+void inverse_dct_component_1x1(short *buffer, const QuantizationTable *q_table) {
+  // Same arithmetic as the full inverse DCT of a block with only a DC coefficient
+  buffer[0] = inverse_dct_dc(buffer[0], q_table);
+}
+
+#if HAVE_X86_SIMD
+
+/*
+ * The 1-D transform below is the same butterfly as the scalar code, written once with macros so that the SSE2 and
+ * AVX2 kernels share it. v[k] holds the k-th frequency of several columns (or rows) and is replaced by the k-th
+ * output sample. SCALE is the first multiply and shift of each input: MUL_SHIFT in the row pass, and only the shift
+ * in the column pass, whose inputs are multiplied by the prescale table beforehand.
+ */
+#define IDCT_1D(TYPE, ADD, SUB, MUL_SHIFT, SCALE, SRAI, v)                                                             \
+  do {                                                                                                                 \
+    TYPE g0 = SCALE(v[0], 181, 5);                                                                                     \
+    TYPE g1 = SCALE(v[4], 181, 5);                                                                                     \
+    TYPE g2 = SCALE(v[2], 59, 3);                                                                                      \
+    TYPE g3 = SCALE(v[6], 49, 4);                                                                                      \
+    TYPE g4 = SCALE(v[5], 71, 4);                                                                                      \
+    TYPE g5 = SCALE(v[1], 251, 5);                                                                                     \
+    TYPE g6 = SCALE(v[7], 25, 4);                                                                                      \
+    TYPE g7 = SCALE(v[3], 213, 5);                                                                                     \
+                                                                                                                       \
+    TYPE f4 = SUB(g4, g7);                                                                                             \
+    TYPE f5 = ADD(g5, g6);                                                                                             \
+    TYPE f6 = SUB(g5, g6);                                                                                             \
+    TYPE f7 = ADD(g4, g7);                                                                                             \
+                                                                                                                       \
+    TYPE e2 = SUB(g2, g3);                                                                                             \
+    TYPE e3 = ADD(g2, g3);                                                                                             \
+    TYPE e5 = SUB(f5, f7);                                                                                             \
+    TYPE e7 = ADD(f5, f7);                                                                                             \
+    TYPE e8 = ADD(f4, f6);                                                                                             \
+                                                                                                                       \
+    TYPE d2 = MUL_SHIFT(e2, 181, 7);                                                                                   \
+    TYPE d4 = MUL_SHIFT(f4, 277, 8);                                                                                   \
+    TYPE d5 = MUL_SHIFT(e5, 181, 7);                                                                                   \
+    TYPE d6 = MUL_SHIFT(f6, 669, 8);                                                                                   \
+    TYPE d8 = MUL_SHIFT(e8, 49, 6);                                                                                    \
+                                                                                                                       \
+    TYPE c0 = ADD(g0, g1);                                                                                             \
+    TYPE c1 = SUB(g0, g1);                                                                                             \
+    TYPE c2 = SUB(d2, e3);                                                                                             \
+    TYPE c4 = ADD(d4, d8);                                                                                             \
+    TYPE c5 = ADD(d5, e7);                                                                                             \
+    TYPE c6 = SUB(d6, d8);                                                                                             \
+    TYPE c8 = SUB(c5, c6);                                                                                             \
+                                                                                                                       \
+    TYPE b0 = ADD(c0, e3);                                                                                             \
+    TYPE b1 = ADD(c1, c2);                                                                                             \
+    TYPE b2 = SUB(c1, c2);                                                                                             \
+    TYPE b3 = SUB(c0, e3);                                                                                             \
+    TYPE b4 = SUB(c4, c8);                                                                                             \
+    TYPE b6 = SUB(c6, e7);                                                                                             \
+                                                                                                                       \
+    v[0] = SRAI(ADD(b0, e7), 4);                                                                                       \
+    v[1] = SRAI(ADD(b1, b6), 4);                                                                                       \
+    v[2] = SRAI(ADD(b2, c8), 4);                                                                                       \
+    v[3] = SRAI(ADD(b3, b4), 4);                                                                                       \
+    v[4] = SRAI(SUB(b3, b4), 4);                                                                                       \
+    v[5] = SRAI(SUB(b2, c8), 4);                                                                                       \
+    v[6] = SRAI(SUB(b1, b6), 4);                                                                                       \
+    v[7] = SRAI(SUB(b0, e7), 4);                                                                                       \
+  } while (0)
+
+// IDCT_1D for v[4] to v[7] being zero, the same as idct_1d_low4
+#define IDCT_1D_LOW4(TYPE, ADD, SUB, MUL_SHIFT, SCALE, SRAI, ZERO, v)                                                  \
+  do {                                                                                                                 \
+    TYPE g0 = SCALE(v[0], 181, 5);                                                                                     \
+    TYPE g2 = SCALE(v[2], 59, 3);                                                                                      \
+    TYPE g5 = SCALE(v[1], 251, 5);                                                                                     \
+    TYPE g7 = SCALE(v[3], 213, 5);                                                                                     \
+                                                                                                                       \
+    TYPE f4 = SUB(ZERO, g7);                                                                                           \
+    TYPE e5 = SUB(g5, g7);                                                                                             \
+    TYPE e7 = ADD(g5, g7);                                                                                             \
+                                                                                                                       \
+    TYPE d2 = MUL_SHIFT(g2, 181, 7);                                                                                   \
+    TYPE d4 = MUL_SHIFT(f4, 277, 8);                                                                                   \
+    TYPE d5 = MUL_SHIFT(e5, 181, 7);                                                                                   \
+    TYPE d6 = MUL_SHIFT(g5, 669, 8);                                                                                   \
+    TYPE d8 = MUL_SHIFT(e5, 49, 6);                                                                                    \
+                                                                                                                       \
+    TYPE c2 = SUB(d2, g2);                                                                                             \
+    TYPE c4 = ADD(d4, d8);                                                                                             \
+    TYPE c5 = ADD(d5, e7);                                                                                             \
+    TYPE c6 = SUB(d6, d8);                                                                                             \
+    TYPE c8 = SUB(c5, c6);                                                                                             \
+                                                                                                                       \
+    TYPE b0 = ADD(g0, g2);                                                                                             \
+    TYPE b1 = ADD(g0, c2);                                                                                             \
+    TYPE b2 = SUB(g0, c2);                                                                                             \
+    TYPE b3 = SUB(g0, g2);                                                                                             \
+    TYPE b4 = SUB(c4, c8);                                                                                             \
+    TYPE b6 = SUB(c6, e7);                                                                                             \
+                                                                                                                       \
+    v[0] = SRAI(ADD(b0, e7), 4);                                                                                       \
+    v[1] = SRAI(ADD(b1, b6), 4);                                                                                       \
+    v[2] = SRAI(ADD(b2, c8), 4);                                                                                       \
+    v[3] = SRAI(ADD(b3, b4), 4);                                                                                       \
+    v[4] = SRAI(SUB(b3, b4), 4);                                                                                       \
+    v[5] = SRAI(SUB(b2, c8), 4);                                                                                       \
+    v[6] = SRAI(SUB(b1, b6), 4);                                                                                       \
+    v[7] = SRAI(SUB(b0, e7), 4);                                                                                       \
+  } while (0)
+
+/*
+ * SSE2: 4 columns per register, so each pass runs twice. SSE2 has no 32-bit multiply keeping the low half, it is
+ * built from two 32x32->64 multiplies.
+ */
+__attribute__((target("sse2"))) static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define SSE2_MUL_SHIFT(x, c, s) _mm_srai_epi32(mullo_epi32_sse2((x), _mm_set1_epi32(c)), (s))
+#define SSE2_SHIFT(x, c, s) _mm_srai_epi32((x), (s))
+
+// Truncate 32-bit lanes to 16 bits and sign extend them again, like storing to a short
+#define SSE2_TRUNCATE(x) _mm_srai_epi32(_mm_slli_epi32((x), 16), 16)
+
+__attribute__((target("sse2"))) static inline void transpose_4x4_sse2(__m128i *r0, __m128i *r1, __m128i *r2,
+                                                                      __m128i *r3) {
+  __m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+  __m128i t1 = _mm_unpacklo_epi32(*r2, *r3);
+  __m128i t2 = _mm_unpackhi_epi32(*r0, *r1);
+  __m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+  *r0 = _mm_unpacklo_epi64(t0, t1);
+  *r1 = _mm_unpackhi_epi64(t0, t1);
+  *r2 = _mm_unpacklo_epi64(t2, t3);
+  *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+// lo[k] holds columns 0-3 of row k and hi[k] columns 4-7
+__attribute__((target("sse2"))) static inline void transpose_8x8_sse2(__m128i *lo, __m128i *hi) {
+  transpose_4x4_sse2(&lo[0], &lo[1], &lo[2], &lo[3]);
+  transpose_4x4_sse2(&hi[0], &hi[1], &hi[2], &hi[3]);
+  transpose_4x4_sse2(&lo[4], &lo[5], &lo[6], &lo[7]);
+  transpose_4x4_sse2(&hi[4], &hi[5], &hi[6], &hi[7]);
+  for (int k = 0; k < 4; k++) {
+    __m128i temp = hi[k];
+    hi[k] = lo[k + 4];
+    lo[k + 4] = temp;
+  }
+}
+
+__attribute__((target("sse2"))) static void inverse_dct_component_sse2(short *buffer,
+                                                                       const QuantizationTable *q_table) {
+  __m128i lo[8], hi[8];
+  const __m128i zero = _mm_setzero_si128();
+
+  for (int k = 0; k < 8; k++) {
+    __m128i row = _mm_loadu_si128((__m128i *) &buffer[k * 8]);
+    __m128i sign = _mm_cmpgt_epi16(zero, row);
+    lo[k] = mullo_epi32_sse2(_mm_unpacklo_epi16(row, sign), _mm_loadu_si128((__m128i *) &q_table->prescale[k * 8]));
+    hi[k] = mullo_epi32_sse2(_mm_unpackhi_epi16(row, sign), _mm_loadu_si128((__m128i *) &q_table->prescale[k * 8 + 4]));
+  }
+
+  IDCT_1D(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_SHIFT, _mm_srai_epi32, lo);
+  IDCT_1D(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_SHIFT, _mm_srai_epi32, hi);
+
+  for (int k = 0; k < 8; k++) {
+    lo[k] = SSE2_TRUNCATE(lo[k]);
+    hi[k] = SSE2_TRUNCATE(hi[k]);
+  }
+  transpose_8x8_sse2(lo, hi);
+
+  IDCT_1D(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_MUL_SHIFT, _mm_srai_epi32, lo);
+  IDCT_1D(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_MUL_SHIFT, _mm_srai_epi32, hi);
+
+  transpose_8x8_sse2(lo, hi);
+  for (int k = 0; k < 8; k++) {
+    // Values are truncated first so that the saturating pack behaves like a plain store to short
+    __m128i row = _mm_packs_epi32(SSE2_TRUNCATE(lo[k]), SSE2_TRUNCATE(hi[k]));
+    _mm_storeu_si128((__m128i *) &buffer[k * 8], row);
+  }
+}
+
+// Only columns 0-3 of rows 0-3 are non-zero: one column pass, and the row pass only needs the first 4 inputs
+__attribute__((target("sse2"))) static void inverse_dct_component_low4_sse2(short *buffer,
+                                                                         const QuantizationTable *q_table) {
+  __m128i lo[8], hi[8];
+  const __m128i zero = _mm_setzero_si128();
+
+  for (int k = 0; k < 4; k++) {
+    __m128i row = _mm_loadl_epi64((__m128i *) &buffer[k * 8]);
+    lo[k] = mullo_epi32_sse2(_mm_unpacklo_epi16(row, _mm_cmpgt_epi16(zero, row)),
+                             _mm_loadu_si128((__m128i *) &q_table->prescale[k * 8]));
+  }
+
+  IDCT_1D_LOW4(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_SHIFT, _mm_srai_epi32, zero, lo);
+
+  // Transpose the two 4x4 blocks of columns 0-3, the other half of the 8x8 transpose only moves zeros
+  for (int k = 0; k < 8; k++) {
+    lo[k] = SSE2_TRUNCATE(lo[k]);
+  }
+  transpose_4x4_sse2(&lo[0], &lo[1], &lo[2], &lo[3]);
+  transpose_4x4_sse2(&lo[4], &lo[5], &lo[6], &lo[7]);
+  for (int k = 0; k < 4; k++) {
+    hi[k] = lo[k + 4];
+  }
+
+  IDCT_1D_LOW4(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_MUL_SHIFT, _mm_srai_epi32, zero, lo);
+  IDCT_1D_LOW4(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL_SHIFT, SSE2_MUL_SHIFT, _mm_srai_epi32, zero, hi);
+
+  transpose_8x8_sse2(lo, hi);
+  for (int k = 0; k < 8; k++) {
+    __m128i row = _mm_packs_epi32(SSE2_TRUNCATE(lo[k]), SSE2_TRUNCATE(hi[k]));
+    _mm_storeu_si128((__m128i *) &buffer[k * 8], row);
+  }
+}
+
+/*
+ * AVX2: a whole row of 8 columns per register
+ */
+#define AVX2_MUL_SHIFT(x, c, s) _mm256_srai_epi32(_mm256_mullo_epi32((x), _mm256_set1_epi32(c)), (s))
+#define AVX2_SHIFT(x, c, s) _mm256_srai_epi32((x), (s))
+#define AVX2_TRUNCATE(x) _mm256_srai_epi32(_mm256_slli_epi32((x), 16), 16)
+
+__attribute__((target("avx2"))) static inline void transpose_8x8_avx2(__m256i *v) {
+  __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+  __m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+  __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+  __m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+  __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+  __m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+  __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+  __m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+  __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+  __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+  __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+  __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+  v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2"))) static void inverse_dct_component_avx2(short *buffer,
+                                                                       const QuantizationTable *q_table) {
+  __m256i v[8];
+
+  for (int k = 0; k < 8; k++) {
+    v[k] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) &buffer[k * 8])),
+                              _mm256_loadu_si256((__m256i *) &q_table->prescale[k * 8]));
+  }
+
+  IDCT_1D(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL_SHIFT, AVX2_SHIFT, _mm256_srai_epi32, v);
+
+  for (int k = 0; k < 8; k++) {
+    v[k] = AVX2_TRUNCATE(v[k]);
+  }
+  transpose_8x8_avx2(v);
+
+  IDCT_1D(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL_SHIFT, AVX2_MUL_SHIFT, _mm256_srai_epi32, v);
+
+  transpose_8x8_avx2(v);
+  for (int k = 0; k < 8; k += 2) {
+    // packs works within 128-bit lanes, the permute puts rows k and k + 1 back in order
+    __m256i rows = _mm256_packs_epi32(AVX2_TRUNCATE(v[k]), AVX2_TRUNCATE(v[k + 1]));
+    rows = _mm256_permute4x64_epi64(rows, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *) &buffer[k * 8], rows);
+  }
+}
+
+__attribute__((target("avx2"))) static void inverse_dct_component_low4_avx2(short *buffer,
+                                                                         const QuantizationTable *q_table) {
+  __m256i v[8];
+  const __m256i zero = _mm256_setzero_si256();
+
+  for (int k = 0; k < 4; k++) {
+    v[k] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) &buffer[k * 8])),
+                              _mm256_loadu_si256((__m256i *) &q_table->prescale[k * 8]));
+  }
+
+  IDCT_1D_LOW4(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL_SHIFT, AVX2_SHIFT, _mm256_srai_epi32, zero, v);
+
+  for (int k = 0; k < 8; k++) {
+    v[k] = AVX2_TRUNCATE(v[k]);
+  }
+  transpose_8x8_avx2(v);
+
+  IDCT_1D_LOW4(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL_SHIFT, AVX2_MUL_SHIFT, _mm256_srai_epi32, zero,
+               v);
+
+  transpose_8x8_avx2(v);
+  for (int k = 0; k < 8; k += 2) {
+    __m256i rows = _mm256_packs_epi32(AVX2_TRUNCATE(v[k]), AVX2_TRUNCATE(v[k + 1]));
+    rows = _mm256_permute4x64_epi64(rows, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *) &buffer[k * 8], rows);
+  }
+}
+
+#endif // HAVE_X86_SIMD
+
+/**
+ * Pick the fastest inverse DCT kernel supported by the CPU we are running on
+ */
+void init_idct_dispatch(void) {
+  inverse_dct_component = inverse_dct_component_scalar;
+  inverse_dct_component_low4 = inverse_dct_component_low4_scalar;
+
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    inverse_dct_component = inverse_dct_component_avx2;
+    inverse_dct_component_low4 = inverse_dct_component_low4_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    inverse_dct_component = inverse_dct_component_sse2;
+    inverse_dct_component_low4 = inverse_dct_component_low4_sse2;
+  }
+#endif
+}
+
+/**
+ * Inverse DCT producing block_size x block_size samples per block (8, 4, 2 or 1)
+ */
+idct_function scaled_idct_function(uint32_t block_size) {
+  switch (block_size) {
+    case 4:
+      return inverse_dct_component_4x4;
+    case 2:
+      return inverse_dct_component_2x2;
+    case 1:
+      return inverse_dct_component_1x1;
+    default:
+      return inverse_dct_component;
+  }
+}
@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Pipelined decoding of the CPU decoder, for images that cannot be split between threads any other way.
+ *
+ * Entropy decoding is inherently serial without restart markers, but it is only part of the work. The calling thread
+ * entropy decodes one MCU row after another and hands them round robin to worker threads over lock free queues, and
+ * the workers inverse transform and convert their rows to pixels in parallel. With a row callback the rows are handed
+ * over strictly in order, which keeps the memory of a decode bounded by the queues whatever the height of the image.
+ */
+
+#define PIPELINE_DEPTH 4 // MCU rows that can wait in the queue of each worker of a pipelined decode
+
+/**
+ * Single producer, single consumer ring of entropy decoded MCU rows, from the entropy thread to one worker
+ * Only the entropy thread writes head and only the worker writes tail, so neither needs a lock
+ */
+typedef struct PipelineQueue {
+  short *blocks;                     // PIPELINE_DEPTH slots of blocks as kept by entropy_decode_mcus
+  int *last_indices;                 // and their last indices
+  uint32_t mcu_rows[PIPELINE_DEPTH]; // MCU row held by each slot
+  uint32_t head;                     // slots filled so far
+  uint32_t tail;                     // slots emptied so far
+  SamplePlanes samples;              // a single MCU row, owned by the worker
+  uint8_t *pixels;                   // output rows of one MCU row for the row callback, owned by the worker
+  pthread_t thread;
+} PipelineQueue;
+
+/**
+ * Shared state of a pipelined decode: the calling thread entropy decodes MCU rows and hands them round robin to the
+ * workers, which inverse transform and convert them
+ */
+typedef struct PipelineDecode {
+  JpegCpuContext *ctx;
+  PipelineQueue *queues;
+  uint32_t worker_count;
+  uint32_t next_worker;  // claimed atomically by the workers as they start
+  uint32_t first_mcu_row;
+  uint32_t first_mcu_col; // MCU columns decoded in every row
+  uint32_t end_mcu_col;
+  uint32_t slot_blocks;   // blocks per slot
+  OutputRows *output;     // the whole image, unless rows go to the row callback
+  uint32_t next_emit;     // next MCU row handed to the row callback, which takes them in order
+  uint32_t done;          // set once the entropy thread pushed its last row
+} PipelineDecode;
+
+static void *run_pipeline_worker(void *arg) {
+  PipelineDecode *job = (PipelineDecode *) arg;
+  JpegCpuContext *ctx = job->ctx;
+  PipelineQueue *queue = &job->queues[__atomic_fetch_add(&job->next_worker, 1, __ATOMIC_RELAXED)];
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t row_lines = ctx->jpegInfo.max_v_samp_factor * output_block_lines(ctx);
+
+  while (1) {
+    if (queue->tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+      // The last rows are pushed before done is set, so they are seen once it is
+      if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) &&
+          queue->tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      sched_yield();
+      continue;
+    }
+
+    uint32_t slot = queue->tail % PIPELINE_DEPTH;
+    uint32_t mcu_row = queue->mcu_rows[slot];
+    uint32_t row_start = mcu_row * mcus_per_row;
+    queue->samples.first_mcu_row = mcu_row;
+    transform_mcus(ctx, row_start + job->first_mcu_col, row_start + job->end_mcu_col,
+                   &queue->blocks[(size_t) slot * job->slot_blocks * 64],
+                   &queue->last_indices[(size_t) slot * job->slot_blocks], &queue->samples);
+
+    if (ctx->row_callback != NULL) {
+      OutputRows output;
+      init_output_rows(ctx, queue->pixels, mcu_row * row_lines, row_lines, &output);
+      convert_mcu_rows(ctx, &queue->samples, mcu_row, mcu_row + 1, &output);
+      while (__atomic_load_n(&job->next_emit, __ATOMIC_ACQUIRE) != mcu_row) {
+        sched_yield();
+      }
+      emit_mcu_row(ctx, &output);
+      __atomic_store_n(&job->next_emit, mcu_row + 1, __ATOMIC_RELEASE);
+    } else {
+      convert_mcu_rows(ctx, &queue->samples, mcu_row, mcu_row + 1, job->output);
+    }
+
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+static void free_pipeline_queues(PipelineDecode *job, uint32_t count) {
+  JpegCpuArena *arena = &job->ctx->arena;
+  for (uint32_t i = 0; i < count; i++) {
+    arena_free(arena, job->queues[i].blocks);
+    arena_free(arena, job->queues[i].last_indices);
+    arena_free(arena, job->queues[i].pixels);
+    free_sample_planes(job->ctx, &job->queues[i].samples);
+  }
+  arena_free(arena, job->queues);
+}
+
+/**
+ * Decode the MCU rows [first_mcu_row, mcu_rows) like decompress_mcu_rows, as a pipeline: the calling thread entropy
+ * decodes them (skipping the MCUs outside [first_mcu_col, end_mcu_col) and the rows above) and ctx->num_threads - 1
+ * workers inverse transform and convert them, then hand them to the row callback in order. Entropy decoding is the
+ * only serial stage, and memory use stays bounded by the queues whatever the height of the image
+ * Returns 1 if the image was decoded (or found invalid), 0 if it should be decoded serially instead
+ */
+int decompress_pipelined(JpegCpuContext *ctx, uint8_t *pixels, uint32_t mcu_rows, uint32_t first_mcu_row,
+                         uint32_t first_mcu_col, uint32_t end_mcu_col) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t row_lines = ctx->jpegInfo.max_v_samp_factor * output_block_lines(ctx);
+  uint32_t blocks_per_mcu = 0;
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    blocks_per_mcu += component->h_samp_factor * component->v_samp_factor;
+  }
+
+  PipelineDecode job;
+  memset(&job, 0, sizeof(PipelineDecode));
+  job.ctx = ctx;
+  job.worker_count = ctx->num_threads - 1;
+  job.first_mcu_row = first_mcu_row;
+  job.first_mcu_col = first_mcu_col;
+  job.end_mcu_col = end_mcu_col;
+  job.slot_blocks = (end_mcu_col - first_mcu_col) * blocks_per_mcu;
+  job.next_emit = first_mcu_row;
+  if (mcu_rows - first_mcu_row < job.worker_count) {
+    job.worker_count = mcu_rows - first_mcu_row;
+  }
+  if (job.worker_count == 0) {
+    return 0;
+  }
+
+  job.queues = (PipelineQueue *) arena_alloc(&ctx->arena, job.worker_count * sizeof(PipelineQueue));
+  if (job.queues == NULL) {
+    return 0;
+  }
+  memset(job.queues, 0, job.worker_count * sizeof(PipelineQueue));
+  for (uint32_t i = 0; i < job.worker_count; i++) {
+    PipelineQueue *queue = &job.queues[i];
+    queue->blocks = (short *) arena_alloc(&ctx->arena, (size_t) PIPELINE_DEPTH * job.slot_blocks * 64 * sizeof(short));
+    queue->last_indices = (int *) arena_alloc(&ctx->arena, (size_t) PIPELINE_DEPTH * job.slot_blocks * sizeof(int));
+    if (ctx->row_callback != NULL) {
+      queue->pixels = (uint8_t *) arena_alloc(&ctx->arena, output_size(ctx, row_lines));
+    }
+    if (queue->blocks == NULL || queue->last_indices == NULL ||
+        (ctx->row_callback != NULL && queue->pixels == NULL) || alloc_sample_planes(ctx, &queue->samples, 1) != 0) {
+      free_pipeline_queues(&job, i + 1);
+      return 0;
+    }
+  }
+
+  OutputRows output;
+  if (ctx->row_callback == NULL) {
+    uint32_t left, top, right, bottom;
+    output_region(ctx, &left, &top, &right, &bottom);
+    init_output_rows(ctx, pixels, top, output_line_count(ctx), &output);
+    job.output = &output;
+  }
+
+  // Rows only go to workers that are running
+  uint32_t started = 0;
+  for (; started < job.worker_count; started++) {
+    if (pthread_create(&job.queues[started].thread, NULL, run_pipeline_worker, &job) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    free_pipeline_queues(&job, job.worker_count);
+    return 0;
+  }
+
+  short previous_dcs[3] = {0};
+  int error = 0;
+  for (uint32_t mcu_row = 0; mcu_row < mcu_rows && !error; mcu_row++) {
+    uint32_t row_start = mcu_row * mcus_per_row;
+    uint32_t row_end = row_start + mcus_per_row;
+    if (mcu_row < first_mcu_row) {
+      error = skip_mcus(ctx, &ctx->decompressor, row_start, row_end, previous_dcs) != 0;
+      continue;
+    }
+
+    // Wait for a free slot in the queue of the worker whose turn it is
+    PipelineQueue *queue = &job.queues[(mcu_row - first_mcu_row) % started];
+    while (queue->head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == PIPELINE_DEPTH) {
+      sched_yield();
+    }
+    uint32_t slot = queue->head % PIPELINE_DEPTH;
+    short *blocks = &queue->blocks[(size_t) slot * job.slot_blocks * 64];
+    int *last_indices = &queue->last_indices[(size_t) slot * job.slot_blocks];
+    uint32_t decode_start = row_start + first_mcu_col;
+    uint32_t decode_end = row_start + end_mcu_col;
+
+    if (skip_mcus(ctx, &ctx->decompressor, row_start, decode_start, previous_dcs) != 0) {
+      error = 1;
+      break;
+    }
+    if (ctx->progressive) {
+      load_stored_mcus(ctx, decode_start, decode_end, blocks, last_indices);
+    } else if (entropy_decode_mcus(ctx, &ctx->decompressor, decode_start, decode_end, blocks, last_indices,
+                                   previous_dcs) != 0) {
+      error = 1;
+      break;
+    }
+    queue->mcu_rows[slot] = mcu_row;
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+
+    error = skip_mcus(ctx, &ctx->decompressor, decode_end, row_end, previous_dcs) != 0;
+  }
+
+  __atomic_store_n(&job.done, 1, __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(job.queues[i].thread, NULL);
+  }
+  free_pipeline_queues(&job, job.worker_count);
+
+  if (error) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid MCU\n");
+  }
+  return 1;
+}
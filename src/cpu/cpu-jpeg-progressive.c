@@ -0,0 +1,544 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Progressive images (SOF2) spread the coefficients of every block over several scans (Annex G): spectral selection
+ * sends bands of zigzag indices, and successive approximation sends the upper bits of the coefficients first and then
+ * refines them a bit per scan. Every scan is entropy decoded into ctx->coefficient_store before the first MCU row is
+ * transformed, and the MCU loops then read the blocks from the store instead of the bitstream.
+ */
+
+static inline size_t stored_block_index(const CoefficientStore *store, uint32_t color_index, uint32_t row,
+                                        uint32_t col) {
+  return store->offsets[color_index] + (size_t) row * store->strides[color_index] + col;
+}
+
+/**
+ * Zigzag coefficients per block the output reads: the coefficient count of coefficient output, or else the top left
+ * block_size x block_size coefficients the scaled inverse DCTs read, which end at zigzag index 0, 4, 24 or 63
+ */
+static uint32_t stored_coefficient_count(JpegCpuContext *ctx) {
+  if (is_coefficient_output(ctx->output_format)) {
+    return ctx->coefficient_count;
+  }
+  switch (ctx->block_size) {
+    case 1:
+      return 1;
+    case 2:
+      return 5;
+    case 4:
+      return 25;
+    default:
+      return 64;
+  }
+}
+
+/**
+ * Lay out the store for the blocks of every MCU of the image, with stored_coefficient_count coefficients each, and
+ * clear it. The buffers of earlier images are reused when they are large enough
+ * Returns 0 on success, -1 if out of memory
+ */
+static int alloc_coefficient_store(JpegCpuContext *ctx) {
+  CoefficientStore *store = &ctx->coefficient_store;
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  size_t blocks = 0;
+
+  store->count = stored_coefficient_count(ctx);
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    store->offsets[color_index] = blocks;
+    store->strides[color_index] = mcus_per_row * component->h_samp_factor;
+    blocks += (size_t) store->strides[color_index] * mcu_rows * component->v_samp_factor;
+  }
+
+  size_t coefficients_size = blocks * store->count;
+  if (coefficients_size > store->coefficients_size) {
+    free(store->coefficients);
+    store->coefficients = (short *) malloc(coefficients_size * sizeof(short));
+    store->coefficients_size = store->coefficients != NULL ? coefficients_size : 0;
+    if (store->coefficients == NULL) {
+      return -1;
+    }
+  }
+  memset(store->coefficients, 0, coefficients_size * sizeof(short));
+
+  // Past the first coefficient, coefficients that are not kept still need a bit telling whether they are non-zero
+  if (store->count > 1 && store->count < 64) {
+    if (blocks > store->nonzero_size) {
+      free(store->nonzero);
+      store->nonzero = (uint64_t *) malloc(blocks * sizeof(uint64_t));
+      store->nonzero_size = store->nonzero != NULL ? blocks : 0;
+      if (store->nonzero == NULL) {
+        return -1;
+      }
+    }
+    memset(store->nonzero, 0, blocks * sizeof(uint64_t));
+  }
+
+  return 0;
+}
+
+void free_coefficient_store(CoefficientStore *store) {
+  free(store->coefficients);
+  free(store->nonzero);
+  memset(store, 0, sizeof(CoefficientStore));
+}
+
+/**
+ * Find the marker that ends the scan starting at d->ptr, past stuffed 0xFF bytes and restart markers
+ * Returns the end of the data if there is none
+ */
+static char *find_scan_end(JpegDecompressor *d) {
+  char *ptr = d->ptr;
+  char *end = d->data + d->length;
+
+  while (ptr + 1 < end) {
+    char *marker = memchr(ptr, 0xFF, end - ptr - 1);
+    if (marker == NULL) {
+      break;
+    }
+    uint8_t code = marker[1];
+    if (code != 0x00 && (code < M_RST_FIRST || code > M_RST_LAST)) {
+      return marker;
+    }
+    ptr = marker + 2;
+  }
+
+  return end;
+}
+
+// Restart intervals start over with the DC predictions and the end-of-band run, at a byte boundary
+static void restart_scan(JpegDecompressor *d, short *previous_dcs, uint32_t *eobrun) {
+  previous_dcs[0] = 0;
+  previous_dcs[1] = 0;
+  previous_dcs[2] = 0;
+  *eobrun = 0;
+
+  uint32_t offset = d->bits_left % 8;
+  if (offset != 0) {
+    d->bit_reservoir <<= offset;
+    d->bits_left -= offset;
+  }
+}
+
+/**
+ * Decode the band of AC coefficients of a block in a first scan, section G.1.2.2: coefficients come scaled up by
+ * 1 << Al, and an end-of-band code can end the band of the next blocks as well, which eobrun counts down
+ * Returns 0 on success, -1 if the block is invalid
+ */
+static int decode_ac_first(JpegCpuContext *ctx, JpegDecompressor *d, ColorComponentInfo *component,
+                           short *coefficients, uint64_t *nonzero, uint32_t count, uint32_t *eobrun) {
+  HuffmanTable *ac_table = &ctx->jpegInfo.ac_huffman_tables[component->ac_huffman_table_id];
+  HuffmanLookup *ac_lookup = &ctx->ac_huffman_lookups[component->ac_huffman_table_id];
+  uint32_t se = ctx->jpegInfo.se;
+  uint32_t al = ctx->jpegInfo.Al;
+
+  if (*eobrun > 0) {
+    (*eobrun)--;
+    return 0;
+  }
+
+  for (uint32_t k = ctx->jpegInfo.ss; k <= se; k++) {
+    uint8_t symbol = huff_decode(d, ac_table, ac_lookup);
+    if (symbol == (uint8_t) -1) {
+      report_mcu_error(d, "Error: Invalid AC code\n");
+      return -1;
+    }
+    uint32_t run = symbol >> 4;
+    uint32_t length = symbol & 0x0F;
+
+    if (length == 0) {
+      if (run == 15) {
+        // 16 zeros
+        k += 15;
+        continue;
+      }
+      // End of band for this block and (1 << run) - 1 more, plus run bits worth of blocks
+      *eobrun = (1u << run) - 1 + get_num_bits(d, run);
+      return 0;
+    }
+
+    k += run;
+    if (k > se) {
+      report_mcu_error(d, "Error: Invalid AC code - zeros exceeded the band %d > %d\n", k, se);
+      return -1;
+    }
+    int coeff = get_num_bits(d, length);
+    if (coeff < (1 << (length - 1))) {
+      coeff -= (1 << length) - 1;
+    }
+    if (k < count) {
+      coefficients[k] = coeff * (1 << al);
+    } else {
+      *nonzero |= 1ULL << k;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Refinement of coefficient k, if it is already non-zero: a correction bit that adds p1 to its magnitude
+ * Returns 1 if the coefficient is non-zero, 0 if it is still zero and no bit was read
+ */
+static inline int refine_coefficient(JpegDecompressor *d, short *coefficients, const uint64_t *nonzero,
+                                     uint32_t count, uint32_t k, int p1) {
+  if (k >= count) {
+    if ((*nonzero >> k & 1) == 0) {
+      return 0;
+    }
+    // Only the magnitude changes, which is not kept
+    get_num_bits(d, 1);
+    return 1;
+  }
+
+  if (coefficients[k] == 0) {
+    return 0;
+  }
+  if (get_num_bits(d, 1) && (coefficients[k] & p1) == 0) {
+    coefficients[k] += coefficients[k] >= 0 ? p1 : -p1;
+  }
+  return 1;
+}
+
+/**
+ * Decode the band of AC coefficients of a block in a refinement scan, section G.1.2.3: coefficients that become
+ * non-zero are coded like in a first scan, and every coefficient that already is non-zero gets a correction bit where
+ * the zero runs pass over it
+ * Returns 0 on success, -1 if the block is invalid
+ */
+static int decode_ac_refine(JpegCpuContext *ctx, JpegDecompressor *d, ColorComponentInfo *component,
+                            short *coefficients, uint64_t *nonzero, uint32_t count, uint32_t *eobrun) {
+  HuffmanTable *ac_table = &ctx->jpegInfo.ac_huffman_tables[component->ac_huffman_table_id];
+  HuffmanLookup *ac_lookup = &ctx->ac_huffman_lookups[component->ac_huffman_table_id];
+  uint32_t se = ctx->jpegInfo.se;
+  int p1 = 1 << ctx->jpegInfo.Al;
+  uint32_t k = ctx->jpegInfo.ss;
+
+  if (*eobrun == 0) {
+    for (; k <= se; k++) {
+      uint8_t symbol = huff_decode(d, ac_table, ac_lookup);
+      if (symbol == (uint8_t) -1) {
+        report_mcu_error(d, "Error: Invalid AC code\n");
+        return -1;
+      }
+      uint32_t run = symbol >> 4;
+      uint32_t length = symbol & 0x0F;
+      int value = 0;
+
+      if (length != 0) {
+        // A coefficient that becomes non-zero is +-1 at this bit
+        if (length != 1) {
+          report_mcu_error(d, "Error: Invalid AC refinement code\n");
+          return -1;
+        }
+        value = get_num_bits(d, 1) ? p1 : -p1;
+      } else if (run != 15) {
+        *eobrun = (1u << run) + get_num_bits(d, run);
+        break;
+      }
+
+      // Skip run zero coefficients, the new coefficient goes to the next zero one
+      for (; k <= se; k++) {
+        if (!refine_coefficient(d, coefficients, nonzero, count, k, p1)) {
+          if (run == 0) {
+            break;
+          }
+          run--;
+        }
+      }
+      if (value != 0) {
+        if (k > se) {
+          report_mcu_error(d, "Error: Invalid AC code - zeros exceeded the band %d > %d\n", k, se);
+          return -1;
+        }
+        if (k < count) {
+          coefficients[k] = value;
+        } else {
+          *nonzero |= 1ULL << k;
+        }
+      }
+    }
+  }
+
+  if (*eobrun > 0) {
+    // The rest of the band stays zero, but its non-zero coefficients are still refined
+    for (; k <= se; k++) {
+      refine_coefficient(d, coefficients, nonzero, count, k, p1);
+    }
+    (*eobrun)--;
+  }
+
+  return 0;
+}
+
+/**
+ * Decode what the current scan holds of the block at (row, col) of a component into the store
+ * Returns 0 on success, -1 if the block is invalid
+ */
+static int decode_scan_block(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t color_index, uint32_t row,
+                             uint32_t col, short *previous_dc, uint32_t *eobrun) {
+  CoefficientStore *store = &ctx->coefficient_store;
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+  size_t block = stored_block_index(store, color_index, row, col);
+  short *coefficients = &store->coefficients[block * store->count];
+  uint64_t unused = 0;
+  uint64_t *nonzero = store->count > 1 && store->count < 64 ? &store->nonzero[block] : &unused;
+
+  if (ctx->jpegInfo.ss == 0) {
+    if (ctx->jpegInfo.Ah == 0) {
+      short dc;
+      if (decode_dc(ctx, d, component, &dc, previous_dc) != 0) {
+        return -1;
+      }
+      coefficients[0] = dc * (1 << ctx->jpegInfo.Al);
+    } else if (get_num_bits(d, 1)) {
+      coefficients[0] |= 1 << ctx->jpegInfo.Al;
+    }
+    return 0;
+  }
+
+  if (ctx->jpegInfo.Ah == 0) {
+    return decode_ac_first(ctx, d, component, coefficients, nonzero, store->count, eobrun);
+  }
+  return decode_ac_refine(ctx, d, component, coefficients, nonzero, store->count, eobrun);
+}
+
+/**
+ * Entropy decode the scan at d->ptr into the store. A scan of a single component goes through the blocks that hold
+ * part of the image, leaving out those that only pad MCUs (section A.2.2), interleaved scans go through whole MCUs
+ * Returns 0 on success, -1 if a block is invalid
+ */
+static int decode_scan(JpegCpuContext *ctx, JpegDecompressor *d) {
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  short previous_dcs[3] = {0};
+  uint32_t eobrun = 0;
+
+  if (ctx->scan_num_components == 1) {
+    uint32_t color_index = ctx->scan_components[0];
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    uint32_t width = (ctx->jpegInfo.image_width * component->h_samp_factor + ctx->jpegInfo.max_h_samp_factor - 1) /
+                     ctx->jpegInfo.max_h_samp_factor;
+    uint32_t height = (ctx->jpegInfo.image_height * component->v_samp_factor + ctx->jpegInfo.max_v_samp_factor - 1) /
+                      ctx->jpegInfo.max_v_samp_factor;
+    uint32_t blocks_per_row = (width + 7) / 8;
+    uint32_t block_rows = (height + 7) / 8;
+    uint32_t unit = 0;
+
+    for (uint32_t row = 0; row < block_rows; row++) {
+      for (uint32_t col = 0; col < blocks_per_row; col++, unit++) {
+        if (restart_interval != 0 && unit % restart_interval == 0) {
+          restart_scan(d, previous_dcs, &eobrun);
+        }
+        if (decode_scan_block(ctx, d, color_index, row, col, &previous_dcs[color_index], &eobrun) != 0) {
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  for (uint32_t mcu = 0; mcu < mcus_per_row * mcu_rows; mcu++) {
+    uint32_t mcu_row = mcu / mcus_per_row;
+    uint32_t mcu_col = mcu % mcus_per_row;
+    if (restart_interval != 0 && mcu % restart_interval == 0) {
+      restart_scan(d, previous_dcs, &eobrun);
+    }
+
+    for (uint32_t i = 0; i < ctx->scan_num_components; i++) {
+      uint32_t color_index = ctx->scan_components[i];
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          if (decode_scan_block(ctx, d, color_index, mcu_row * component->v_samp_factor + y,
+                                mcu_col * component->h_samp_factor + x, &previous_dcs[color_index], &eobrun) != 0) {
+            return -1;
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Whether the output needs what the current scan holds: AC scans are of no use when only the DC coefficient of each
+ * block is kept, and neither are scans of chroma alone with luma output
+ */
+static int scan_needed(JpegCpuContext *ctx) {
+  if (ctx->coefficient_store.count == 1 && ctx->jpegInfo.ss != 0) {
+    return 0;
+  }
+  if (ctx->output_format != JPEG_OUTPUT_LUMA) {
+    return 1;
+  }
+  for (uint32_t i = 0; i < ctx->scan_num_components; i++) {
+    if (ctx->scan_components[i] == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Entropy decode every scan of a progressive image into ctx->coefficient_store, from the scan whose SOS was just read
+ * up to EOI, along with the tables and restart intervals defined between scans. Scans the output does not need are
+ * skipped unread: at 1/8 scale (and coefficient output of the DC alone) that is every AC scan, most of the data. At
+ * other scales all scans are decoded, as a refinement scan depends on every earlier scan of its band, but only the
+ * coefficients the scale reads are kept (see CoefficientStore)
+ * Returns 0 on success, -1 if a scan is invalid or out of memory
+ */
+int decode_progressive_scans(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
+  char *data = d->data;
+  uint32_t length = d->length;
+
+  if (alloc_coefficient_store(ctx) != 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+
+  while (1) {
+    char *scan_end;
+    if (scan_needed(ctx)) {
+      // The bit reader pads the destuffed scan with zeros past its end rather than reading into the next marker
+      scan_end = load_entropy_segment(ctx);
+      if (scan_end == NULL) {
+        return -1;
+      }
+      int result = decode_scan(ctx, d);
+      d->data = data;
+      d->length = length;
+      if (result != 0) {
+        ctx->jpegInfo.valid = 0;
+        fprintf(stderr, "Error: Invalid progressive scan\n");
+        return -1;
+      }
+    } else {
+      scan_end = find_scan_end(d);
+    }
+
+    // Skip any fill bytes before the marker, files cut short just end with their last scan
+    d->ptr = scan_end;
+    while (d->ptr + 2 < d->data + length && (uint8_t) d->ptr[1] == 0xFF) {
+      d->ptr++;
+    }
+    if (d->ptr + 2 > d->data + length || (uint8_t) d->ptr[1] == M_EOI) {
+      return 0;
+    }
+
+    int result = 1;
+    while (ctx->jpegInfo.valid && result) {
+      result = read_next_marker(ctx);
+    }
+    if (!ctx->jpegInfo.valid) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * Copy a block of the store into buffer as decode_mcu would have decoded it: 64 coefficients in natural order
+ * Returns the zigzag index of the last non-zero coefficient
+ */
+static inline int load_stored_block(const CoefficientStore *store, size_t block, short *buffer) {
+  const short *coefficients = &store->coefficients[block * store->count];
+  int last_index = 0;
+
+  memset(buffer, 0, 64 * sizeof(short));
+  for (uint32_t k = 0; k < store->count; k++) {
+    if (coefficients[k] != 0) {
+      buffer[ZIGZAG_ORDER[k]] = coefficients[k];
+      last_index = k;
+    }
+  }
+  return last_index;
+}
+
+/**
+ * MCU loop of progressive images: the blocks of the MCUs [first_mcu, end_mcu) come from the store, and are inverse
+ * transformed into the sample planes, or kept as coefficients with coefficient output. There is no bitstream to read
+ * Returns 0
+ */
+int decode_mcus_progressive(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                            SamplePlanes *samples, short *previous_dcs) {
+  CoefficientStore *store = &ctx->coefficient_store;
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_row = first_mcu / mcus_per_row;
+  uint32_t mcu_col = first_mcu % mcus_per_row;
+  uint32_t block_size = ctx->block_size;
+  uint32_t coefficient_output = is_coefficient_output(ctx->output_format);
+  idct_function idct = select_idct(ctx);
+  short buffer[64];
+  (void) d;
+  (void) previous_dcs;
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      if (samples->planes[color_index] == NULL) {
+        continue;
+      }
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+      uint32_t plane_stride = samples->strides[color_index];
+      uint32_t plane_row = (mcu_row - samples->first_mcu_row) * component->v_samp_factor;
+
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          uint32_t col = mcu_col * component->h_samp_factor + x;
+          size_t stored = stored_block_index(store, color_index, mcu_row * component->v_samp_factor + y, col);
+          int last_index = load_stored_block(store, stored, buffer);
+          short *plane = samples->planes[color_index];
+          if (coefficient_output) {
+            store_coefficients(ctx, q_table, buffer,
+                               &plane[(plane_row + y) * plane_stride + col * ctx->coefficient_count]);
+          } else {
+            short *block = &plane[(plane_row + y) * block_size * plane_stride + col * block_size];
+            transform_block(idct, q_table, block_size, buffer, last_index, block, plane_stride);
+          }
+        }
+      }
+    }
+
+    if (++mcu_col == mcus_per_row) {
+      mcu_col = 0;
+      mcu_row++;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Counterpart of entropy_decode_mcus for progressive images, the blocks of the MCUs [first_mcu, end_mcu) come from
+ * the store
+ */
+void load_stored_mcus(JpegCpuContext *ctx, uint32_t first_mcu, uint32_t end_mcu, short *blocks, int *last_indices) {
+  CoefficientStore *store = &ctx->coefficient_store;
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    uint32_t mcu_row = mcu / mcus_per_row;
+    uint32_t mcu_col = mcu % mcus_per_row;
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          size_t block = stored_block_index(store, color_index, mcu_row * component->v_samp_factor + y,
+                                            mcu_col * component->h_samp_factor + x);
+          *last_indices++ = load_stored_block(store, block, blocks);
+          blocks += 64;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,258 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Crop and resize stage of the CPU decoder, fed with the pixel rows of the (DCT scaled) image as they are decoded.
+ *
+ * Resampling is separable. Every source row within the crop is resampled horizontally once, into a ring that holds
+ * the rows still needed by the next output rows, and an output row is formed as soon as its last source row arrives.
+ * Both axes are described by ResizeAxis tables built once per image, so the per-pixel work is a few multiply-adds.
+ *
+ * Weights are fixed point with RESIZE_WEIGHT_BITS fractional bits and always add up to one, so flat areas (and the
+ * alpha of RGBA) come out exactly as they went in. Horizontally resampled values keep RESIZE_ROW_BITS fractional bits
+ * in 16 bits, the vertical sums of those fit in 32 bits.
+ */
+
+#define RESIZE_WEIGHT_BITS 12
+#define RESIZE_WEIGHT_ONE (1 << RESIZE_WEIGHT_BITS)
+#define RESIZE_ROW_BITS 8
+#define RESIZE_ROW_SHIFT (RESIZE_WEIGHT_BITS - RESIZE_ROW_BITS) // from horizontal sums to resampled values
+
+static void free_resize_axis(ResizeAxis *axis) {
+  free(axis->starts);
+  free(axis->counts);
+  free(axis->weights);
+  memset(axis, 0, sizeof(ResizeAxis));
+}
+
+/**
+ * Turn the real valued weights of one output index into fixed point weights that add up to exactly one. Each weight
+ * is the difference between the rounded running sums of the weights up to and before it, so that none goes negative
+ * however many taps share the rounding error
+ */
+static void quantize_weights(const double *weights, uint32_t count, uint16_t *fixed) {
+  double total = 0;
+  for (uint32_t k = 0; k < count; k++) {
+    total += weights[k];
+  }
+
+  double sum = 0;
+  long previous = 0;
+  for (uint32_t k = 0; k < count; k++) {
+    sum += weights[k];
+    long rounded = k + 1 == count ? RESIZE_WEIGHT_ONE : lround(sum / total * RESIZE_WEIGHT_ONE);
+    fixed[k] = (uint16_t)(rounded - previous);
+    previous = rounded;
+  }
+}
+
+/**
+ * Build the resampling of source_length source pixels from source_start onwards (the crop, in pixels of a source of
+ * source_size pixels) to output_size pixels
+ * Returns 0 on success, -1 if out of memory
+ */
+static int init_resize_axis(ResizeAxis *axis, double source_start, double source_length, uint32_t source_size,
+                            uint32_t output_size, JpegResizeFilter filter) {
+  double scale = source_length / output_size;
+  axis->max_taps = filter == JPEG_RESIZE_AREA ? (uint32_t) ceil(scale) + 1 : 2;
+  axis->starts = (uint32_t *) malloc(output_size * sizeof(uint32_t));
+  axis->counts = (uint32_t *) malloc(output_size * sizeof(uint32_t));
+  axis->weights = (uint16_t *) calloc((size_t) output_size * axis->max_taps, sizeof(uint16_t));
+  double *weights = (double *) malloc(axis->max_taps * sizeof(double));
+  if (axis->starts == NULL || axis->counts == NULL || axis->weights == NULL || weights == NULL) {
+    free(weights);
+    free_resize_axis(axis);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < output_size; i++) {
+    int64_t first, last;
+    if (filter == JPEG_RESIZE_AREA) {
+      // Every source pixel counts as much as it overlaps the span of the output pixel
+      double low = source_start + i * scale;
+      double high = low + scale;
+      first = (int64_t) floor(low);
+      last = (int64_t) ceil(high) - 1;
+      if (last < first) {
+        last = first;
+      }
+      for (int64_t j = first; j <= last; j++) {
+        double overlap = fmin(high, j + 1.0) - fmax(low, (double) j);
+        weights[j - first] = overlap > 0 ? overlap / scale : 0;
+      }
+    } else {
+      // Pixel centers are at half-integer positions
+      double center = source_start + (i + 0.5) * scale - 0.5;
+      first = (int64_t) floor(center);
+      last = first + 1;
+      weights[0] = 1.0 - (center - first);
+      weights[1] = center - first;
+    }
+
+    // Taps past the edges of the source repeat its edge pixels
+    while (first < 0 && last > first) {
+      weights[1] += weights[0];
+      memmove(weights, weights + 1, (size_t)(last - first) * sizeof(double));
+      first++;
+    }
+    while (last >= (int64_t) source_size && last > first) {
+      weights[last - first - 1] += weights[last - first];
+      last--;
+    }
+    if (first < 0) {
+      first = 0;
+    }
+    if (first >= (int64_t) source_size) {
+      first = source_size - 1;
+    }
+
+    axis->starts[i] = (uint32_t) first;
+    axis->counts[i] = (uint32_t)(last - first + 1);
+    quantize_weights(weights, axis->counts[i], &axis->weights[(size_t) i * axis->max_taps]);
+  }
+
+  free(weights);
+  return 0;
+}
+
+/**
+ * Prepare the resize of the crop rectangle (in pixels of a source_width x source_height source) to the size of
+ * resize, for rows of pixel_size bytes per pixel. The caller sets where the output goes
+ * Returns 0 on success, -1 if out of memory
+ */
+int init_resizer(JpegCpuResizer *resizer, const JpegResize *resize, uint32_t pixel_size, uint32_t source_width,
+                 uint32_t source_height, double crop_x, double crop_y, double crop_width, double crop_height) {
+  memset(resizer, 0, sizeof(JpegCpuResizer));
+  resizer->width = resize->width;
+  resizer->height = resize->height;
+  resizer->pixel_size = pixel_size;
+
+  if (init_resize_axis(&resizer->horizontal, crop_x, crop_width, source_width, resize->width, resize->filter) != 0 ||
+      init_resize_axis(&resizer->vertical, crop_y, crop_height, source_height, resize->height, resize->filter) != 0) {
+    free_resizer(resizer);
+    return -1;
+  }
+
+  size_t row_length = (size_t) resize->width * pixel_size;
+  resizer->ring = (uint16_t *) malloc(row_length * resizer->vertical.max_taps * sizeof(uint16_t));
+  resizer->sums = (uint32_t *) malloc(row_length * sizeof(uint32_t));
+  if (resizer->ring == NULL || resizer->sums == NULL) {
+    free_resizer(resizer);
+    return -1;
+  }
+  return 0;
+}
+
+void free_resizer(JpegCpuResizer *resizer) {
+  free_resize_axis(&resizer->horizontal);
+  free_resize_axis(&resizer->vertical);
+  free(resizer->ring);
+  free(resizer->sums);
+  resizer->ring = NULL;
+  resizer->sums = NULL;
+}
+
+/**
+ * Source rows the resize needs, every row from the last one on can be left undecoded
+ */
+uint32_t resizer_source_rows(JpegCpuResizer *resizer) {
+  uint32_t last = resizer->height - 1;
+  return resizer->vertical.starts[last] + resizer->vertical.counts[last];
+}
+
+/**
+ * Horizontal resampling of one source row, specialised for the number of bytes per pixel
+ */
+static inline __attribute__((always_inline)) void resample_row_pixels(const ResizeAxis *axis, const uint8_t *source,
+                                                                       uint16_t *row, uint32_t width,
+                                                                       uint32_t pixel_size) {
+  for (uint32_t i = 0; i < width; i++) {
+    const uint8_t *taps = &source[(size_t) axis->starts[i] * pixel_size];
+    const uint16_t *weights = &axis->weights[(size_t) i * axis->max_taps];
+    uint32_t sums[4] = {0, 0, 0, 0};
+
+    for (uint32_t k = 0; k < axis->counts[i]; k++) {
+      for (uint32_t c = 0; c < pixel_size; c++) {
+        sums[c] += weights[k] * taps[k * pixel_size + c];
+      }
+    }
+    for (uint32_t c = 0; c < pixel_size; c++) {
+      row[i * pixel_size + c] = (uint16_t)((sums[c] + (1 << (RESIZE_ROW_SHIFT - 1))) >> RESIZE_ROW_SHIFT);
+    }
+  }
+}
+
+static void resample_row(JpegCpuResizer *resizer, const uint8_t *source, uint16_t *row) {
+  switch (resizer->pixel_size) {
+    case 1:
+      resample_row_pixels(&resizer->horizontal, source, row, resizer->width, 1);
+      break;
+    case 3:
+      resample_row_pixels(&resizer->horizontal, source, row, resizer->width, 3);
+      break;
+    default:
+      resample_row_pixels(&resizer->horizontal, source, row, resizer->width, 4);
+      break;
+  }
+}
+
+/**
+ * Vertical resampling of output row out_row from the rows in the ring, into out
+ */
+static void resample_column(JpegCpuResizer *resizer, uint32_t out_row, uint8_t *out) {
+  const ResizeAxis *axis = &resizer->vertical;
+  const uint16_t *weights = &axis->weights[(size_t) out_row * axis->max_taps];
+  uint32_t row_length = resizer->width * resizer->pixel_size;
+  uint32_t *sums = resizer->sums;
+
+  memset(sums, 0, row_length * sizeof(uint32_t));
+  for (uint32_t k = 0; k < axis->counts[out_row]; k++) {
+    const uint16_t *row = &resizer->ring[(size_t)((axis->starts[out_row] + k) % axis->max_taps) * row_length];
+    uint32_t weight = weights[k];
+    for (uint32_t x = 0; x < row_length; x++) {
+      sums[x] += weight * row[x];
+    }
+  }
+
+  const uint32_t shift = RESIZE_WEIGHT_BITS + RESIZE_ROW_BITS;
+  for (uint32_t x = 0; x < row_length; x++) {
+    uint32_t value = (sums[x] + (1u << (shift - 1))) >> shift;
+    out[x] = value > 255 ? 255 : value;
+  }
+}
+
+/**
+ * Row callback of the decoder: takes pixel rows [first_row, first_row + row_count) of the source and produces every
+ * output row whose source rows are then complete
+ */
+void resize_rows(void *user_data, const uint8_t *rows, uint32_t first_row, uint32_t row_count, uint32_t width,
+                 uint32_t stride) {
+  JpegCpuResizer *resizer = (JpegCpuResizer *) user_data;
+  const ResizeAxis *axis = &resizer->vertical;
+  uint32_t row_length = resizer->width * resizer->pixel_size;
+  (void) width;
+
+  for (uint32_t y = first_row; y < first_row + row_count && resizer->next_row < resizer->height; y++) {
+    if (y < axis->starts[resizer->next_row]) {
+      continue;
+    }
+    resample_row(resizer, &rows[(size_t)(y - first_row) * stride],
+                 &resizer->ring[(size_t)(y % axis->max_taps) * row_length]);
+
+    while (resizer->next_row < resizer->height &&
+           axis->starts[resizer->next_row] + axis->counts[resizer->next_row] - 1 == y) {
+      if (resizer->row_callback != NULL) {
+        resample_column(resizer, resizer->next_row, resizer->pixels);
+        resizer->row_callback(resizer->row_callback_data, resizer->pixels, resizer->next_row, 1, resizer->width,
+                              row_length);
+      } else {
+        resample_column(resizer, resizer->next_row, &resizer->pixels[(size_t) resizer->next_row * resizer->stride]);
+      }
+      resizer->next_row++;
+    }
+  }
+}
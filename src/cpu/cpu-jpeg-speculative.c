@@ -0,0 +1,436 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Speculative parallel decoding of the CPU decoder, for images without restart markers.
+ *
+ * Without restart markers nothing tells where an MCU starts in the entropy coded data, so the data is cut into chunks
+ * and every thread simply assumes an MCU starts at the first byte of its chunk. Huffman codes resynchronise quickly,
+ * so a stream that decodes on past the end of its chunk soon hits a block start recorded by the next stream, and from
+ * there on both decode the same blocks. Only the DC predictions differ, by a constant per component, which is fixed
+ * up when the blocks are reconstructed. Any stream that never synchronises makes the image fall back to the serial
+ * decoder.
+ */
+
+#define SPECULATIVE_MIN_CHUNK 16384 // not worthwhile splitting entropy coded data into chunks smaller than this
+
+/**
+ * Block start recorded by a speculative stream while decoding its own chunk, used to detect synchronisation
+ */
+typedef struct SyncRecord {
+  uint64_t position;      // bit_position at the start of the block
+  short previous_dcs[3];  // DC predictions before the block
+  uint8_t error;          // the block could not be decoded
+} SyncRecord;
+
+/**
+ * One thread's share of a speculative decode. Stream 0 starts at the beginning of the entropy coded data, every
+ * other stream at an arbitrary byte of it, assuming it is the start of an MCU with all DC predictions at 0. Once a
+ * stream runs into a block start (bit position and block within the MCU) recorded by a later stream, both decode
+ * identical blocks from there on, except for a constant DC offset per component.
+ */
+typedef struct SpeculativeStream {
+  JpegDecompressor d;
+  uint64_t limit;      // bit position where the chunk of this stream ends
+  short *coefficients;   // 64 coefficients per decoded block, as decoded
+  uint8_t *last_indices; // what decode_mcu returned for every decoded block
+  SyncRecord *records; // one per block decoded within the chunk
+  uint32_t chunk_blocks;
+  uint32_t block_count;
+  uint32_t capacity;
+  uint32_t first_overflow_error; // first block past the chunk that could not be decoded
+  short previous_dcs[3];
+
+  // Where decoding past the chunk synchronised with a later stream
+  int synced;
+  uint32_t sync_block;        // first block of this stream that is not used
+  uint32_t sync_stream;       // stream continuing from there
+  uint32_t sync_stream_block; // block of sync_stream that matches sync_block
+  short sync_dc_delta[3];     // previous_dcs of this stream minus those of sync_stream at that point
+} SpeculativeStream;
+
+/**
+ * Run of consecutive image blocks taken from one stream
+ */
+typedef struct SpeculativeSegment {
+  uint32_t first_block; // index in the whole image, counted in decoding order
+  uint32_t stream;
+  uint32_t stream_block;
+  short dc_offset[3]; // added to the DC predictions of the stream to get the true ones
+} SpeculativeSegment;
+
+typedef struct SpeculativeDecode {
+  JpegCpuContext *ctx;
+  SpeculativeStream *streams;
+  uint32_t stream_count;
+  uint32_t total_blocks;
+  uint32_t blocks_per_mcu;
+  uint8_t block_components[6]; // component of every block of an MCU, in decoding order
+  uint64_t entropy_end;        // bit position of the end of the destuffed entropy coded data
+  uint32_t next_stream;        // claimed atomically
+
+  SpeculativeSegment *segments;
+  uint32_t segment_count;
+  OutputRows *output;
+  uint32_t mcu_rows;
+  uint32_t next_row; // claimed atomically
+  int error;
+} SpeculativeDecode;
+
+/**
+ * Position of the next unread bit, in bits from the start of the destuffed data, so that it does not depend on how
+ * far ahead the bit reservoir happens to be filled
+ */
+static uint64_t bit_position(JpegDecompressor *d) {
+  return (uint64_t)(d->ptr - d->data) * 8 + d->padding_bits - d->bits_left;
+}
+
+static int grow_speculative_stream(SpeculativeStream *stream, int with_records) {
+  uint32_t capacity = stream->capacity * 2;
+  short *coefficients = (short *) realloc(stream->coefficients, (size_t) capacity * 64 * sizeof(short));
+  if (coefficients == NULL) {
+    return -1;
+  }
+  stream->coefficients = coefficients;
+
+  uint8_t *last_indices = (uint8_t *) realloc(stream->last_indices, capacity);
+  if (last_indices == NULL) {
+    return -1;
+  }
+  stream->last_indices = last_indices;
+
+  if (with_records) {
+    SyncRecord *records = (SyncRecord *) realloc(stream->records, (size_t) capacity * sizeof(SyncRecord));
+    if (records == NULL) {
+      return -1;
+    }
+    stream->records = records;
+  }
+
+  stream->capacity = capacity;
+  return 0;
+}
+
+/**
+ * First pass: every stream decodes the blocks starting within its own chunk and records where they start
+ */
+static void *decode_speculative_chunks(void *arg) {
+  SpeculativeDecode *job = (SpeculativeDecode *) arg;
+  uint32_t index;
+
+  while ((index = __atomic_fetch_add(&job->next_stream, 1, __ATOMIC_RELAXED)) < job->stream_count) {
+    SpeculativeStream *stream = &job->streams[index];
+    uint32_t block = 0;
+
+    while (block < job->total_blocks) {
+      uint64_t position = bit_position(&stream->d);
+      if (position >= stream->limit) {
+        break;
+      }
+      if (block == stream->capacity && grow_speculative_stream(stream, 1) != 0) {
+        __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+        break;
+      }
+
+      uint8_t component = job->block_components[block % job->blocks_per_mcu];
+      SyncRecord *record = &stream->records[block];
+      record->position = position;
+      memcpy(record->previous_dcs, stream->previous_dcs, sizeof(record->previous_dcs));
+      int last_index = decode_block(job->ctx, &stream->d, component, &stream->coefficients[(size_t) block * 64],
+                                    &stream->previous_dcs[component]);
+      record->error = last_index < 0;
+      stream->last_indices[block] = last_index;
+      block++;
+    }
+
+    stream->chunk_blocks = block;
+    stream->block_count = block;
+  }
+
+  return NULL;
+}
+
+/**
+ * Second pass: every stream but the last keeps decoding past its chunk until it reaches a block start recorded by
+ * one of the following streams
+ */
+static void *synchronise_speculative_streams(void *arg) {
+  SpeculativeDecode *job = (SpeculativeDecode *) arg;
+  uint32_t index;
+
+  while ((index = __atomic_fetch_add(&job->next_stream, 1, __ATOMIC_RELAXED)) < job->stream_count - 1) {
+    SpeculativeStream *stream = &job->streams[index];
+    uint32_t block = stream->block_count;
+    uint32_t target = index + 1;
+    uint32_t target_block = 0;
+
+    while (block < job->total_blocks) {
+      uint64_t position = bit_position(&stream->d);
+      if (position >= job->entropy_end) {
+        break;
+      }
+
+      // Records of a stream are sorted by position, move on to the next stream once we are past them all
+      while (target < job->stream_count) {
+        SpeculativeStream *next = &job->streams[target];
+        while (target_block < next->chunk_blocks && next->records[target_block].position < position) {
+          target_block++;
+        }
+        if (target_block < next->chunk_blocks) {
+          break;
+        }
+        target++;
+        target_block = 0;
+      }
+
+      if (target < job->stream_count) {
+        SyncRecord *record = &job->streams[target].records[target_block];
+        if (record->position == position && target_block % job->blocks_per_mcu == block % job->blocks_per_mcu) {
+          stream->synced = 1;
+          stream->sync_block = block;
+          stream->sync_stream = target;
+          stream->sync_stream_block = target_block;
+          for (int i = 0; i < 3; i++) {
+            stream->sync_dc_delta[i] = stream->previous_dcs[i] - record->previous_dcs[i];
+          }
+          break;
+        }
+      }
+
+      if (block == stream->capacity && grow_speculative_stream(stream, 0) != 0) {
+        __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+        break;
+      }
+
+      uint8_t component = job->block_components[block % job->blocks_per_mcu];
+      int last_index = decode_block(job->ctx, &stream->d, component, &stream->coefficients[(size_t) block * 64],
+                                    &stream->previous_dcs[component]);
+      if (last_index < 0 && stream->first_overflow_error == UINT32_MAX) {
+        stream->first_overflow_error = block;
+      }
+      stream->last_indices[block] = last_index;
+      block++;
+    }
+
+    stream->block_count = block;
+  }
+
+  return NULL;
+}
+
+static int speculative_blocks_valid(SpeculativeStream *stream, uint32_t first_block, uint32_t end_block) {
+  for (uint32_t block = first_block; block < end_block && block < stream->chunk_blocks; block++) {
+    if (stream->records[block].error) {
+      return 0;
+    }
+  }
+  return stream->first_overflow_error < first_block || stream->first_overflow_error >= end_block;
+}
+
+/**
+ * Follow the synchronisation points from stream 0 to build the list of segments covering the whole image
+ * Returns 0 on success, -1 if the streams do not add up to a valid image
+ */
+static int link_speculative_streams(SpeculativeDecode *job) {
+  uint32_t image_block = 0;
+  uint32_t stream_index = 0;
+  uint32_t stream_block = 0;
+  short dc_offset[3] = {0, 0, 0};
+
+  job->segments = (SpeculativeSegment *) malloc(job->stream_count * sizeof(SpeculativeSegment));
+  if (job->segments == NULL) {
+    return -1;
+  }
+
+  while (image_block < job->total_blocks) {
+    SpeculativeStream *stream = &job->streams[stream_index];
+    uint32_t end_block = stream->synced ? stream->sync_block : stream->block_count;
+    if (end_block - stream_block > job->total_blocks - image_block) {
+      end_block = stream_block + job->total_blocks - image_block;
+    }
+    if (end_block <= stream_block || !speculative_blocks_valid(stream, stream_block, end_block)) {
+      return -1;
+    }
+
+    SpeculativeSegment *segment = &job->segments[job->segment_count++];
+    segment->first_block = image_block;
+    segment->stream = stream_index;
+    segment->stream_block = stream_block;
+    memcpy(segment->dc_offset, dc_offset, sizeof(dc_offset));
+
+    image_block += end_block - stream_block;
+    if (image_block == job->total_blocks) {
+      break;
+    }
+    if (!stream->synced) {
+      return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+      dc_offset[i] += stream->sync_dc_delta[i];
+    }
+    stream_index = stream->sync_stream;
+    stream_block = stream->sync_stream_block;
+  }
+
+  return 0;
+}
+
+/**
+ * Last pass: inverse transform and convert MCU rows, fixing up the DC coefficients of every segment
+ */
+static void *reconstruct_speculative_rows(void *arg) {
+  SpeculativeDecode *job = (SpeculativeDecode *) arg;
+  JpegCpuContext *ctx = job->ctx;
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t block_size = ctx->block_size;
+  idct_function idct = select_idct(ctx);
+  SamplePlanes samples;
+  short buffer[64];
+  uint32_t row;
+
+  if (alloc_sample_planes(ctx, &samples, 1) != 0) {
+    __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  while ((row = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED)) < job->mcu_rows) {
+    uint32_t image_block = row * mcus_per_row * job->blocks_per_mcu;
+    uint32_t segment_index = 0;
+    while (segment_index + 1 < job->segment_count && job->segments[segment_index + 1].first_block <= image_block) {
+      segment_index++;
+    }
+    samples.first_mcu_row = row;
+
+    for (uint32_t mcu_col = 0; mcu_col < mcus_per_row; mcu_col++) {
+      for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+        ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+        QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+        uint32_t plane_stride = samples.strides[color_index];
+
+        for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+          for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+            if (segment_index + 1 < job->segment_count && job->segments[segment_index + 1].first_block == image_block) {
+              segment_index++;
+            }
+            SpeculativeSegment *segment = &job->segments[segment_index];
+            SpeculativeStream *stream = &job->streams[segment->stream];
+            size_t stream_block = segment->stream_block + (image_block - segment->first_block);
+            image_block++;
+            if (samples.planes[color_index] == NULL) {
+              continue;
+            }
+
+            memcpy(buffer, &stream->coefficients[stream_block * 64], sizeof(buffer));
+            buffer[0] += segment->dc_offset[color_index];
+            if (is_coefficient_output(ctx->output_format)) {
+              uint32_t block_col = mcu_col * component->h_samp_factor + x;
+              store_coefficients(ctx, q_table, buffer,
+                                 &samples.planes[color_index][y * plane_stride + block_col * ctx->coefficient_count]);
+              continue;
+            }
+
+            short *block = &samples.planes[color_index][(y * block_size) * plane_stride +
+                                                        (mcu_col * component->h_samp_factor + x) * block_size];
+            transform_block(idct, q_table, block_size, buffer, stream->last_indices[stream_block], block,
+                            plane_stride);
+          }
+        }
+      }
+    }
+
+    convert_mcu_rows(ctx, &samples, row, row + 1, job->output);
+  }
+
+  free_sample_planes(ctx, &samples);
+  return NULL;
+}
+
+/**
+ * Decode an image without restart markers on ctx->num_threads threads, in the same way as synchronise_tasklets on
+ * the DPU: the entropy coded data is cut into chunks that are decoded speculatively, every stream decodes past its
+ * chunk until it synchronises with the next one, and the DC predictions are fixed up when the blocks are
+ * reconstructed
+ * Returns 1 if the image was decoded, 0 if it should be decoded serially instead
+ */
+int decompress_speculative(JpegCpuContext *ctx, OutputRows *output) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  JpegDecompressor *d = &ctx->decompressor;
+  char *entropy_start = d->ptr;
+  char *entropy_end = d->data + d->length;
+  uint64_t entropy_length = entropy_end - entropy_start;
+  uint32_t stream_count = ctx->num_threads;
+  if (stream_count > entropy_length / SPECULATIVE_MIN_CHUNK) {
+    stream_count = entropy_length / SPECULATIVE_MIN_CHUNK;
+  }
+  if (stream_count < 2 || d->bits_left != 0) {
+    return 0;
+  }
+
+  SpeculativeDecode job;
+  memset(&job, 0, sizeof(SpeculativeDecode));
+  job.ctx = ctx;
+  job.output = output;
+  job.mcu_rows = mcu_rows;
+  job.stream_count = stream_count;
+  job.entropy_end = (uint64_t)(entropy_end - d->data) * 8;
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    for (uint32_t i = 0; i < component->h_samp_factor * component->v_samp_factor; i++) {
+      job.block_components[job.blocks_per_mcu++] = color_index;
+    }
+  }
+  job.total_blocks = mcus_per_row * mcu_rows * job.blocks_per_mcu;
+
+  job.streams = (SpeculativeStream *) calloc(stream_count, sizeof(SpeculativeStream));
+  if (job.streams == NULL) {
+    return 0;
+  }
+
+  int result = 0;
+  for (uint32_t i = 0; i < stream_count; i++) {
+    SpeculativeStream *stream = &job.streams[i];
+    char *start = entropy_start + entropy_length * i / stream_count;
+    char *end = entropy_start + entropy_length * (i + 1) / stream_count;
+
+    stream->d = *d;
+    stream->d.ptr = start;
+    stream->d.quiet = 1;
+    stream->limit = (uint64_t)(end - d->data) * 8;
+    stream->first_overflow_error = UINT32_MAX;
+    // Room for the blocks of the chunk plus some slack, assuming blocks are spread evenly over the data
+    stream->capacity = (uint64_t) job.total_blocks * (end - start) / entropy_length + 1024;
+    stream->coefficients = (short *) malloc((size_t) stream->capacity * 64 * sizeof(short));
+    stream->last_indices = (uint8_t *) malloc(stream->capacity);
+    stream->records = (SyncRecord *) malloc((size_t) stream->capacity * sizeof(SyncRecord));
+    if (stream->coefficients == NULL || stream->last_indices == NULL || stream->records == NULL) {
+      goto cleanup;
+    }
+  }
+
+  run_on_threads(stream_count, decode_speculative_chunks, &job);
+  job.next_stream = 0;
+  if (!job.error) {
+    run_on_threads(stream_count - 1, synchronise_speculative_streams, &job);
+  }
+  if (job.error || link_speculative_streams(&job) != 0) {
+    goto cleanup;
+  }
+
+  run_on_threads(ctx->num_threads < mcu_rows ? ctx->num_threads : mcu_rows, reconstruct_speculative_rows, &job);
+  result = !job.error;
+
+cleanup:
+  for (uint32_t i = 0; i < stream_count; i++) {
+    free(job.streams[i].coefficients);
+    free(job.streams[i].last_indices);
+    free(job.streams[i].records);
+  }
+  free(job.streams);
+  free(job.segments);
+  return result;
+}
@@ -0,0 +1,150 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu-jpeg.h"
+
+/*
+ * Cache of decoded Huffman and quantization tables, shared by the contexts of a batch.
+ *
+ * Encoders tend to write the same few DHT and DQT segments into every file, so the tables are keyed by the bytes that
+ * define them: a hit copies the ready tables (including the Huffman lookups and the IDCT prescale) instead of parsing
+ * and building them again. Entries are replaced round robin once the cache is full.
+ */
+
+// FNV-1a, cheap and good enough to tell a handful of tables apart before the bytes are compared
+static uint64_t hash_table_bytes(const uint8_t *bytes, uint32_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int entry_matches(uint64_t entry_hash, uint32_t entry_length, const uint8_t *entry_key, uint64_t hash,
+                         const uint8_t *key, uint32_t length) {
+  return entry_length == length && entry_hash == hash && memcmp(entry_key, key, length) == 0;
+}
+
+/**
+ * Allocate an empty cache, to be given to any number of contexts with jpeg_cpu_set_table_cache
+ */
+JpegCpuTableCache *jpeg_cpu_create_table_cache(void) {
+  JpegCpuTableCache *cache = (JpegCpuTableCache *) calloc(1, sizeof(JpegCpuTableCache));
+  if (cache != NULL) {
+    pthread_mutex_init(&cache->lock, NULL);
+  }
+  return cache;
+}
+
+/**
+ * Free the cache, the contexts using it must not decode any more files
+ */
+void jpeg_cpu_destroy_table_cache(JpegCpuTableCache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+/**
+ * Copy the tables built from the length bytes at key into h_table and lookup
+ * Returns 1 if the cache has them, 0 otherwise
+ */
+int find_cached_huffman_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length, HuffmanTable *h_table,
+                              HuffmanLookup *lookup) {
+  uint64_t hash = hash_table_bytes(key, length);
+  int found = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  for (uint32_t i = 0; i < TABLE_CACHE_ENTRIES; i++) {
+    CachedHuffmanTable *entry = &cache->huffman[i];
+    if (entry_matches(entry->hash, entry->length, entry->key, hash, key, length)) {
+      *h_table = entry->table;
+      *lookup = entry->lookup;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return found;
+}
+
+/**
+ * Remember the tables built from the length bytes at key (at most HUFFMAN_TABLE_KEY_SIZE)
+ */
+void cache_huffman_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length, const HuffmanTable *h_table,
+                         const HuffmanLookup *lookup) {
+  uint64_t hash = hash_table_bytes(key, length);
+
+  pthread_mutex_lock(&cache->lock);
+  // Another context may have added the same table in the meantime
+  for (uint32_t i = 0; i < TABLE_CACHE_ENTRIES; i++) {
+    CachedHuffmanTable *entry = &cache->huffman[i];
+    if (entry_matches(entry->hash, entry->length, entry->key, hash, key, length)) {
+      pthread_mutex_unlock(&cache->lock);
+      return;
+    }
+  }
+
+  CachedHuffmanTable *entry = &cache->huffman[cache->next_huffman];
+  cache->next_huffman = (cache->next_huffman + 1) % TABLE_CACHE_ENTRIES;
+  entry->hash = hash;
+  entry->length = length;
+  memcpy(entry->key, key, length);
+  entry->table = *h_table;
+  entry->lookup = *lookup;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Copy the table formed from the length bytes at key into q_table
+ * Returns 1 if the cache has it, 0 otherwise
+ */
+int find_cached_quantization_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length,
+                                   QuantizationTable *q_table) {
+  uint64_t hash = hash_table_bytes(key, length);
+  int found = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  for (uint32_t i = 0; i < TABLE_CACHE_ENTRIES; i++) {
+    CachedQuantizationTable *entry = &cache->quantization[i];
+    if (entry_matches(entry->hash, entry->length, entry->key, hash, key, length)) {
+      *q_table = entry->table;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return found;
+}
+
+/**
+ * Remember the table formed from the length bytes at key (at most QUANTIZATION_TABLE_KEY_SIZE)
+ */
+void cache_quantization_table(JpegCpuTableCache *cache, const uint8_t *key, uint32_t length,
+                              const QuantizationTable *q_table) {
+  uint64_t hash = hash_table_bytes(key, length);
+
+  pthread_mutex_lock(&cache->lock);
+  for (uint32_t i = 0; i < TABLE_CACHE_ENTRIES; i++) {
+    CachedQuantizationTable *entry = &cache->quantization[i];
+    if (entry_matches(entry->hash, entry->length, entry->key, hash, key, length)) {
+      pthread_mutex_unlock(&cache->lock);
+      return;
+    }
+  }
+
+  CachedQuantizationTable *entry = &cache->quantization[cache->next_quantization];
+  cache->next_quantization = (cache->next_quantization + 1) % TABLE_CACHE_ENTRIES;
+  entry->hash = hash;
+  entry->length = length;
+  memcpy(entry->key, key, length);
+  entry->table = *q_table;
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -4,7 +4,7 @@
 
 #include "dpu-jpeg.h"
 
-__mram_noinit short MCU_buffer[NR_TASKLETS][16776960 / NR_TASKLETS];
+__mram_noinit short MCU_buffer[NR_TASKLETS][MCU_BUFFER_LENGTH / NR_TASKLETS];
 
 #define PREWRITE_SIZE 768
 __dma_aligned short MCU_buffer_cache[NR_TASKLETS][PREWRITE_SIZE];
@@ -23,6 +23,8 @@ static void concat_adjust_mcus(JpegDecompressor *d, int row, int col);
 
 static void inverse_dct_component(JpegDecompressor *d, int cache_index);
 static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int cache_index, int v, int h);
+static void level_shift_block(JpegDecompressor *d, int cache_index);
+static void write_block_rows(JpegDecompressor *d, int cache_index, int plane_index, int plane_width);
 
 void decode_bitstream(JpegDecompressor *d) {
   short previous_dcs[3] = {0};
@@ -64,7 +66,7 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
   // Tasklet i has to overflow to MCUs decoded by Tasklet i + 1 for synchronisation
   // The last tasklet cannot overflow, so it returns first
   int current_mcu_index = (row * jpegInfo.mcu_width_real + col) * 192;
-  if (current_mcu_index > 16776960 / NR_TASKLETS) {
+  if (current_mcu_index > MCU_BUFFER_LENGTH / NR_TASKLETS) {
     printf("Warning: Tasklet %d exceeded buffer size limit, output image is most likely malformed\n", d->tasklet_id);
   }
 
@@ -79,13 +81,14 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
   int next_tasklet_mcu_blocks_elapsed = 0;
   int num_synched_mcu_blocks = 0;
   int minimum_synched_mcu_blocks = jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor + 2;
+  // Luminance blocks of an MCU and one block per chroma component, grayscale MCUs are a single block
+  int blocks_per_mcu = jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor + jpegInfo.num_color_components - 1;
 
   for (; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
     for (; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
       if (num_synched_mcu_blocks >= minimum_synched_mcu_blocks + 1) {
         jpegInfoDpu.mcu_end_index[d->tasklet_id] = (row * jpegInfo.mcu_width_real + col) * 192;
-        int blocks_elapsed =
-            (next_tasklet_mcu_blocks_elapsed / minimum_synched_mcu_blocks) * jpegInfo.max_h_samp_factor;
+        int blocks_elapsed = (next_tasklet_mcu_blocks_elapsed / blocks_per_mcu) * jpegInfo.max_h_samp_factor;
         jpegInfoDpu.mcu_start_index[d->tasklet_id + 1] = blocks_elapsed * 192;
         // goto sync1;
         concat_adjust_mcus(d, row, col);
@@ -192,6 +195,8 @@ static void concat_adjust_mcus(JpegDecompressor *d, int row, int col) {
 
 static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_dc) {
   QuantizationTable *q_table = &jpegInfo.quant_tables[jpegInfo.color_components[component_index].quant_table_id];
+  // Quantized coefficient output keeps the coefficients as decoded
+  int dequantize = jpegInfoDpu.output_format != JPEG_OUTPUT_QUANTIZED_COEFFICIENTS;
   HuffmanTable *dc_table = &jpegInfo.dc_huffman_tables[jpegInfo.color_components[component_index].dc_huffman_table_id];
   HuffmanTable *ac_table = &jpegInfo.ac_huffman_tables[jpegInfo.color_components[component_index].ac_huffman_table_id];
 
@@ -214,7 +219,9 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
   MCU_buffer_cache[d->tasklet_id][0] = coeff + *previous_dc;
   *previous_dc = MCU_buffer_cache[d->tasklet_id][0];
   // Dequantization
-  MCU_buffer_cache[d->tasklet_id][0] *= q_table->table[0];
+  if (dequantize) {
+    MCU_buffer_cache[d->tasklet_id][0] *= q_table->table[0];
+  }
 
   // Get the AC values for this MCU block
   int i = 1;
@@ -262,7 +269,7 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
         coeff -= (1 << coeff_length) - 1;
       }
       // Write coefficient to buffer as well as perform dequantization
-      MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i]] = coeff * q_table->table[ZIGZAG_ORDER[i]];
+      MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i]] = dequantize ? coeff * q_table->table[ZIGZAG_ORDER[i]] : coeff;
       i++;
     }
   }
@@ -338,6 +345,21 @@ void inverse_dct_convert(JpegDecompressor *d) {
     end_row = jpegInfo.mcu_height;
   }
 
+  if (jpegInfo.num_color_components == 1 || jpegInfoDpu.output_format == JPEG_OUTPUT_LUMA) {
+    // Grayscale and luma-only output: every block position holds a luminance block, which holds the pixels once level
+    // shifted. Only those blocks are read and written back, chroma blocks are left as decoded
+    for (; row < end_row; row++) {
+      for (int col = 0; col < jpegInfo.mcu_width; col++) {
+        int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3) << 6;
+        mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE0);
+        inverse_dct_component(d, 0);
+        level_shift_block(d, 0);
+        mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE0);
+      }
+    }
+    return;
+  }
+
   for (; row < end_row; row += jpegInfo.max_v_samp_factor) {
     for (int col = 0; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
       for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
@@ -353,6 +375,31 @@ void inverse_dct_convert(JpegDecompressor *d) {
         }
       }
 
+      if (jpegInfoDpu.output_format == JPEG_OUTPUT_YUV420) {
+        // Planar YUV of a 4:2:0 file: the luminance blocks are level shifted in place for find_sum_rgb and
+        // gather_luma_plane, the chroma blocks are the U and V planes already and go straight to them
+        for (int y = 0; y < 2; y++) {
+          for (int x = 0; x < 2; x++) {
+            int mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3) << 6;
+            int cache_index = ((y << 8) + (y << 7)) + ((x << 7) + (x << 6));
+            level_shift_block(d, cache_index);
+            mram_write(&MCU_buffer_cache[d->tasklet_id][cache_index], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE0);
+            if (row + y == 0) {
+              // Gathering would overwrite the first row of blocks while reading it, so it is staged as well
+              int staged_index = jpegInfoDpu.plane_start + (jpegInfoDpu.chroma_size << 1) + ((col + x) << 3);
+              write_block_rows(d, cache_index, staged_index, jpegInfo.mcu_width_real << 3);
+            }
+          }
+        }
+        int chroma_index = (row << 4) * jpegInfo.mcu_width_real + (col << 2);
+        level_shift_block(d, 64);
+        level_shift_block(d, 128);
+        write_block_rows(d, 64, jpegInfoDpu.plane_start + chroma_index, jpegInfo.mcu_width_real << 2);
+        write_block_rows(d, 128, jpegInfoDpu.plane_start + jpegInfoDpu.chroma_size + chroma_index,
+                         jpegInfo.mcu_width_real << 2);
+        continue;
+      }
+
       // Convert from YCbCr to RGB
       for (int y = jpegInfo.max_v_samp_factor - 1; y >= 0; y--) {
         for (int x = jpegInfo.max_h_samp_factor - 1; x >= 0; x--) {
@@ -370,6 +417,102 @@ void inverse_dct_convert(JpegDecompressor *d) {
   }
 }
 
+// Coefficient output: each tasklet packs the blocks of its MCU rows into per component planes, which are built past
+// the decoded blocks so that no tasklet overwrites blocks another one has yet to read
+void pack_coefficients(JpegDecompressor *d) {
+  int mcu_rows = jpegInfo.mcu_height_real / jpegInfo.max_v_samp_factor;
+  int mcus_per_row = jpegInfo.mcu_width_real / jpegInfo.max_h_samp_factor;
+  int rows_per_tasklet = (mcu_rows + NR_TASKLETS - 1) / NR_TASKLETS;
+  int mcu_row = rows_per_tasklet * d->tasklet_id;
+  int end_row = mcu_row + rows_per_tasklet < mcu_rows ? mcu_row + rows_per_tasklet : mcu_rows;
+  int count = jpegInfoDpu.coefficient_count;
+  int packed_start = (jpegInfo.mcu_height_real * jpegInfo.mcu_width_real * 3) << 6;
+
+  for (; mcu_row < end_row; mcu_row++) {
+    int plane_index = packed_start;
+    for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
+      int h = jpegInfo.color_components[color_index].h_samp_factor;
+      int v = jpegInfo.color_components[color_index].v_samp_factor;
+      int blocks_per_row = mcus_per_row * h;
+
+      for (int y = 0; y < v; y++) {
+        for (int col = 0; col < mcus_per_row; col++) {
+          for (int x = 0; x < h; x++) {
+            int row = mcu_row * jpegInfo.max_v_samp_factor + y;
+            int mcu_index =
+                ((row * jpegInfo.mcu_width_real + col * jpegInfo.max_h_samp_factor + x) * 3 + color_index) << 6;
+            mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE0);
+
+            // decode_mcu already dequantized the blocks unless quantized coefficients were asked for
+            for (int i = 0; i < count; i++) {
+              MCU_buffer_cache[d->tasklet_id][64 + i] = MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i]];
+            }
+
+            int packed_index = plane_index + ((mcu_row * v + y) * blocks_per_row + col * h + x) * count;
+            mram_write(&MCU_buffer_cache[d->tasklet_id][64], &MCU_buffer[0][packed_index], count * sizeof(short));
+          }
+        }
+      }
+      plane_index += mcu_rows * v * blocks_per_row * count;
+    }
+  }
+}
+
+// Copy size shorts of MCU_buffer from one index to another, split between the tasklets
+static void move_shorts(JpegDecompressor *d, int from, int to, int size) {
+  for (int index = d->tasklet_id * PREWRITE_SIZE; index < size; index += NR_TASKLETS * PREWRITE_SIZE) {
+    int length = size - index < PREWRITE_SIZE ? size - index : PREWRITE_SIZE;
+    mram_read(&MCU_buffer[0][from + index], &MCU_buffer_cache[d->tasklet_id][0], length * sizeof(short));
+    mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][to + index], length * sizeof(short));
+  }
+}
+
+// Move the packed coefficients to the start of MCU_buffer for the host to read, they take less room than the decoded
+// blocks they were built past, so the copies never overlap
+void move_coefficients(JpegDecompressor *d) {
+  int packed_start = (jpegInfo.mcu_height_real * jpegInfo.mcu_width_real * 3) << 6;
+  move_shorts(d, packed_start, 0, jpegInfoDpu.coefficient_size);
+}
+
+// Planar YUV output: gather the level shifted luminance blocks of the rows of blocks [first, 3 * first) into the Y
+// plane at the start of MCU_buffer. A row of blocks takes a third of the room in the plane that it takes decoded, so
+// like move_luma_blocks a round only overwrites rows gathered by the previous ones, and only reads rows no round has
+// written yet. Row 0 would overwrite itself and was staged by inverse_dct_convert instead, see move_yuv_planes
+void gather_luma_plane(JpegDecompressor *d, int first) {
+  int last = first * 3 < jpegInfo.mcu_height_real ? first * 3 : jpegInfo.mcu_height_real;
+  int width = jpegInfo.mcu_width_real << 3;
+
+  for (int row = first + d->tasklet_id; row < last; row += NR_TASKLETS) {
+    for (int col = 0; col < jpegInfo.mcu_width_real; col++) {
+      int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3) << 6;
+      mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE0);
+      write_block_rows(d, 0, (row << 3) * width + (col << 3), width);
+    }
+  }
+}
+
+// Planar YUV output: move the U and V planes, and the first row of the Y plane, from past the decoded blocks to their
+// place in MCU_buffer once the rest of the Y plane is gathered
+void move_yuv_planes(JpegDecompressor *d) {
+  int luma_size = (jpegInfo.mcu_height_real * jpegInfo.mcu_width_real) << 6;
+  move_shorts(d, jpegInfoDpu.plane_start, luma_size, jpegInfoDpu.chroma_size << 1);
+  move_shorts(d, jpegInfoDpu.plane_start + (jpegInfoDpu.chroma_size << 1), 0, jpegInfo.mcu_width_real << 6);
+}
+
+// Grayscale and luma-only output: move the luminance block of every block position to the start of MCU_buffer, so
+// that the host reads one slot per position instead of three. Block i moves from slot 3 * i to slot i, which holds the
+// block i / 3 when i is a multiple of 3, so the blocks are moved in rounds [first, 3 * first) separated by a barrier:
+// a round only overwrites blocks moved by the previous ones and only reads slots no round has written yet
+void move_luma_blocks(JpegDecompressor *d, int first) {
+  int block_count = jpegInfo.mcu_height * jpegInfo.mcu_width_real;
+  int last = first * 3 < block_count ? first * 3 : block_count;
+
+  for (int block = first + d->tasklet_id; block < last; block += NR_TASKLETS) {
+    mram_read(&MCU_buffer[0][(block * 3) << 6], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE0);
+    mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][block << 6], MCU_READ_WRITE_SIZE0);
+  }
+}
+
 static void inverse_dct_component(JpegDecompressor *d, int cache_index) {
   // ANN algorithm, intermediate values are bit shifted to the left to preserve precision
   // and then bit shifted to the right at the end
@@ -559,6 +702,27 @@ static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int cache_index, int v, int
   }
 }
 
+// Write a block of the cache as 8 rows of 8 samples to a plane of MCU_buffer starting at plane_index
+static void write_block_rows(JpegDecompressor *d, int cache_index, int plane_index, int plane_width) {
+  for (int i = 0; i < 8; i++) {
+    mram_write(&MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3)], &MCU_buffer[0][plane_index + i * plane_width],
+               8 * sizeof(short));
+  }
+}
+
+static void level_shift_block(JpegDecompressor *d, int cache_index) {
+  for (int i = 0; i < 64; i++) {
+    short value = MCU_buffer_cache[d->tasklet_id][cache_index + i] + 128;
+
+    if (value < 0)
+      value = 0;
+    if (value > 255)
+      value = 255;
+
+    MCU_buffer_cache[d->tasklet_id][cache_index + i] = value;
+  }
+}
+
 // Start position and cropped width, height must be 8 pixel aligned
 void crop(JpegDecompressor *d, int start_x, int start_y, int new_width, int new_height) {
   // TODO: think about whether it is possible to use multiple tasklets
@@ -693,12 +857,14 @@ void find_sum_rgb(JpegDecompressor *d) {
   }
 
   uint32_t sum_rgb[3] = {0, 0, 0};
+  // Only RGB output fills every slot of a block position, otherwise the luminance is summed alone
+  int num_components = is_rgb_output(jpegInfoDpu.output_format) ? jpegInfo.num_color_components : 1;
 
   for (; row < end_row; row++) {
     for (int col = 0; col < jpegInfo.mcu_width_real; col++) {
       int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3) << 6;
       mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE1);
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
+      for (int color_index = 0; color_index < num_components; color_index++) {
         for (int i = 0; i < 64; i++) {
           sum_rgb[color_index] += MCU_buffer_cache[d->tasklet_id][(color_index << 6) + i];
         }
@@ -707,7 +873,7 @@ void find_sum_rgb(JpegDecompressor *d) {
   }
 
   mutex_lock(sum_rgb_lock);
-  for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
+  for (int color_index = 0; color_index < num_components; color_index++) {
     jpegInfoDpu.sum_rgb[color_index] += sum_rgb[color_index];
   }
   mutex_unlock(sum_rgb_lock);
@@ -18,6 +18,7 @@ BARRIER_INIT(crop_barrier, NR_TASKLETS);
 BARRIER_INIT(prep0_barrier, NR_TASKLETS);
 BARRIER_INIT(prep1_barrier, NR_TASKLETS);
 BARRIER_INIT(prep2_barrier, NR_TASKLETS);
+BARRIER_INIT(luma_barrier, NR_TASKLETS);
 
 #define DEBUG 0
 
@@ -141,6 +142,58 @@ static void init_jpeg_info() {
   for (int i = 0; i < 3; i++) {
     jpegInfoDpu.sum_rgb[i] = 0;
   }
+  jpegInfoDpu.output_format = input.output_format;
+  jpegInfoDpu.coefficient_count = 0;
+  jpegInfoDpu.coefficient_size = 0;
+  jpegInfoDpu.plane_start = 0;
+  jpegInfoDpu.chroma_size = 0;
+}
+
+// Coefficient output keeps the requested number of coefficients per block, rounded up to whole DMA transfers
+static int init_coefficient_output() {
+  uint32_t count = input.coefficient_count < 1 ? 1 : input.coefficient_count > 64 ? 64 : input.coefficient_count;
+  jpegInfoDpu.coefficient_count = ALIGN(count, 4);
+
+  int blocks_per_mcu = jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor + jpegInfo.num_color_components - 1;
+  int mcu_count = (jpegInfo.mcu_height_real / jpegInfo.max_v_samp_factor) *
+                  (jpegInfo.mcu_width_real / jpegInfo.max_h_samp_factor);
+  jpegInfoDpu.coefficient_size = mcu_count * blocks_per_mcu * jpegInfoDpu.coefficient_count;
+
+  // The coefficients are packed past the decoded blocks (see pack_coefficients)
+  int decoded_size = (jpegInfo.mcu_height_real * jpegInfo.mcu_width_real * 3) << 6;
+  if (decoded_size + jpegInfoDpu.coefficient_size > MCU_BUFFER_LENGTH) {
+    printf("Error: Image too large for coefficient output\n");
+    return 1;
+  }
+
+  output.coefficient_count = jpegInfoDpu.coefficient_count;
+  output.coefficient_bytes = jpegInfoDpu.coefficient_size * sizeof(short);
+  return 0;
+}
+
+// Planar YUV output is only made of 4:2:0 files, whose chroma blocks already are the U and V planes. Those planes and
+// the first row of Y blocks are staged past the decoded blocks until the Y plane is gathered (see gather_luma_plane)
+static int init_yuv420_output() {
+  int is_420 = jpegInfo.num_color_components == 3 && jpegInfo.color_components[0].h_samp_factor == 2 &&
+               jpegInfo.color_components[0].v_samp_factor == 2;
+  for (int i = 1; i < jpegInfo.num_color_components; i++) {
+    is_420 &= jpegInfo.color_components[i].h_samp_factor == 1 && jpegInfo.color_components[i].v_samp_factor == 1;
+  }
+  if (!is_420) {
+    printf("Error: YUV 4:2:0 output needs a 4:2:0 color image\n");
+    return 1;
+  }
+
+  int block_count = jpegInfo.mcu_height_real * jpegInfo.mcu_width_real;
+  jpegInfoDpu.plane_start = (block_count * 3) << 6;
+  jpegInfoDpu.chroma_size = block_count << 4;
+  if (jpegInfoDpu.plane_start + (jpegInfoDpu.chroma_size << 1) + (jpegInfo.mcu_width_real << 6) > MCU_BUFFER_LENGTH) {
+    printf("Error: Image too large for YUV 4:2:0 output\n");
+    return 1;
+  }
+
+  output.plane_bytes = ((block_count << 6) + (jpegInfoDpu.chroma_size << 1)) * sizeof(short);
+  return 0;
 }
 
 static int read_all_markers(JpegDecompressor *d) {
@@ -170,6 +223,16 @@ static int read_all_markers(JpegDecompressor *d) {
   output.image_height = jpegInfo.image_height;
   output.padding = jpegInfo.padding;
   output.mcu_width_real = jpegInfo.mcu_width_real;
+  output.num_color_components = input.output_format == JPEG_OUTPUT_LUMA ? 1 : jpegInfo.num_color_components;
+  output.coefficient_count = 0;
+  output.coefficient_bytes = 0;
+  output.plane_bytes = 0;
+  if (is_coefficient_output(input.output_format) && init_coefficient_output() != 0) {
+    return 1;
+  }
+  if (input.output_format == JPEG_OUTPUT_YUV420 && init_yuv420_output() != 0) {
+    return 1;
+  }
 
 #if DEBUG
   print_jpeg_decompressor();
@@ -234,6 +297,13 @@ int main() {
 
   // All tasklets should wait until tasklet 0 has finished adjusting the DC coefficients
   barrier_wait(&idct_barrier);
+  if (is_coefficient_output(jpegInfoDpu.output_format)) {
+    // No inverse DCT and nothing to sum, the packed coefficients are the whole result
+    pack_coefficients(&decompressor);
+    barrier_wait(&crop_barrier);
+    move_coefficients(&decompressor);
+    return 0;
+  }
   inverse_dct_convert(&decompressor);
 
   barrier_wait(&crop_barrier);
@@ -255,5 +325,22 @@ int main() {
     output.sum_rgb[color_index] = jpegInfoDpu.sum_rgb[color_index];
   }
 
+  if (jpegInfoDpu.output_format == JPEG_OUTPUT_YUV420) {
+    // Row 0 is staged, each round gathers the rows whose room the previous rounds emptied
+    for (int first = 1; first < jpegInfo.mcu_height_real; first *= 3) {
+      gather_luma_plane(&decompressor, first);
+      barrier_wait(&luma_barrier);
+    }
+    move_yuv_planes(&decompressor);
+  }
+
+  if (output.num_color_components == 1) {
+    // Block 0 is already in place, each round moves the blocks whose slots the previous rounds emptied
+    for (int first = 1; first < jpegInfo.mcu_height * jpegInfo.mcu_width_real; first *= 3) {
+      move_luma_blocks(&decompressor, first);
+      barrier_wait(&luma_barrier);
+    }
+  }
+
   return 0;
 }
@@ -27,6 +27,14 @@ int process_SOFn(JpegDecompressor *d) {
     }
   }
 
+  if (jpegInfo.num_color_components == 1) {
+    // Section A.2.2: a single component is not interleaved, so every MCU is one block whatever its sampling factors
+    jpegInfo.color_components[0].h_samp_factor = 1;
+    jpegInfo.color_components[0].v_samp_factor = 1;
+    jpegInfo.max_h_samp_factor = 1;
+    jpegInfo.max_v_samp_factor = 1;
+  }
+
   initialize_MCU_height_width();
 
   if (length - 8 - (3 * jpegInfo.num_color_components) != 0) {
@@ -1,5 +1,8 @@
 #define _POSIX_C_SOURCE 199309L
 
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +10,7 @@
 #include <time.h>
 
 #include "bmp.h"
+#include "cpu-jpeg.h"
 #include "jpeg-common.h"
 
 #define TIME 0      // If set to 1, times how long it takes to do specific parts of the JPEG decoding process
@@ -37,8 +41,6 @@
 #define S6 0.19134171618254488586 // 12 >> 6 or 49 >> 8
 #define S7 0.09754516100806413392 // 6 >> 6  or 25 >> 8
 
-JpegInfo jpegInfo;
-
 /* We want to emulate the behaviour of 'tjbench <jpg> -scale 1/8'
         That calls 'process_data_simple_main' and 'decompress_onepass' in
 turbojpeg On my laptop, I see:
@@ -85,12 +87,13 @@ static void skip_bytes(JpegDecompressor *d, int num_bytes) {
   }
 }
 
-static int skip_marker(JpegDecompressor *d) {
+static int skip_marker(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   int length = read_short(d);
   length -= 2;
 
   if (length < 0) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "ERROR: Invalid length encountered in skip_marker\n");
     return -1;
   }
@@ -100,15 +103,15 @@ static int skip_marker(JpegDecompressor *d) {
 }
 
 static int count_and_skip_non_marker_bytes(JpegDecompressor *d) {
-  int num_skipped_bytes = 0;
-  uint8_t byte = read_byte(d);
-  while (byte != 0xFF) {
-    if (is_eof(d)) {
-      return -1;
-    }
-    num_skipped_bytes++;
-    byte = read_byte(d);
+  char *end = d->data + d->length;
+  char *marker = d->ptr < end ? memchr(d->ptr, 0xFF, end - d->ptr) : NULL;
+  if (marker == NULL) {
+    d->ptr = end;
+    return -1;
   }
+
+  int num_skipped_bytes = marker - d->ptr;
+  d->ptr = marker + 1;
   return num_skipped_bytes;
 }
 
@@ -134,7 +137,8 @@ static int skip_to_next_marker(JpegDecompressor *d) {
   return marker;
 }
 
-static void check_start_of_image(JpegDecompressor *d) {
+static void check_start_of_image(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t c1 = 0, c2 = 0;
 
   if (!is_eof(d)) {
@@ -142,111 +146,135 @@ static void check_start_of_image(JpegDecompressor *d) {
     c2 = read_byte(d);
   }
   if (c1 != 0xFF || c2 != M_SOI) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Not JPEG: %X %X\n", c1, c2);
   }
 }
 
-static void form_low_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
+static void form_low_precision_DQT(JpegCpuContext *ctx, int *length, uint8_t table_id) {
+  JpegDecompressor *d = &ctx->decompressor;
   for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_byte(d); // Qk
+    ctx->jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_byte(d); // Qk
   }
   *length -= 64;
 }
 
-static void form_high_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
+static void form_high_precision_DQT(JpegCpuContext *ctx, int *length, uint8_t table_id) {
+  JpegDecompressor *d = &ctx->decompressor;
   for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_short(d); // Qk
+    ctx->jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_short(d); // Qk
   }
   *length -= 128;
 }
 
-static int read_and_form_DQT(JpegDecompressor *d, int *length) {
+static int read_and_form_DQT(JpegCpuContext *ctx, int *length) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t qt_info = read_byte(d);
   *length -= 1;
 
   uint8_t table_id = qt_info & 0x0F; // Tq
   if (table_id > 3) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid DQT - got quantization table ID: %d, ID should be between 0 and 3\n", table_id);
     return 1;
   }
-  jpegInfo.quant_tables[table_id].exists = 1;
-
+  QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[table_id];
   uint8_t precision = (qt_info >> 4) & 0x0F; // Pq
+
+  // A table seen in an earlier file is copied with its prescale
+  const uint8_t *key = (const uint8_t *) d->ptr;
+  uint32_t key_length = precision == 0 ? 64 : 128;
+  if (ctx->table_cache == NULL || d->ptr + key_length > d->data + d->length) {
+    key_length = 0;
+  }
+  if (key_length != 0 && find_cached_quantization_table(ctx->table_cache, key, key_length, q_table)) {
+    skip_bytes(d, key_length);
+    *length -= key_length;
+    return 0;
+  }
+  q_table->exists = 1;
+
   if (precision == 0) {
-    form_low_precision_DQT(d, length, table_id);
+    form_low_precision_DQT(ctx, length, table_id);
   } else {
-    form_high_precision_DQT(d, length, table_id);
+    form_high_precision_DQT(ctx, length, table_id);
+  }
+  form_idct_prescale(q_table);
+  if (key_length != 0) {
+    cache_quantization_table(ctx->table_cache, key, key_length, q_table);
   }
 
   return 0;
 }
 
 // Page 39: Section B.2.4.1
-static void process_DQT(JpegDecompressor *d) {
+static void process_DQT(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   int length = read_short(d); // Lq
   length -= 2;
 
   while (length > 0) {
-    int error = read_and_form_DQT(d, &length);
+    int error = read_and_form_DQT(ctx, &length);
     if (error) {
       return;
     }
   }
 
   if (length != 0) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid DQT - length incorrect\n");
   }
 }
 
-static void process_DRI(JpegDecompressor *d) {
+static void process_DRI(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   int length = read_short(d);
   if (length != 4) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid DRI - length is not 4\n");
     return;
   }
 
-  jpegInfo.restart_interval = read_short(d);
+  ctx->jpegInfo.restart_interval = read_short(d);
 }
 
-static int read_SOF_metadata(JpegDecompressor *d) {
+static int read_SOF_metadata(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t precision = read_byte(d); // P
   if (precision != 8) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOF - precision is %d, should be 8\n", precision);
     return 1;
   }
 
-  jpegInfo.image_height = read_short(d); // Y
-  jpegInfo.image_width = read_short(d);  // X
-  if (jpegInfo.image_height == 0 || jpegInfo.image_width == 0) {
-    jpegInfo.valid = 0;
-    fprintf(stderr, "Error: Invalid SOF - dimensions: %d x %d\n", jpegInfo.image_width, jpegInfo.image_height);
+  ctx->jpegInfo.image_height = read_short(d); // Y
+  ctx->jpegInfo.image_width = read_short(d);  // X
+  if (ctx->jpegInfo.image_height == 0 || ctx->jpegInfo.image_width == 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid SOF - dimensions: %d x %d\n", ctx->jpegInfo.image_width, ctx->jpegInfo.image_height);
     return 1;
   }
 
-  jpegInfo.num_color_components = read_byte(d); // Nf
-  if (jpegInfo.num_color_components == 0 || jpegInfo.num_color_components > 3) {
-    jpegInfo.valid = 0;
-    fprintf(stderr, "Error: Invalid SOF - number of color components: %d\n", jpegInfo.num_color_components);
+  ctx->jpegInfo.num_color_components = read_byte(d); // Nf
+  if (ctx->jpegInfo.num_color_components == 0 || ctx->jpegInfo.num_color_components > 3) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid SOF - number of color components: %d\n", ctx->jpegInfo.num_color_components);
     return 1;
   }
 
   return 0;
 }
 
-static int read_SOF_color_component_info(JpegDecompressor *d) {
+static int read_SOF_color_component_info(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t component_id = read_byte(d); // Ci
   if (component_id == 0 || component_id > 3) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOF - component ID: %d\n", component_id);
     return 1;
   }
 
-  ColorComponentInfo *component = &jpegInfo.color_components[component_id - 1];
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[component_id - 1];
   component->exists = 1;
   component->component_id = component_id;
 
@@ -257,16 +285,16 @@ static int read_SOF_color_component_info(JpegDecompressor *d) {
     // Only luminance channel can have horizontal or vertical sampling factor greater than 1
     if ((component->h_samp_factor != 1 && component->h_samp_factor != 2) ||
         (component->v_samp_factor != 1 && component->v_samp_factor != 2)) {
-      jpegInfo.valid = 0;
+      ctx->jpegInfo.valid = 0;
       fprintf(stderr, "Error: Invalid SOF - horizontal or vertical sampling factor for luminance out of range %d %d\n",
               component->h_samp_factor, component->v_samp_factor);
       return 1;
     }
 
-    jpegInfo.max_h_samp_factor = component->h_samp_factor;
-    jpegInfo.max_v_samp_factor = component->v_samp_factor;
+    ctx->jpegInfo.max_h_samp_factor = component->h_samp_factor;
+    ctx->jpegInfo.max_v_samp_factor = component->v_samp_factor;
   } else if (component->h_samp_factor != 1 || component->v_samp_factor != 1) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOF - horizontal and vertical sampling factor for Cr and Cb not 1");
     return 1;
   }
@@ -276,64 +304,160 @@ static int read_SOF_color_component_info(JpegDecompressor *d) {
   return 0;
 }
 
-static void initialize_MCU_height_width() {
-  jpegInfo.mcu_height = (jpegInfo.image_height + 7) / 8;
-  jpegInfo.mcu_width = (jpegInfo.image_width + 7) / 8;
-  jpegInfo.padding = jpegInfo.image_width % 4;
-  jpegInfo.mcu_height_real = jpegInfo.mcu_height;
-  jpegInfo.mcu_width_real = jpegInfo.mcu_width;
-  if (jpegInfo.max_v_samp_factor == 2 && jpegInfo.mcu_height_real % 2 == 1) {
-    jpegInfo.mcu_height_real++;
+static void initialize_MCU_height_width(JpegCpuContext *ctx) {
+  ctx->jpegInfo.mcu_height = (ctx->jpegInfo.image_height + 7) / 8;
+  ctx->jpegInfo.mcu_width = (ctx->jpegInfo.image_width + 7) / 8;
+  ctx->jpegInfo.padding = ctx->jpegInfo.image_width % 4;
+  ctx->jpegInfo.mcu_height_real = ctx->jpegInfo.mcu_height;
+  ctx->jpegInfo.mcu_width_real = ctx->jpegInfo.mcu_width;
+  if (ctx->jpegInfo.max_v_samp_factor == 2 && ctx->jpegInfo.mcu_height_real % 2 == 1) {
+    ctx->jpegInfo.mcu_height_real++;
   }
-  if (jpegInfo.max_h_samp_factor == 2 && jpegInfo.mcu_width_real % 2 == 1) {
-    jpegInfo.mcu_width_real++;
+  if (ctx->jpegInfo.max_h_samp_factor == 2 && ctx->jpegInfo.mcu_width_real % 2 == 1) {
+    ctx->jpegInfo.mcu_width_real++;
   }
 }
 
+static void select_mcu_decoder(JpegCpuContext *ctx);
+
 // Page 35: Section B.2.2
-static void process_SOFn(JpegDecompressor *d) {
-  if (jpegInfo.num_color_components != 0) {
-    jpegInfo.valid = 0;
+static void process_SOFn(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
+  if (ctx->jpegInfo.num_color_components != 0) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOF - multiple SOFs encountered\n");
     return;
   }
 
   int length = read_short(d); // Lf
 
-  int error = read_SOF_metadata(d);
+  int error = read_SOF_metadata(ctx);
   if (error) {
     return;
   }
 
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
-    error = read_SOF_color_component_info(d);
+  for (int i = 0; i < ctx->jpegInfo.num_color_components; i++) {
+    error = read_SOF_color_component_info(ctx);
     if (error) {
       return;
     }
   }
 
-  initialize_MCU_height_width();
+  if (ctx->jpegInfo.num_color_components == 1) {
+    // Section A.2.2: a single component is not interleaved, so every MCU is one block whatever its sampling factors
+    ctx->jpegInfo.color_components[0].h_samp_factor = 1;
+    ctx->jpegInfo.color_components[0].v_samp_factor = 1;
+    ctx->jpegInfo.max_h_samp_factor = 1;
+    ctx->jpegInfo.max_v_samp_factor = 1;
+  }
+
+  initialize_MCU_height_width(ctx);
+  select_mcu_decoder(ctx);
 
-  if (length - 8 - (3 * jpegInfo.num_color_components) != 0) {
-    jpegInfo.valid = 0;
+  if (length - 8 - (3 * ctx->jpegInfo.num_color_components) != 0) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOF - length incorrect\n");
   }
 }
 
-static int read_DHT(JpegDecompressor *d, int *length) {
+/**
+ * Assign the canonical codes of h_table, codes of the same length are consecutive
+ * Returns 0 on success, -1 if the codes of a length do not fit in that many bits
+ */
+static int generate_codes(HuffmanTable *h_table) {
+  uint32_t code = 0;
+  for (int i = 0; i < 16; i++) {
+    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
+      h_table->codes[j] = code;
+      code++;
+    }
+    // Section C: the code of all ones is never used, so there is room left at every length
+    if (code >= 1u << (i + 1)) {
+      return -1;
+    }
+    code <<= 1;
+  }
+  return 0;
+}
+
+static void build_huffman_lookup(HuffmanTable *h_table, HuffmanLookup *lookup) {
+  memset(lookup->lookup, 0, sizeof(lookup->lookup));
+
+  for (int length = 1; length <= 16; length++) {
+    int first = h_table->valoffset[length - 1];
+    int last = h_table->valoffset[length];
+    if (first >= last) {
+      lookup->maxcode[length] = -1;
+      lookup->valoffset[length] = 0;
+      continue;
+    }
+    lookup->maxcode[length] = h_table->codes[last - 1];
+    lookup->valoffset[length] = first - h_table->codes[first];
+
+    if (length > HUFF_LOOKAHEAD) {
+      continue;
+    }
+
+    // Every lookahead value starting with this code decodes to the same symbol
+    int fill = 1 << (HUFF_LOOKAHEAD - length);
+    for (int j = first; j < last; j++) {
+      uint32_t index = h_table->codes[j] << (HUFF_LOOKAHEAD - length);
+      for (int k = 0; k < fill; k++) {
+        lookup->lookup[index + k] = (length << 8) | h_table->huffval[j];
+      }
+    }
+  }
+  lookup->maxcode[17] = 0x7FFFFFFF; // sentinel, stops the slow path in huff_decode
+}
+
+/**
+ * Bytes defining the Huffman table at the read position, the 16 code counts and the symbols
+ * Returns 0 if they do not fit in the data or in a HuffmanTable
+ */
+static uint32_t huffman_table_key_length(JpegDecompressor *d) {
+  if (d->ptr + 16 > d->data + d->length) {
+    return 0;
+  }
+  uint32_t total = 0;
+  uint32_t code = 0;
+  for (int i = 0; i < 16; i++) {
+    total += (uint8_t) d->ptr[i];
+    code += (uint8_t) d->ptr[i];
+    if (code >= 1u << (i + 1)) {
+      return 0;
+    }
+    code <<= 1;
+  }
+  if (total > 256 || d->ptr + 16 + total > d->data + d->length) {
+    return 0;
+  }
+  return 16 + total;
+}
+
+static int read_DHT(JpegCpuContext *ctx, int *length) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t ht_info = read_byte(d);
   *length -= 1;
 
   uint8_t table_id = ht_info & 0x0F;        // Th
   uint8_t ac_table = (ht_info >> 4) & 0x0F; // Tc
-  if (table_id > 3) {
-    jpegInfo.valid = 0;
+  if (table_id >= MAX_HUFFMAN_TABLES) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid DHT - Huffman Table ID: %d\n", table_id);
     return 1;
   }
 
-  HuffmanTable *h_table = ac_table ? &jpegInfo.ac_huffman_tables[table_id] : &jpegInfo.dc_huffman_tables[table_id];
-  h_table->exists = 1;
+  HuffmanTable *h_table = ac_table ? &ctx->jpegInfo.ac_huffman_tables[table_id] : &ctx->jpegInfo.dc_huffman_tables[table_id];
+  HuffmanLookup *lookup = ac_table ? &ctx->ac_huffman_lookups[table_id] : &ctx->dc_huffman_lookups[table_id];
+
+  // Most files repeat the tables of earlier ones, those are copied ready built
+  const uint8_t *key = (const uint8_t *) d->ptr;
+  uint32_t key_length = ctx->table_cache != NULL ? huffman_table_key_length(d) : 0;
+  if (key_length != 0 && find_cached_huffman_table(ctx->table_cache, key, key_length, h_table, lookup)) {
+    skip_bytes(d, key_length);
+    *length -= key_length;
+    return 0;
+  }
 
   h_table->valoffset[0] = 0;
   int total = 0;
@@ -342,86 +466,115 @@ static int read_DHT(JpegDecompressor *d, int *length) {
     h_table->valoffset[i] = total;
   }
   *length -= 16;
+  if (total > 256) {
+    h_table->exists = 0;
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid DHT - %d codes\n", total);
+    return 1;
+  }
 
   for (int i = 0; i < total; i++) {
     h_table->huffval[i] = read_byte(d); // Vij
   }
   *length -= total;
 
+  if (generate_codes(h_table) != 0) {
+    h_table->exists = 0;
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid DHT - code lengths do not form a Huffman code\n");
+    return 1;
+  }
+  h_table->exists = 1;
+  build_huffman_lookup(h_table, lookup);
+  if (key_length != 0) {
+    cache_huffman_table(ctx->table_cache, key, key_length, h_table, lookup);
+  }
+
   return 0;
 }
 
 // Page 40: Section B.2.4.2
-static void process_DHT(JpegDecompressor *d) {
+static void process_DHT(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   int length = read_short(d); // Lf
   length -= 2;
 
   // Keep reading Huffman tables until we run out of data
   while (length > 0) {
-    int error = read_DHT(d, &length);
+    int error = read_DHT(ctx, &length);
     if (error) {
       return;
     }
   }
 
   if (length != 0) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid DHT - length incorrect\n");
   }
 }
 
-static void generate_codes(HuffmanTable *h_table) {
-  uint32_t code = 0;
-  for (int i = 0; i < 16; i++) {
-    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
-      h_table->codes[j] = code;
-      code++;
-    }
-    code <<= 1;
-  }
-}
-
-static void build_huffman_tables() {
-  for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.dc_huffman_tables[i].exists) {
-      generate_codes(&jpegInfo.dc_huffman_tables[i]);
-    }
-    if (jpegInfo.ac_huffman_tables[i].exists) {
-      generate_codes(&jpegInfo.ac_huffman_tables[i]);
-    }
-  }
-}
-
-static int read_SOS_color_component_info(JpegDecompressor *d) {
+static int read_SOS_color_component_info(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   uint8_t component_id = read_byte(d); // Csj
   if (component_id == 0 || component_id > 3) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOS - component ID: %d\n", component_id);
     return 1;
   }
 
-  ColorComponentInfo *component = &jpegInfo.color_components[component_id - 1];
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[component_id - 1];
+  if (!component->exists) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid SOS - component %d is not in the frame\n", component_id);
+    return 1;
+  }
+  ctx->scan_components[ctx->scan_num_components++] = component_id - 1;
+
   uint8_t tdta = read_byte(d);
   component->dc_huffman_table_id = (tdta >> 4) & 0x0F; // Tdj
   component->ac_huffman_table_id = tdta & 0x0F;        // Taj
+  if (component->dc_huffman_table_id >= MAX_HUFFMAN_TABLES || component->ac_huffman_table_id >= MAX_HUFFMAN_TABLES) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid SOS - Huffman Table IDs: %d, %d\n", component->dc_huffman_table_id,
+            component->ac_huffman_table_id);
+    return 1;
+  }
 
   return 0;
 }
 
-static int read_SOS_metadata(JpegDecompressor *d) {
-  jpegInfo.ss = read_byte(d); // Ss
-  jpegInfo.se = read_byte(d); // Se
+static int read_SOS_metadata(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
+  ctx->jpegInfo.ss = read_byte(d); // Ss
+  ctx->jpegInfo.se = read_byte(d); // Se
   uint8_t A = read_byte(d);
-  jpegInfo.Ah = (A >> 4) & 0xF; // Ah
-  jpegInfo.Al = A & 0xF;        // Al
+  ctx->jpegInfo.Ah = (A >> 4) & 0xF; // Ah
+  ctx->jpegInfo.Al = A & 0xF;        // Al
+
+  if (ctx->progressive) {
+    // Section G.1.1.1: a scan holds either the DC coefficients, or a band of AC coefficients of a single component
+    uint32_t dc_scan = ctx->jpegInfo.ss == 0;
+    if ((dc_scan && ctx->jpegInfo.se != 0) ||
+        (!dc_scan && (ctx->jpegInfo.se < ctx->jpegInfo.ss || ctx->jpegInfo.se > 63 || ctx->scan_num_components != 1))) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid SOS - invalid spectral selection %d to %d\n", ctx->jpegInfo.ss, ctx->jpegInfo.se);
+      return 1;
+    }
+    if (ctx->jpegInfo.Ah > 13 || ctx->jpegInfo.Al > 13) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid SOS - invalid successive approximation\n");
+      return 1;
+    }
+    return 0;
+  }
 
-  if (jpegInfo.ss != 0 || jpegInfo.se != 63) {
-    jpegInfo.valid = 0;
+  if (ctx->jpegInfo.ss != 0 || ctx->jpegInfo.se != 63) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOS - invalid spectral selection\n");
     return 1;
   }
-  if (jpegInfo.Ah != 0 || jpegInfo.Al != 0) {
-    jpegInfo.valid = 0;
+  if (ctx->jpegInfo.Ah != 0 || ctx->jpegInfo.Al != 0) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOS - invalid successive approximation\n");
     return 1;
   }
@@ -430,105 +583,101 @@ static int read_SOS_metadata(JpegDecompressor *d) {
 }
 
 // Page 37: Section B.2.3
-static void process_SOS(JpegDecompressor *d) {
+static void process_SOS(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   int length = read_short(d); // Ls
 
+  // Progressive scans may hold any of the components, baseline ones all of them
   uint8_t num_components = read_byte(d); // Ns
-  if (num_components == 0 || num_components != jpegInfo.num_color_components) {
-    jpegInfo.valid = 0;
+  if (num_components == 0 || num_components > ctx->jpegInfo.num_color_components ||
+      (!ctx->progressive && num_components != ctx->jpegInfo.num_color_components)) {
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOS - number of color components does not match SOF: %d vs %d\n", num_components,
-            jpegInfo.num_color_components);
+            ctx->jpegInfo.num_color_components);
     return;
   }
 
+  ctx->scan_num_components = 0;
   for (int i = 0; i < num_components; i++) {
-    int error = read_SOS_color_component_info(d);
+    int error = read_SOS_color_component_info(ctx);
     if (error) {
       return;
     }
   }
 
-  int error = read_SOS_metadata(d);
+  int error = read_SOS_metadata(ctx);
   if (error) {
     return;
   }
 
+  // DC refinement scans code no DC differences, scans of the DC coefficients alone code no AC ones
+  uint32_t uses_dc_table = ctx->jpegInfo.ss == 0 && ctx->jpegInfo.Ah == 0;
+  uint32_t uses_ac_table = ctx->jpegInfo.se != 0;
+  for (uint32_t i = 0; i < ctx->scan_num_components; i++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[ctx->scan_components[i]];
+    if ((uses_dc_table && !ctx->jpegInfo.dc_huffman_tables[component->dc_huffman_table_id].exists) ||
+        (uses_ac_table && !ctx->jpegInfo.ac_huffman_tables[component->ac_huffman_table_id].exists)) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid SOS - Huffman table of component %d is not defined\n",
+              ctx->scan_components[i] + 1);
+      return;
+    }
+  }
+
   if (length - 6 - (2 * num_components) != 0) {
-    jpegInfo.valid = 0;
+    ctx->jpegInfo.valid = 0;
     fprintf(stderr, "Error: Invalid SOS - length incorrect\n");
   }
-
-  build_huffman_tables();
 }
 
-static int get_num_bits(JpegDecompressor *d, uint32_t num_bits) {
-  int bits = 0;
-  if (num_bits == 0) {
-    return bits;
-  }
-
-  uint8_t temp_byte;
-  uint32_t actual_byte;
-  while (d->bits_left < num_bits) {
-    // Read a byte and decode it, if it is 0xFF
-    temp_byte = read_byte(d);
-    actual_byte = temp_byte;
-
-    while (temp_byte == 0xFF) {
-      // FF may be padded with FFs, read as many FFs as necessary
-      temp_byte = read_byte(d);
-      if (temp_byte == 0) {
-        // Got FF which is not a marker, save it to buffer
-        actual_byte = 0xFF;
-      } else if (temp_byte >= M_RST_FIRST && temp_byte <= M_RST_LAST) {
-        // Got restart markers, ignore and read new byte
-        temp_byte = read_byte(d);
-        actual_byte = temp_byte;
-      } else {
-        actual_byte = temp_byte;
-      }
-    }
-
-    // Add the new bits to the buffer (MSB aligned)
-    d->bit_buffer |= actual_byte << (32 - 8 - d->bits_left);
-    d->bits_left += 8;
+/**
+ * Destuff the entropy coded segment at the read position into ctx->entropy_segment and point the bit reader at it
+ * Returns the marker that ends the segment in the file data, NULL if out of memory
+ */
+char *load_entropy_segment(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
+  EntropySegment *segment = &ctx->entropy_segment;
+  if (destuff_entropy_segment(segment, d->ptr, d->data + d->length) != 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    return NULL;
   }
 
-  bits = d->bit_buffer >> (32 - num_bits);
-  d->bit_buffer <<= num_bits;
-  d->bits_left -= num_bits;
-  return bits;
+  d->data = segment->data;
+  d->ptr = segment->data;
+  d->length = segment->length;
+  d->bit_reservoir = 0;
+  d->bits_left = 0;
+  d->padding_bits = 0;
+  return segment->end;
 }
 
-static uint8_t huff_decode(JpegDecompressor *d, HuffmanTable *h_table) {
-  uint32_t code = 0;
-
-  for (int i = 0; i < 16; i++) {
-    int bit = get_num_bits(d, 1);
-    code = (code << 1) | bit;
-    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
-      if (code == h_table->codes[j]) {
-        return h_table->huffval[j];
-      }
-    }
+// Speculative decoders run into invalid data all the time, only report it for the real decoder
+void report_mcu_error(JpegDecompressor *d, const char *format, ...) {
+  if (d->quiet) {
+    return;
   }
 
-  return -1;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
 }
 
-static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, short *previous_dc) {
-  QuantizationTable *q_table = &jpegInfo.quant_tables[jpegInfo.color_components[component_index].quant_table_id];
-  HuffmanTable *dc_table = &jpegInfo.dc_huffman_tables[jpegInfo.color_components[component_index].dc_huffman_table_id];
-  HuffmanTable *ac_table = &jpegInfo.ac_huffman_tables[jpegInfo.color_components[component_index].ac_huffman_table_id];
+// Decode the DC coefficient of a block into buffer[0], dequantization is left to the inverse DCT
+int decode_dc(JpegCpuContext *ctx, JpegDecompressor *d, ColorComponentInfo *component, short *buffer,
+              short *previous_dc) {
+  HuffmanTable *dc_table = &ctx->jpegInfo.dc_huffman_tables[component->dc_huffman_table_id];
+  HuffmanLookup *dc_lookup = &ctx->dc_huffman_lookups[component->dc_huffman_table_id];
 
   // Get DC value for this MCU block
-  uint8_t dc_length = huff_decode(d, dc_table);
+  uint8_t dc_length = huff_decode(d, dc_table, dc_lookup);
   if (dc_length == (uint8_t) -1) {
-    fprintf(stderr, "Error: Invalid DC code\n");
+    report_mcu_error(d, "Error: Invalid DC code\n");
     return -1;
   }
   if (dc_length > 11) {
-    fprintf(stderr, "Error: DC coefficient length greater than 11\n");
+    report_mcu_error(d, "Error: DC coefficient length greater than 11\n");
     return -1;
   }
 
@@ -539,23 +688,40 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
   }
   buffer[0] = coeff + *previous_dc;
   *previous_dc = buffer[0];
-  // Dequantization
-  buffer[0] *= q_table->table[0];
+
+  return 0;
+}
+
+/**
+ * Decode the 64 coefficients of a block, they are dequantized by the inverse DCT
+ * Returns the zigzag index of the last non-zero coefficient (0 if there is only a DC coefficient), -1 if the block is
+ * invalid
+ */
+static int decode_mcu(JpegCpuContext *ctx, JpegDecompressor *d, int component_index, short *buffer,
+                      short *previous_dc) {
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[component_index];
+  HuffmanTable *ac_table = &ctx->jpegInfo.ac_huffman_tables[component->ac_huffman_table_id];
+  HuffmanLookup *ac_lookup = &ctx->ac_huffman_lookups[component->ac_huffman_table_id];
+  int last_index = 0;
+  int coeff;
+
+  // Most coefficients are zero, clearing the block at once is cheaper than filling the gaps one by one
+  memset(buffer, 0, 64 * sizeof(short));
+  if (decode_dc(ctx, d, component, buffer, previous_dc) != 0) {
+    return -1;
+  }
 
   // Get the AC values for this MCU block
   int i = 1;
   while (i < 64) {
-    uint8_t ac_length = huff_decode(d, ac_table);
+    uint8_t ac_length = huff_decode(d, ac_table, ac_lookup);
     if (ac_length == (uint8_t) -1) {
-      fprintf(stderr, "Error: Invalid AC code\n");
+      report_mcu_error(d, "Error: Invalid AC code\n");
       return -1;
     }
 
-    // Got 0x00, fill remaining MCU block with 0s
+    // Got 0x00, end of block, the remaining coefficients are 0
     if (ac_length == 0x00) {
-      while (i < 64) {
-        buffer[ZIGZAG_ORDER[i++]] = 0;
-      }
       break;
     }
 
@@ -570,15 +736,13 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
     }
 
     if (i + num_zeroes >= 64) {
-      fprintf(stderr, "Error: Invalid AC code - zeros exceeded MCU length %d >= 64\n", i + num_zeroes);
+      report_mcu_error(d, "Error: Invalid AC code - zeros exceeded MCU length %d >= 64\n", i + num_zeroes);
       return -1;
     }
-    for (int j = 0; j < num_zeroes; j++) {
-      buffer[ZIGZAG_ORDER[i++]] = 0;
-    }
+    i += num_zeroes;
 
     if (coeff_length > 10) {
-      fprintf(stderr, "Error: AC coefficient length greater than 10\n");
+      report_mcu_error(d, "Error: AC coefficient length greater than 10\n");
       return -1;
     }
     if (coeff_length != 0) {
@@ -587,8 +751,55 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
         // Convert to negative coefficient
         coeff -= (1 << coeff_length) - 1;
       }
-      // Write coefficient to buffer as well as perform dequantization
-      buffer[ZIGZAG_ORDER[i]] = coeff * q_table->table[ZIGZAG_ORDER[i]];
+      // Write coefficient to buffer
+      buffer[ZIGZAG_ORDER[i]] = coeff;
+      last_index = i;
+      i++;
+    }
+  }
+
+  return last_index;
+}
+
+/**
+ * Like decode_mcu, but the AC coefficients are only entropy decoded to skip over them, for decoding at 1/8 scale
+ * Only buffer[0] is written, returns 0 or -1 if the block is invalid
+ */
+static int decode_mcu_dc_only(JpegCpuContext *ctx, JpegDecompressor *d, int component_index, short *buffer,
+                              short *previous_dc) {
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[component_index];
+  HuffmanTable *ac_table = &ctx->jpegInfo.ac_huffman_tables[component->ac_huffman_table_id];
+  HuffmanLookup *ac_lookup = &ctx->ac_huffman_lookups[component->ac_huffman_table_id];
+
+  if (decode_dc(ctx, d, component, buffer, previous_dc) != 0) {
+    return -1;
+  }
+
+  int i = 1;
+  while (i < 64) {
+    uint8_t ac_length = huff_decode(d, ac_table, ac_lookup);
+    if (ac_length == (uint8_t) -1) {
+      report_mcu_error(d, "Error: Invalid AC code\n");
+      return -1;
+    }
+    if (ac_length == 0x00) {
+      break;
+    }
+
+    uint8_t num_zeroes = ac_length == 0xF0 ? 16 : (ac_length >> 4) & 0x0F;
+    uint8_t coeff_length = ac_length & 0x0F;
+    if (i + num_zeroes >= 64) {
+      report_mcu_error(d, "Error: Invalid AC code - zeros exceeded MCU length %d >= 64\n", i + num_zeroes);
+      return -1;
+    }
+    if (coeff_length > 10) {
+      report_mcu_error(d, "Error: AC coefficient length greater than 10\n");
+      return -1;
+    }
+
+    i += num_zeroes;
+    if (coeff_length != 0) {
+      get_num_bits(d, coeff_length);
       i++;
     }
   }
@@ -596,18 +807,29 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
   return 0;
 }
 
+// Decode one block with as much detail as the output needs (see ctx->dc_only), returns what decode_mcu returns
+inline int decode_block(JpegCpuContext *ctx, JpegDecompressor *d, int component_index, short *buffer,
+                        short *previous_dc) {
+  if (ctx->dc_only) {
+    return decode_mcu_dc_only(ctx, d, component_index, buffer, previous_dc);
+  }
+  return decode_mcu(ctx, d, component_index, buffer, previous_dc);
+}
+
 #if USE_FLOAT
-static void inverse_dct_component_float(short *buffer) {
+static void inverse_dct_component_float(short *buffer, const QuantizationTable *q_table) {
+  const uint32_t *q = q_table->table;
+
   // ANN algorithm
   for (int i = 0; i < 8; i++) {
-    float g0 = buffer[0 * 8 + i] * S0;
-    float g1 = buffer[4 * 8 + i] * S4;
-    float g2 = buffer[2 * 8 + i] * S2;
-    float g3 = buffer[6 * 8 + i] * S6;
-    float g4 = buffer[5 * 8 + i] * S5;
-    float g5 = buffer[1 * 8 + i] * S1;
-    float g6 = buffer[7 * 8 + i] * S7;
-    float g7 = buffer[3 * 8 + i] * S3;
+    float g0 = buffer[0 * 8 + i] * (float) q[0 * 8 + i] * S0;
+    float g1 = buffer[4 * 8 + i] * (float) q[4 * 8 + i] * S4;
+    float g2 = buffer[2 * 8 + i] * (float) q[2 * 8 + i] * S2;
+    float g3 = buffer[6 * 8 + i] * (float) q[6 * 8 + i] * S6;
+    float g4 = buffer[5 * 8 + i] * (float) q[5 * 8 + i] * S5;
+    float g5 = buffer[1 * 8 + i] * (float) q[1 * 8 + i] * S1;
+    float g6 = buffer[7 * 8 + i] * (float) q[7 * 8 + i] * S7;
+    float g7 = buffer[3 * 8 + i] * (float) q[3 * 8 + i] * S3;
 
     float f4 = g4 - g7;
     float f5 = g5 + g6;
@@ -703,324 +925,1424 @@ static void inverse_dct_component_float(short *buffer) {
     buffer[i * 8 + 7] = b0 - e7;
   }
 }
-#else
-static void inverse_dct_component(short *buffer) {
-  // ANN algorithm, intermediate values are bit shifted to the left to preserve precision
-  // and then bit shifted to the right at the end
-  for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (buffer[0 * 8 + i] * 181) >> 5;
-    int g1 = (buffer[4 * 8 + i] * 181) >> 5;
-    int g2 = (buffer[2 * 8 + i] * 59) >> 3;
-    int g3 = (buffer[6 * 8 + i] * 49) >> 4;
-    int g4 = (buffer[5 * 8 + i] * 71) >> 4;
-    int g5 = (buffer[1 * 8 + i] * 251) >> 5;
-    int g6 = (buffer[7 * 8 + i] * 25) >> 4;
-    int g7 = (buffer[3 * 8 + i] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (buffer[0 * 8 + i] * 22) >> 2;
-    // int g1 = (buffer[4 * 8 + i] * 22) >> 2;
-    // int g2 = (buffer[2 * 8 + i] * 30) >> 2;
-    // int g3 = (buffer[6 * 8 + i] * 12) >> 2;
-    // int g4 = (buffer[5 * 8 + i] * 18) >> 2;
-    // int g5 = (buffer[1 * 8 + i] * 31) >> 2;
-    // int g6 = (buffer[7 * 8 + i] * 6) >> 2;
-    // int g7 = (buffer[3 * 8 + i] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    buffer[0 * 8 + i] = (b0 + e7) >> 4;
-    buffer[1 * 8 + i] = (b1 + b6) >> 4;
-    buffer[2 * 8 + i] = (b2 + c8) >> 4;
-    buffer[3 * 8 + i] = (b3 + b4) >> 4;
-    buffer[4 * 8 + i] = (b3 - b4) >> 4;
-    buffer[5 * 8 + i] = (b2 - c8) >> 4;
-    buffer[6 * 8 + i] = (b1 - b6) >> 4;
-    buffer[7 * 8 + i] = (b0 - e7) >> 4;
-  }
+#endif
 
-  for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (buffer[i * 8 + 0] * 181) >> 5;
-    int g1 = (buffer[i * 8 + 4] * 181) >> 5;
-    int g2 = (buffer[i * 8 + 2] * 59) >> 3;
-    int g3 = (buffer[i * 8 + 6] * 49) >> 4;
-    int g4 = (buffer[i * 8 + 5] * 71) >> 4;
-    int g5 = (buffer[i * 8 + 1] * 251) >> 5;
-    int g6 = (buffer[i * 8 + 7] * 25) >> 4;
-    int g7 = (buffer[i * 8 + 3] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (buffer[i * 8 + 0] * 22) >> 2;
-    // int g1 = (buffer[i * 8 + 4] * 22) >> 2;
-    // int g2 = (buffer[i * 8 + 2] * 30) >> 2;
-    // int g3 = (buffer[i * 8 + 6] * 12) >> 2;
-    // int g4 = (buffer[i * 8 + 5] * 18) >> 2;
-    // int g5 = (buffer[i * 8 + 1] * 31) >> 2;
-    // int g6 = (buffer[i * 8 + 7] * 6) >> 2;
-    // int g7 = (buffer[i * 8 + 3] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    buffer[i * 8 + 0] = (b0 + e7) >> 4;
-    buffer[i * 8 + 1] = (b1 + b6) >> 4;
-    buffer[i * 8 + 2] = (b2 + c8) >> 4;
-    buffer[i * 8 + 3] = (b3 + b4) >> 4;
-    buffer[i * 8 + 4] = (b3 - b4) >> 4;
-    buffer[i * 8 + 5] = (b2 - c8) >> 4;
-    buffer[i * 8 + 6] = (b1 - b6) >> 4;
-    buffer[i * 8 + 7] = (b0 - e7) >> 4;
+void free_sample_planes(JpegCpuContext *ctx, SamplePlanes *samples) {
+  for (uint32_t color_index = 0; color_index < 3; color_index++) {
+    arena_free(&ctx->arena, samples->planes[color_index]);
+    samples->planes[color_index] = NULL;
   }
 }
-#endif
 
-// https://en.wikipedia.org/wiki/YUV Y'UV444 to RGB888 conversion
-static void ycbcr_to_rgb_pixel(short *buffer, short *cbcr, int v, int h) {
-  int max_v = jpegInfo.max_v_samp_factor;
-  int max_h = jpegInfo.max_h_samp_factor;
+/**
+ * Allocate planes holding mcu_rows rows of MCUs, starting at MCU row 0
+ * Luma-only output gets no chroma planes, which tells the decoding loops to skip the inverse DCT of chroma blocks.
+ * Coefficient output keeps ctx->coefficient_count coefficients per block instead of samples, a row of blocks per line
+ * Returns 0 on success, -1 if out of memory
+ */
+int alloc_sample_planes(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t mcu_rows) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t block_width = is_coefficient_output(ctx->output_format) ? ctx->coefficient_count : ctx->block_size;
+  uint32_t block_height = is_coefficient_output(ctx->output_format) ? 1 : ctx->block_size;
+  uint32_t num_planes = ctx->output_format == JPEG_OUTPUT_LUMA ? 1 : ctx->jpegInfo.num_color_components;
+
+  memset(samples, 0, sizeof(SamplePlanes));
+  for (uint32_t color_index = 0; color_index < num_planes; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    samples->strides[color_index] = mcus_per_row * component->h_samp_factor * block_width;
+    samples->planes[color_index] = (short *) arena_alloc(&ctx->arena, (size_t) samples->strides[color_index] *
+                                                         component->v_samp_factor * block_height * mcu_rows *
+                                                         sizeof(short));
+    if (samples->planes[color_index] == NULL) {
+      free_sample_planes(ctx, samples);
+      return -1;
+    }
+  }
 
-  // Iterating from bottom right to top leftbecause otherwise the pixel data will get overwritten
-  for (int y = 7; y >= 0; y--) {
-    for (int x = 7; x >= 0; x--) {
-      uint32_t pixel = (y << 3) + x;
-      uint32_t cbcr_pixel_row = y / max_v + 4 * v;
-      uint32_t cbcr_pixel_col = x / max_h + 4 * h;
-      uint32_t cbcr_pixel = (cbcr_pixel_row << 3) + cbcr_pixel_col + 64;
+  return 0;
+}
 
+/**
+ * Inverse DCT for the scale the context decodes at
+ */
+idct_function select_idct(JpegCpuContext *ctx) {
 #if USE_FLOAT
-      // Floating point version, most accurate, but floating point calculations in DPUs are emulated, so very slow
-      short r = buffer[0][pixel] + 1.402 * cbcr[2][cbcr_pixel] + 128;
-      short g = buffer[0][pixel] - 0.344 * cbcr[1][cbcr_pixel] - 0.714 * cbcr[2][cbcr_pixel] + 128;
-      short b = buffer[0][pixel] + 1.772 * cbcr[1][cbcr_pixel] + 128;
-#else
-      // TODO: if multiplication is too slow, use bit shifting. However, bit shifting is less accurate from what I can
-      // see int r = buffer[0][i] + buffer[2][i] + (buffer[2][i] >> 2) + (buffer[2][i] >> 3) + (buffer[2][i] >> 5) +
-      // 128; int g = buffer[0][i] - ((buffer[1][i] >> 2) + (buffer[1][i] >> 4) + (buffer[1][i] >> 5)) -
-      //         ((buffer[2][i] >> 1) + (buffer[2][i] >> 3) + (buffer[2][i] >> 4) + (buffer[2][i] >> 5)) + 128;
-      // int b = buffer[0][i] + buffer[1][i] + (buffer[1][i] >> 1) + (buffer[1][i] >> 2) + (buffer[1][i] >> 6) + 128;
-
-      // Integer only, quite accurate but may be less performant than only using bit shifting
-      short r = buffer[pixel] + ((45 * cbcr[64 + cbcr_pixel]) >> 5) + 128;
-      short g = buffer[pixel] - ((11 * cbcr[cbcr_pixel] + 23 * cbcr[64 + cbcr_pixel]) >> 5) + 128;
-      short b = buffer[pixel] + ((113 * cbcr[cbcr_pixel]) >> 6) + 128;
+  if (ctx->block_size == 8) {
+    return inverse_dct_component_float;
+  }
 #endif
+  return scaled_idct_function(ctx->block_size);
+}
 
-      if (r < 0)
-        r = 0;
-      if (r > 255)
-        r = 255;
-      if (g < 0)
-        g = 0;
-      if (g > 255)
-        g = 255;
-      if (b < 0)
-        b = 0;
-      if (b > 255)
-        b = 255;
-
-      buffer[pixel] = r;
-      buffer[64 + pixel] = g;
-      buffer[128 + pixel] = b;
+/**
+ * Inverse transform one block of coefficients and store its block_size x block_size samples at block
+ * last_index is the zigzag index of the last non-zero coefficient, full size blocks with nothing past the DC or the
+ * top left 4x4 corner take a shortcut that gives the same samples
+ */
+inline void transform_block(idct_function idct, const QuantizationTable *q_table, uint32_t block_size,
+                            short *buffer, int last_index, short *block, uint32_t plane_stride) {
+#if !USE_FLOAT
+  if (block_size == 8 && last_index == 0) {
+    short sample = inverse_dct_dc(buffer[0], q_table);
+    for (uint32_t i = 0; i < 8; i++) {
+      for (uint32_t j = 0; j < 8; j++) {
+        block[i * plane_stride + j] = sample;
+      }
     }
+    return;
+  }
+  if (block_size == 8 && last_index <= IDCT_LOW4_LAST_INDEX) {
+    idct = inverse_dct_component_low4;
+  }
+#endif
+
+  idct(buffer, q_table);
+  for (uint32_t i = 0; i < block_size; i++) {
+    memcpy(&block[i * plane_stride], &buffer[i * 8], block_size * sizeof(short));
   }
 }
 
-static short *decompress_scanline(JpegDecompressor *d) {
-  short *mcus = (short *) malloc((jpegInfo.mcu_height_real * jpegInfo.mcu_width_real) * (3 * 64) * sizeof(short));
-  short previous_dcs[3] = {0};
-  uint32_t restart_interval = jpegInfo.restart_interval * jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor;
-
-  for (uint32_t row = 0; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
-    for (uint32_t col = 0; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
-      if (restart_interval != 0 && (row * jpegInfo.mcu_width_real + col) % restart_interval == 0) {
-        previous_dcs[0] = 0;
-        previous_dcs[1] = 0;
-        previous_dcs[2] = 0;
-
-        // Align get buffer to next byte
-        uint32_t offset = d->bits_left % 8;
-        if (offset != 0) {
-          d->bit_buffer <<= offset;
-          d->bits_left -= offset;
-        }
-      }
+/**
+ * Called before every MCU, at the start of a restart interval the DC predictions start over and the bitstream
+ * continues at the next byte boundary
+ */
+static inline void restart_mcus(JpegDecompressor *d, uint32_t restart_interval, uint32_t mcu, short *previous_dcs) {
+  if (restart_interval == 0 || mcu % restart_interval != 0) {
+    return;
+  }
+  previous_dcs[0] = 0;
+  previous_dcs[1] = 0;
+  previous_dcs[2] = 0;
+
+  // Align get buffer to next byte
+  uint32_t offset = d->bits_left % 8;
+  if (offset != 0) {
+    d->bit_reservoir <<= offset;
+    d->bits_left -= offset;
+  }
+}
 
-      for (uint32_t color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (uint32_t y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
-          for (uint32_t x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
-            // MCU to index is (current row + vertical sampling) * total number of MCUs in a row of the JPEG
-            // + (current col + horizontal sampling)
-            short *buffer = &mcus[(((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6];
-
-            // Decode Huffman coded bitstream
-            if (decode_mcu(d, color_index, buffer, &previous_dcs[color_index]) != 0) {
-              jpegInfo.valid = 0;
-              fprintf(stderr, "Error: Invalid MCU\n");
-              free(mcus);
-              return NULL;
-            }
-
-            // Compute inverse DCT with ANN algorithm
-#if USE_FLOAT
-            inverse_dct_component_float(buffer);
-#else
-            inverse_dct_component(buffer);
-#endif
+/**
+ * Entropy decode and inverse transform the MCUs [first_mcu, end_mcu) into the sample planes, for any sampling layout
+ * The MCUs must lie within the MCU rows held by the planes
+ * Returns 0 on success, -1 if an MCU is invalid
+ */
+static int decode_mcus_generic(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                               SamplePlanes *samples, short *previous_dcs) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  uint32_t mcu_row = first_mcu / mcus_per_row;
+  uint32_t mcu_col = first_mcu % mcus_per_row;
+  uint32_t block_size = ctx->block_size;
+  idct_function idct = select_idct(ctx);
+  short buffer[64];
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    restart_mcus(d, restart_interval, mcu, previous_dcs);
+
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+      uint32_t plane_stride = samples->strides[color_index];
+      uint32_t plane_row = (mcu_row - samples->first_mcu_row) * component->v_samp_factor * block_size;
+
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          // Decode Huffman coded bitstream
+          int last_index = decode_block(ctx, d, color_index, buffer, &previous_dcs[color_index]);
+          if (last_index < 0) {
+            return -1;
+          }
+          if (samples->planes[color_index] == NULL) {
+            // Only decoded to keep the bitstream in sync
+            continue;
           }
-        }
-      }
 
-      // Convert from YCbCr to RGB
-      short *cbcr = &mcus[((row * jpegInfo.mcu_width_real + col) * 3) << 6];
-      for (int y = jpegInfo.max_v_samp_factor - 1; y >= 0; y--) {
-        for (int x = jpegInfo.max_h_samp_factor - 1; x >= 0; x--) {
-          short *buffer = &mcus[(((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3) << 6];
-          ycbcr_to_rgb_pixel(buffer, cbcr, y, x);
+          // Compute inverse DCT with ANN algorithm
+          short *block = &samples->planes[color_index][(plane_row + y * block_size) * plane_stride +
+                                                        (mcu_col * component->h_samp_factor + x) * block_size];
+          transform_block(idct, q_table, block_size, buffer, last_index, block, plane_stride);
         }
       }
     }
+
+    if (++mcu_col == mcus_per_row) {
+      mcu_col = 0;
+      mcu_row++;
+    }
   }
 
-  return mcus;
+  return 0;
 }
 
+/*
+ * Decoding loops for the usual sampling layouts. Chroma components always have sampling factors of 1 (see
+ * read_SOF_color_component_info), so a layout is the number of components and the luma sampling factors. With those
+ * known at compile time the block loops unroll and the block offsets fold into constants.
+ */
+
 /**
- * Read JPEG markers
- * Return 0 when the SOS marker is found
- * Otherwise return 1
- *
- * @param d JpegDecompressor struct that holds all information about the JPEG currently being decoded
+ * Decode and transform the h x v blocks of one component of an MCU, the top left one goes to block
+ * The blocks are only decoded if block is NULL
  */
-static int read_next_marker(JpegDecompressor *d) {
-  int marker;
+static inline __attribute__((always_inline)) int decode_component_blocks(JpegCpuContext *ctx, JpegDecompressor *d,
+                                                                         idct_function idct, uint32_t color_index,
+                                                                         uint32_t h, uint32_t v, short *block,
+                                                                         uint32_t plane_stride, short *previous_dc) {
+  ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+  QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+  uint32_t block_size = ctx->block_size;
+  short buffer[64];
+
+  for (uint32_t y = 0; y < v; y++) {
+    for (uint32_t x = 0; x < h; x++) {
+      int last_index = decode_block(ctx, d, color_index, buffer, previous_dc);
+      if (last_index < 0) {
+        return -1;
+      }
+      if (block != NULL) {
+        transform_block(idct, q_table, block_size, buffer, last_index, &block[(y * plane_stride + x) * block_size],
+                        plane_stride);
+      }
+    }
+  }
 
-  marker = skip_to_next_marker(d);
-  switch (marker) {
-    case -1:
-      jpegInfo.valid = 0;
-      fprintf(stderr, "Error: Read past EOF\n");
-      break;
+  return 0;
+}
 
-    case M_APP_FIRST ... M_APP_LAST:
-      skip_marker(d);
-      break;
+static inline __attribute__((always_inline)) int decode_mcus_layout(JpegCpuContext *ctx, JpegDecompressor *d,
+                                                                    uint32_t first_mcu, uint32_t end_mcu,
+                                                                    SamplePlanes *samples, short *previous_dcs,
+                                                                    uint32_t num_components, uint32_t luma_h,
+                                                                    uint32_t luma_v) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / luma_h;
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  uint32_t mcu_row = first_mcu / mcus_per_row;
+  uint32_t mcu_col = first_mcu % mcus_per_row;
+  uint32_t block_size = ctx->block_size;
+  idct_function idct = select_idct(ctx);
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    restart_mcus(d, restart_interval, mcu, previous_dcs);
+
+    uint32_t plane_row = (mcu_row - samples->first_mcu_row) * block_size;
+    short *luma = &samples->planes[0][plane_row * luma_v * samples->strides[0] + mcu_col * luma_h * block_size];
+    if (decode_component_blocks(ctx, d, idct, 0, luma_h, luma_v, luma, samples->strides[0], &previous_dcs[0]) != 0) {
+      return -1;
+    }
+    for (uint32_t color_index = 1; color_index < num_components; color_index++) {
+      short *chroma = NULL;
+      if (samples->planes[color_index] != NULL) {
+        chroma = &samples->planes[color_index][plane_row * samples->strides[color_index] + mcu_col * block_size];
+      }
+      if (decode_component_blocks(ctx, d, idct, color_index, 1, 1, chroma, samples->strides[color_index],
+                                  &previous_dcs[color_index]) != 0) {
+        return -1;
+      }
+    }
 
-    case M_DQT:
-      process_DQT(d);
-      break;
+    if (++mcu_col == mcus_per_row) {
+      mcu_col = 0;
+      mcu_row++;
+    }
+  }
 
-    case M_DRI:
-      process_DRI(d);
-      break;
+  return 0;
+}
 
-    case M_SOF0:
-      // case M_SOF5 ... M_SOF7:
-      // case M_SOF9 ... M_SOF11:
-      // case M_SOF13 ... M_SOF15:
-      process_SOFn(d);
-      break;
+static int decode_mcus_gray(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                            SamplePlanes *samples, short *previous_dcs) {
+  return decode_mcus_layout(ctx, d, first_mcu, end_mcu, samples, previous_dcs, 1, 1, 1);
+}
 
-    case M_SOF2:
-      // TODO: handle progressive JPEG
-      jpegInfo.valid = 0;
-      break;
+static int decode_mcus_444(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                           SamplePlanes *samples, short *previous_dcs) {
+  return decode_mcus_layout(ctx, d, first_mcu, end_mcu, samples, previous_dcs, 3, 1, 1);
+}
 
-    case M_DHT:
-      process_DHT(d);
-      break;
+static int decode_mcus_422(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                           SamplePlanes *samples, short *previous_dcs) {
+  return decode_mcus_layout(ctx, d, first_mcu, end_mcu, samples, previous_dcs, 3, 2, 1);
+}
 
-    case M_SOS:
-      process_SOS(d);
-      return 0;
+static int decode_mcus_440(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                           SamplePlanes *samples, short *previous_dcs) {
+  return decode_mcus_layout(ctx, d, first_mcu, end_mcu, samples, previous_dcs, 3, 1, 2);
+}
 
-    case M_COM:
-    case M_EXT_FIRST ... M_EXT_LAST:
-    case M_DNL:
-    case M_DHP:
-    case M_EXP:
-      skip_marker(d);
-      break;
+static int decode_mcus_420(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                           SamplePlanes *samples, short *previous_dcs) {
+  return decode_mcus_layout(ctx, d, first_mcu, end_mcu, samples, previous_dcs, 3, 2, 2);
+}
 
-    default:
-      jpegInfo.valid = 0;
-      fprintf(stderr, "Error: Unhandled marker: FF %X\n", marker);
+/**
+ * Keep the first ctx->coefficient_count coefficients of a decoded block in zigzag order, dequantized with q_table
+ * unless the output asks for them as coded
+ */
+inline void store_coefficients(JpegCpuContext *ctx, const QuantizationTable *q_table, const short *buffer,
+                               short *coefficients) {
+  uint32_t count = ctx->coefficient_count;
+
+  if (ctx->output_format == JPEG_OUTPUT_QUANTIZED_COEFFICIENTS) {
+    for (uint32_t i = 0; i < count; i++) {
+      coefficients[i] = buffer[ZIGZAG_ORDER[i]];
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    coefficients[i] = buffer[ZIGZAG_ORDER[i]] * q_table->table[ZIGZAG_ORDER[i]];
+  }
+}
+
+/**
+ * Entropy decode the MCUs [first_mcu, end_mcu) and store the coefficients of every block in the planes, which hold a
+ * row of blocks per line (see alloc_sample_planes). There is no inverse DCT, so one loop does for every layout
+ * Returns 0 on success, -1 if an MCU is invalid
+ */
+static int decode_mcus_coefficients(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                                    SamplePlanes *samples, short *previous_dcs) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  uint32_t mcu_row = first_mcu / mcus_per_row;
+  uint32_t mcu_col = first_mcu % mcus_per_row;
+  uint32_t count = ctx->coefficient_count;
+  short buffer[64];
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    restart_mcus(d, restart_interval, mcu, previous_dcs);
+
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+      uint32_t plane_stride = samples->strides[color_index];
+      uint32_t plane_row = (mcu_row - samples->first_mcu_row) * component->v_samp_factor;
+
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          if (decode_block(ctx, d, color_index, buffer, &previous_dcs[color_index]) < 0) {
+            return -1;
+          }
+          store_coefficients(ctx, q_table, buffer,
+                             &samples->planes[color_index][(plane_row + y) * plane_stride +
+                                                           (mcu_col * component->h_samp_factor + x) * count]);
+        }
+      }
+    }
+
+    if (++mcu_col == mcus_per_row) {
+      mcu_col = 0;
+      mcu_row++;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Entropy decode the MCUs [first_mcu, end_mcu) only to keep the bitstream and the DC predictors in sync, for the MCUs
+ * outside the region being decoded. The AC coefficients are skipped over and nothing is transformed
+ * Returns 0 on success, -1 if an MCU is invalid
+ */
+int skip_mcus(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu, short *previous_dcs) {
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  short buffer[64];
+
+  if (ctx->progressive) {
+    // Already entropy decoded into the coefficient store
+    return 0;
+  }
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    restart_mcus(d, restart_interval, mcu, previous_dcs);
+
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      uint32_t blocks = component->h_samp_factor * component->v_samp_factor;
+      for (uint32_t i = 0; i < blocks; i++) {
+        if (decode_mcu_dc_only(ctx, d, color_index, buffer, &previous_dcs[color_index]) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Entropy decode the MCUs [first_mcu, end_mcu) and keep every block as decoded, 64 coefficients in blocks and the
+ * zigzag index of its last non-zero coefficient in last_indices, block after block in the order of the bitstream
+ * Returns 0 on success, -1 if an MCU is invalid
+ */
+int entropy_decode_mcus(JpegCpuContext *ctx, JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu,
+                        short *blocks, int *last_indices, short *previous_dcs) {
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    restart_mcus(d, restart_interval, mcu, previous_dcs);
+
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      uint32_t block_count = component->h_samp_factor * component->v_samp_factor;
+      for (uint32_t i = 0; i < block_count; i++) {
+        int last_index = decode_block(ctx, d, color_index, blocks, &previous_dcs[color_index]);
+        if (last_index < 0) {
+          return -1;
+        }
+        *last_indices++ = last_index;
+        blocks += 64;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Inverse transform the blocks of the MCUs [first_mcu, end_mcu) kept by entropy_decode_mcus into the sample planes,
+ * at the block size of the context. The blocks are left as they are, so they can be transformed at other sizes
+ */
+void transform_mcus(JpegCpuContext *ctx, uint32_t first_mcu, uint32_t end_mcu, const short *blocks,
+                    const int *last_indices, SamplePlanes *samples) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_row = first_mcu / mcus_per_row;
+  uint32_t mcu_col = first_mcu % mcus_per_row;
+  uint32_t block_size = ctx->block_size;
+  idct_function idct = select_idct(ctx);
+  short buffer[64];
+
+  for (uint32_t mcu = first_mcu; mcu < end_mcu; mcu++) {
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+      QuantizationTable *q_table = &ctx->jpegInfo.quant_tables[component->quant_table_id];
+      uint32_t plane_stride = samples->strides[color_index];
+      uint32_t plane_row = (mcu_row - samples->first_mcu_row) * component->v_samp_factor * block_size;
+
+      for (uint32_t y = 0; y < component->v_samp_factor; y++) {
+        for (uint32_t x = 0; x < component->h_samp_factor; x++) {
+          if (samples->planes[color_index] != NULL) {
+            short *block = &samples->planes[color_index][(plane_row + y * block_size) * plane_stride +
+                                                          (mcu_col * component->h_samp_factor + x) * block_size];
+            memcpy(buffer, blocks, sizeof(buffer));
+            transform_block(idct, q_table, block_size, buffer, *last_indices, block, plane_stride);
+          }
+          blocks += 64;
+          last_indices++;
+        }
+      }
+    }
+
+    if (++mcu_col == mcus_per_row) {
+      mcu_col = 0;
+      mcu_row++;
+    }
+  }
+}
+
+/**
+ * Pick the MCU decoding loop for the sampling layout of the frame, anything unusual takes the generic one
+ * Progressive images are read from the coefficient store whatever their layout
+ */
+static void select_mcu_decoder(JpegCpuContext *ctx) {
+  uint32_t num_components = ctx->jpegInfo.num_color_components;
+  uint32_t h = ctx->jpegInfo.max_h_samp_factor;
+  uint32_t v = ctx->jpegInfo.max_v_samp_factor;
+
+  ctx->decode_mcus = decode_mcus_generic;
+  if (ctx->progressive) {
+    ctx->decode_mcus = decode_mcus_progressive;
+  } else if (is_coefficient_output(ctx->output_format)) {
+    ctx->decode_mcus = decode_mcus_coefficients;
+  } else if (num_components == 1 && h == 1 && v == 1) {
+    ctx->decode_mcus = decode_mcus_gray;
+  } else if (num_components == 3 && h == 1 && v == 1) {
+    ctx->decode_mcus = decode_mcus_444;
+  } else if (num_components == 3 && h == 2 && v == 1) {
+    ctx->decode_mcus = decode_mcus_422;
+  } else if (num_components == 3 && h == 1 && v == 2) {
+    ctx->decode_mcus = decode_mcus_440;
+  } else if (num_components == 3 && h == 2 && v == 2) {
+    ctx->decode_mcus = decode_mcus_420;
+  }
+}
+
+/**
+ * Samples per side of the decoded blocks for images at 1/scale_denom of their size, rounded down to a supported scale
+ */
+static uint32_t scale_block_size(uint32_t scale_denom) {
+  uint32_t block_size = 8;
+  while (block_size > 1 && scale_denom >= 2) {
+    block_size /= 2;
+    scale_denom /= 2;
+  }
+  return block_size;
+}
+
+/**
+ * The part [left, right) x [top, bottom) of an image_width x image_height image decoded with blocks of block_size
+ * samples that is output: all of it, or the pixels region covers once scaled down, clipped to the image
+ */
+static void scaled_region(const JpegRegion *region, uint32_t block_size, uint32_t image_width, uint32_t image_height,
+                          uint32_t *left, uint32_t *top, uint32_t *right, uint32_t *bottom) {
+  uint32_t width = (image_width * block_size + 7) / 8;
+  uint32_t height = (image_height * block_size + 7) / 8;
+
+  *left = 0;
+  *top = 0;
+  *right = width;
+  *bottom = height;
+  if (region->width == 0) {
+    return;
+  }
+
+  uint64_t x = (uint64_t) region->x * block_size / 8;
+  uint64_t y = (uint64_t) region->y * block_size / 8;
+  uint64_t end_x = (((uint64_t) region->x + region->width) * block_size + 7) / 8;
+  uint64_t end_y = (((uint64_t) region->y + region->height) * block_size + 7) / 8;
+  *left = x < width ? x : width;
+  *top = y < height ? y : height;
+  *right = end_x < width ? end_x : width;
+  *bottom = end_y < height ? end_y : height;
+}
+
+/**
+ * Rectangle of the decoded image that is output, in pixels of the image scaled down along with the blocks (see
+ * scaled_region). Coefficient output counts blocks of the luminance instead, including those of the padding MCUs
+ */
+void output_region(JpegCpuContext *ctx, uint32_t *left, uint32_t *top, uint32_t *right, uint32_t *bottom) {
+  if (is_coefficient_output(ctx->output_format)) {
+    *left = 0;
+    *top = 0;
+    *right = ctx->jpegInfo.mcu_width_real;
+    *bottom = ctx->jpegInfo.mcu_height_real;
+    return;
+  }
+  scaled_region(&ctx->region, ctx->block_size, ctx->jpegInfo.image_width, ctx->jpegInfo.image_height, left, top,
+                right, bottom);
+}
+
+/**
+ * Size of the decoded image, or of the region of it that is output
+ */
+static uint32_t output_width(JpegCpuContext *ctx) {
+  uint32_t left, top, right, bottom;
+  output_region(ctx, &left, &top, &right, &bottom);
+  return right - left;
+}
+
+static uint32_t output_height(JpegCpuContext *ctx) {
+  uint32_t left, top, right, bottom;
+  output_region(ctx, &left, &top, &right, &bottom);
+  return bottom - top;
+}
+
+/**
+ * Lines of the decoded image per row of blocks, coefficient output stores each row of blocks as a single line
+ */
+uint32_t output_block_lines(JpegCpuContext *ctx) {
+  return is_coefficient_output(ctx->output_format) ? 1 : ctx->block_size;
+}
+
+/**
+ * Bytes per pixel of the decoded image: 3 for RGB and BGR, 4 for RGBA and 1 for luma-only or planar YUV output which
+ * are not color converted. RGB output of grayscale images is not color converted either
+ */
+static uint32_t format_pixel_size(JpegOutputFormat format, uint32_t num_color_components) {
+  switch (format) {
+    case JPEG_OUTPUT_RGB:
+      return num_color_components != 1 ? 3 : 1;
+    case JPEG_OUTPUT_BGR:
+      return 3;
+    case JPEG_OUTPUT_RGBA:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+static uint32_t output_bytes_per_pixel(JpegCpuContext *ctx) {
+  return format_pixel_size(ctx->output_format, ctx->jpegInfo.num_color_components);
+}
+
+/**
+ * Bytes per row of the decoded image (the Y plane of planar YUV, the luminance blocks of coefficient output), rows
+ * span every MCU including the padding past output_width unless the image goes to a buffer of the caller or only a
+ * region of it is decoded
+ */
+static uint32_t output_stride(JpegCpuContext *ctx) {
+  if (ctx->output_pixels != NULL) {
+    return ctx->output_pixels_stride;
+  }
+  if (is_coefficient_output(ctx->output_format)) {
+    return ctx->jpegInfo.mcu_width_real * ctx->coefficient_count * sizeof(short);
+  }
+  if (ctx->region.width != 0) {
+    return output_width(ctx) * output_bytes_per_pixel(ctx);
+  }
+  return ctx->jpegInfo.mcu_width_real * ctx->block_size * output_bytes_per_pixel(ctx);
+}
+
+/**
+ * Lines of the image decoded as a whole: every MCU row, or only the lines of the region
+ */
+uint32_t output_line_count(JpegCpuContext *ctx) {
+  if (ctx->region.width != 0) {
+    return output_height(ctx);
+  }
+  return ctx->jpegInfo.mcu_height_real * output_block_lines(ctx);
+}
+
+/**
+ * Bytes per row of blocks of a component with coefficient output
+ */
+static uint32_t output_coefficient_stride(JpegCpuContext *ctx, uint32_t color_index) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  return mcus_per_row * ctx->jpegInfo.color_components[color_index].h_samp_factor * ctx->coefficient_count *
+         sizeof(short);
+}
+
+/**
+ * Rows of blocks of a component with coefficient output that cover line_count rows of luminance blocks
+ */
+static uint32_t output_coefficient_rows(JpegCpuContext *ctx, uint32_t color_index, uint32_t line_count) {
+  return line_count / ctx->jpegInfo.max_v_samp_factor * ctx->jpegInfo.color_components[color_index].v_samp_factor;
+}
+
+/**
+ * Bytes per row of the U and V planes of planar YUV output, which have half the width and height of the Y plane
+ */
+static uint32_t output_chroma_stride(JpegCpuContext *ctx) {
+  return (ctx->jpegInfo.mcu_width_real * ctx->block_size + 1) / 2;
+}
+
+/**
+ * Bytes needed for line_count rows of the decoded image, with planar YUV the U and then the V plane follow the Y rows
+ * and with coefficient output the blocks of the other components follow the luminance blocks
+ */
+size_t output_size(JpegCpuContext *ctx, uint32_t line_count) {
+  if (is_coefficient_output(ctx->output_format)) {
+    size_t size = 0;
+    for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      size += (size_t) output_coefficient_stride(ctx, color_index) *
+              output_coefficient_rows(ctx, color_index, line_count);
+    }
+    return size;
+  }
+
+  size_t size = (size_t) output_stride(ctx) * line_count;
+  if (ctx->output_format == JPEG_OUTPUT_YUV420) {
+    size += (size_t) 2 * output_chroma_stride(ctx) * ((line_count + 1) / 2);
+  }
+  return size;
+}
+
+/**
+ * Lay out the planes of line_count image lines from first_line onwards in pixels, which holds output_size bytes
+ */
+void init_output_rows(JpegCpuContext *ctx, uint8_t *pixels, uint32_t first_line, uint32_t line_count,
+                      OutputRows *output) {
+  memset(output, 0, sizeof(OutputRows));
+  output->planes[0] = pixels;
+  output->strides[0] = output_stride(ctx);
+  output->first_line = first_line;
+
+  if (is_coefficient_output(ctx->output_format)) {
+    for (uint32_t color_index = 1; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+      output->strides[color_index] = output_coefficient_stride(ctx, color_index);
+      output->planes[color_index] =
+          output->planes[color_index - 1] +
+          (size_t) output->strides[color_index - 1] * output_coefficient_rows(ctx, color_index - 1, line_count);
+    }
+  } else if (ctx->output_format == JPEG_OUTPUT_YUV420) {
+    uint32_t chroma_rows = (first_line + line_count + 1) / 2 - (first_line + 1) / 2;
+    output->strides[1] = output_chroma_stride(ctx);
+    output->strides[2] = output->strides[1];
+    output->planes[1] = pixels + (size_t) output->strides[0] * line_count;
+    output->planes[2] = output->planes[1] + (size_t) output->strides[1] * chroma_rows;
+  }
+}
+
+static inline uint8_t clamp_sample(int value) {
+  if (value < 0) {
+    return 0;
+  }
+  if (value > 255) {
+    return 255;
+  }
+  return value;
+}
+
+/**
+ * Fill the U and V rows of planar YUV output whose top line lies in the image lines [first_line, end_line)
+ * Every chroma sample averages the 2x2 pixels it covers, only the lines within the range are used so that MCU rows can
+ * be converted on their own. 4:2:0 chroma is already at the right size and is only level shifted
+ */
+static void convert_chroma_rows(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t first_line, uint32_t end_line,
+                                OutputRows *output) {
+  uint32_t max_h = ctx->jpegInfo.max_h_samp_factor;
+  uint32_t max_v = ctx->jpegInfo.max_v_samp_factor;
+  uint32_t row_width = ctx->jpegInfo.mcu_width_real * ctx->block_size;
+  uint32_t plane_first_line = samples->first_mcu_row * max_v * ctx->block_size;
+  uint32_t output_first_row = (output->first_line + 1) / 2;
+  uint32_t width = output->strides[1];
+
+  for (uint32_t chroma_y = (first_line + 1) / 2; chroma_y < (end_line + 1) / 2; chroma_y++) {
+    uint32_t y0 = chroma_y * 2 - plane_first_line;
+    uint32_t y1 = chroma_y * 2 + 1 < end_line ? y0 + 1 : y0;
+
+    for (uint32_t color_index = 1; color_index < 3; color_index++) {
+      uint8_t *out = &output->planes[color_index][(size_t)(chroma_y - output_first_row) * output->strides[color_index]];
+      if (samples->planes[color_index] == NULL) {
+        memset(out, 128, width);
+        continue;
+      }
+
+      short *row0 = &samples->planes[color_index][(y0 / max_v) * samples->strides[color_index]];
+      short *row1 = &samples->planes[color_index][(y1 / max_v) * samples->strides[color_index]];
+      if (max_h == 2 && row0 == row1) {
+        gray_row(row0, out, width);
+        continue;
+      }
+
+      for (uint32_t x = 0; x < width; x++) {
+        uint32_t x0 = (x * 2) / max_h;
+        uint32_t x1 = (x * 2 + 1 < row_width ? x * 2 + 1 : x * 2) / max_h;
+        int sum = row0[x0] + row0[x1] + row1[x0] + row1[x1];
+        out[x] = clamp_sample(((sum + 2) >> 2) + 128);
+      }
+    }
+  }
+}
+
+/**
+ * Copy the coefficients of the MCU rows [first_row, end_row) into output, a line of each plane is a row of blocks
+ */
+static void copy_coefficient_rows(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t first_row, uint32_t end_row,
+                                  OutputRows *output) {
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    uint32_t v = ctx->jpegInfo.color_components[color_index].v_samp_factor;
+    uint32_t output_first_row = output_coefficient_rows(ctx, color_index, output->first_line);
+    size_t row_size = samples->strides[color_index] * sizeof(short);
+
+    for (uint32_t row = first_row * v; row < end_row * v; row++) {
+      memcpy(&output->planes[color_index][(size_t)(row - output_first_row) * output->strides[color_index]],
+             &samples->planes[color_index][(row - samples->first_mcu_row * v) * samples->strides[color_index]],
+             row_size);
+    }
+  }
+}
+
+/**
+ * The color conversion kernel writing pixels in the byte order of format
+ */
+static color_convert_function select_color_converter(JpegOutputFormat format) {
+  switch (format) {
+    case JPEG_OUTPUT_BGR:
+      return ycbcr_to_bgr_row;
+    case JPEG_OUTPUT_RGBA:
+      return ycbcr_to_rgba_row;
+    default:
+      return ycbcr_to_rgb_row;
+  }
+}
+
+/**
+ * Color convert width pixels from x onwards of a pixel row, y_row, cb_row and cr_row start at the left of the image
+ * The kernels take the chroma samples of horizontally subsampled rows in whole pairs of pixels, so an odd first pixel
+ * is converted on its own
+ */
+static inline void convert_row_from(color_convert_function convert_row, const short *y_row, const short *cb_row,
+                                    const short *cr_row, uint32_t h_shift, uint32_t x, uint8_t *pixels,
+                                    uint32_t width, uint32_t pixel_size) {
+  if ((x & ((1u << h_shift) - 1)) != 0 && width > 0) {
+    convert_row(&y_row[x], &cb_row[x >> h_shift], &cr_row[x >> h_shift], h_shift, pixels, 1);
+    x++;
+    pixels += pixel_size;
+    width--;
+  }
+  convert_row(&y_row[x], &cb_row[x >> h_shift], &cr_row[x >> h_shift], h_shift, pixels, width);
+}
+
+/**
+ * Convert the MCU rows [first_row, end_row) from YCbCr to RGB into output, which must hold their lines
+ * Chroma rows are repeated when the luminance is vertically subsampled. Grayscale images, luma-only and planar YUV
+ * output skip the conversion and take the luminance as is, coefficient output is copied
+ * Only the pixels within the output region are written (see output_region), the MCU padding past them is dropped
+ */
+void convert_mcu_rows(JpegCpuContext *ctx, SamplePlanes *samples, uint32_t first_row, uint32_t end_row,
+                      OutputRows *output) {
+  if (is_coefficient_output(ctx->output_format)) {
+    copy_coefficient_rows(ctx, samples, first_row, end_row, output);
+    return;
+  }
+
+  uint32_t max_h = ctx->jpegInfo.max_h_samp_factor;
+  uint32_t max_v = ctx->jpegInfo.max_v_samp_factor;
+  uint32_t block_size = ctx->block_size;
+  uint32_t left, top, right, bottom;
+  output_region(ctx, &left, &top, &right, &bottom);
+  uint32_t width = right - left;
+  uint32_t bytes_per_pixel = output_bytes_per_pixel(ctx);
+  color_convert_function convert_row = select_color_converter(ctx->output_format);
+  uint32_t first_line = first_row * max_v * block_size;
+  uint32_t end_line = end_row * max_v * block_size;
+  uint32_t visible_first_line = first_line > top ? first_line : top;
+  uint32_t visible_end_line = end_line < bottom ? end_line : bottom;
+
+  for (uint32_t y = visible_first_line; y < visible_end_line; y++) {
+    uint32_t plane_y = y - samples->first_mcu_row * max_v * block_size;
+    short *y_row = &samples->planes[0][plane_y * samples->strides[0]];
+    uint8_t *row_pixels = &output->planes[0][(size_t)(y - output->first_line) * output->strides[0]];
+
+    if (bytes_per_pixel == 1) {
+      gray_row(&y_row[left], row_pixels, width);
+      continue;
+    }
+    if (samples->planes[1] == NULL) {
+      gray_to_pixels_row(&y_row[left], row_pixels, width, bytes_per_pixel);
+      continue;
+    }
+
+    short *cb_row = &samples->planes[1][(plane_y / max_v) * samples->strides[1]];
+    short *cr_row = &samples->planes[2][(plane_y / max_v) * samples->strides[2]];
+    convert_row_from(convert_row, y_row, cb_row, cr_row, max_h - 1, left, row_pixels, width, bytes_per_pixel);
+  }
+
+  if (ctx->output_format == JPEG_OUTPUT_YUV420) {
+    convert_chroma_rows(ctx, samples, first_line, end_line, output);
+  }
+}
+
+/**
+ * Shared state of the threads decoding one image in parallel
+ */
+typedef struct ParallelDecode {
+  JpegCpuContext *ctx;
+  SamplePlanes samples;
+  OutputRows *output;
+  const uint32_t *segment_offsets; // where every restart segment starts in the destuffed data
+  uint32_t segment_count;
+  uint32_t mcu_rows;
+  uint32_t next_segment; // next restart segment to decode, claimed atomically
+  uint32_t next_row;     // next MCU row to convert to RGB, claimed atomically
+  int error;
+} ParallelDecode;
+
+static void *decode_restart_segments(void *arg) {
+  ParallelDecode *job = (ParallelDecode *) arg;
+  JpegCpuContext *ctx = job->ctx;
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  uint32_t mcu_count = job->mcu_rows * (ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor);
+  uint32_t segment;
+
+  while ((segment = __atomic_fetch_add(&job->next_segment, 1, __ATOMIC_RELAXED)) < job->segment_count) {
+    // Each segment starts byte aligned with reset DC predictions, so it only needs a fresh bit reader
+    JpegDecompressor d = ctx->decompressor;
+    short previous_dcs[3] = {0};
+    d.ptr = d.data + job->segment_offsets[segment];
+    d.bit_reservoir = 0;
+    d.bits_left = 0;
+    d.padding_bits = 0;
+
+    uint32_t first_mcu = segment * restart_interval;
+    uint32_t end_mcu = first_mcu + restart_interval < mcu_count ? first_mcu + restart_interval : mcu_count;
+    if (ctx->decode_mcus(ctx, &d, first_mcu, end_mcu, &job->samples, previous_dcs) != 0) {
+      __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+static void *convert_rows(void *arg) {
+  ParallelDecode *job = (ParallelDecode *) arg;
+  uint32_t row;
+
+  while ((row = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED)) < job->mcu_rows) {
+    convert_mcu_rows(job->ctx, &job->samples, row, row + 1, job->output);
+  }
+
+  return NULL;
+}
+
+/**
+ * Run function on the calling thread and num_threads - 1 helper threads, and wait for all of them
+ */
+void run_on_threads(uint32_t num_threads, void *(*function)(void *), void *arg) {
+  pthread_t threads[num_threads];
+  uint32_t started = 0;
+
+  for (; started + 1 < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, function, arg) != 0) {
+      break;
+    }
+  }
+  function(arg);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/**
+ * Decode an image with restart markers by handing whole restart segments to ctx->num_threads threads
+ * Every segment is decoded straight into its place in full image sample planes, which are then converted to RGB
+ * Returns 1 if the image was decoded (or found invalid), 0 if it should be decoded serially instead
+ */
+static int decompress_restart_segments(JpegCpuContext *ctx, OutputRows *output) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  uint32_t restart_interval = ctx->jpegInfo.restart_interval;
+  uint32_t expected_segments = (mcus_per_row * mcu_rows + restart_interval - 1) / restart_interval;
+
+  if (ctx->num_threads < 2 || expected_segments < 2) {
+    return 0;
+  }
+
+  // Destuffing found the restart markers, any missing or extra ones are left for the serial decoder to deal with
+  EntropySegment *segment = &ctx->entropy_segment;
+  if (!segment->restarts_in_sequence || segment->restart_count != expected_segments) {
+    return 0;
+  }
+
+  ParallelDecode job;
+  memset(&job, 0, sizeof(ParallelDecode));
+  job.ctx = ctx;
+  job.output = output;
+  job.mcu_rows = mcu_rows;
+  job.segment_offsets = segment->restart_offsets;
+  job.segment_count = segment->restart_count;
+  if (alloc_sample_planes(ctx, &job.samples, mcu_rows) != 0) {
+    return 0;
+  }
+
+  uint32_t num_threads = ctx->num_threads < job.segment_count ? ctx->num_threads : job.segment_count;
+  run_on_threads(num_threads, decode_restart_segments, &job);
+  if (job.error) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Invalid MCU\n");
+  } else {
+    run_on_threads(ctx->num_threads < mcu_rows ? ctx->num_threads : mcu_rows, convert_rows, &job);
+  }
+
+  free_sample_planes(ctx, &job.samples);
+  return 1;
+}
+
+/**
+ * Hand the pixel rows of an MCU row that lie within the output region to the row callback, output holds the whole
+ * MCU row. Rows are numbered from the top of the region
+ * With planar YUV the U and V rows are moved up to directly follow the Y rows that are handed over
+ */
+void emit_mcu_row(JpegCpuContext *ctx, OutputRows *output) {
+  uint32_t row_lines = ctx->jpegInfo.max_v_samp_factor * output_block_lines(ctx);
+  uint32_t left, top, right, bottom;
+  output_region(ctx, &left, &top, &right, &bottom);
+  uint32_t first_line = output->first_line > top ? output->first_line : top;
+  uint32_t end_line = output->first_line + row_lines < bottom ? output->first_line + row_lines : bottom;
+
+  if (first_line < end_line) {
+    uint32_t line_count = end_line - first_line;
+    if (ctx->output_format == JPEG_OUTPUT_YUV420 && line_count < row_lines) {
+      OutputRows emitted;
+      init_output_rows(ctx, output->planes[0], first_line, line_count, &emitted);
+      size_t chroma_size = emitted.planes[2] - emitted.planes[1];
+      memmove(emitted.planes[1], output->planes[1], chroma_size);
+      memmove(emitted.planes[2], output->planes[2], chroma_size);
+    }
+    const uint8_t *rows = output->planes[0] + (size_t)(first_line - output->first_line) * output->strides[0];
+    ctx->row_callback(ctx->row_callback_data, rows, first_line - top, line_count, right - left, output_stride(ctx));
+  }
+}
+
+/**
+ * Decode the image one row of MCUs at a time, every row is converted to RGB in one pass
+ * With a row callback, pixels only holds a single MCU row which is handed to the callback as soon as it is converted,
+ * otherwise it holds the whole image (see output_line_count)
+ * Only the MCUs that intersect the output region are transformed and converted, the others are entropy decoded to
+ * follow the bitstream and the DC predictors, and decoding stops at the last MCU row the output needs
+ * Returns 0 on success, -1 if the image is invalid or out of memory
+ */
+static int decompress_mcu_rows(JpegCpuContext *ctx, uint8_t *pixels) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  uint32_t row_lines = ctx->jpegInfo.max_v_samp_factor * output_block_lines(ctx);
+  uint32_t mcu_pixels = ctx->jpegInfo.max_h_samp_factor * output_block_lines(ctx);
+  uint32_t left, top, right, bottom;
+  output_region(ctx, &left, &top, &right, &bottom);
+  if (ctx->line_limit != 0 && top + ctx->line_limit < bottom) {
+    bottom = top + ctx->line_limit;
+  }
+  if ((bottom + row_lines - 1) / row_lines < mcu_rows) {
+    mcu_rows = (bottom + row_lines - 1) / row_lines;
+  }
+  uint32_t first_mcu_row = top / row_lines;
+  uint32_t first_mcu_col = left / mcu_pixels;
+  uint32_t end_mcu_col = (right + mcu_pixels - 1) / mcu_pixels;
+
+  if (ctx->num_threads > 1 && !is_coefficient_output(ctx->output_format) &&
+      decompress_pipelined(ctx, pixels, mcu_rows, first_mcu_row, first_mcu_col, end_mcu_col)) {
+    return ctx->jpegInfo.valid ? 0 : -1;
+  }
+
+  SamplePlanes samples;
+  if (alloc_sample_planes(ctx, &samples, 1) != 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+
+  OutputRows output;
+  if (ctx->row_callback == NULL) {
+    init_output_rows(ctx, pixels, top, output_line_count(ctx), &output);
+  }
+
+  short previous_dcs[3] = {0};
+  for (uint32_t mcu_row = 0; mcu_row < mcu_rows; mcu_row++) {
+    uint32_t row_start = mcu_row * mcus_per_row;
+    uint32_t row_end = row_start + mcus_per_row;
+    uint32_t decode_start = mcu_row < first_mcu_row ? row_end : row_start + first_mcu_col;
+    uint32_t decode_end = mcu_row < first_mcu_row ? row_end : row_start + end_mcu_col;
+
+    samples.first_mcu_row = mcu_row;
+    if (skip_mcus(ctx, &ctx->decompressor, row_start, decode_start, previous_dcs) != 0 ||
+        ctx->decode_mcus(ctx, &ctx->decompressor, decode_start, decode_end, &samples, previous_dcs) != 0 ||
+        skip_mcus(ctx, &ctx->decompressor, decode_end, row_end, previous_dcs) != 0) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid MCU\n");
+      free_sample_planes(ctx, &samples);
+      return -1;
+    }
+    if (mcu_row < first_mcu_row) {
+      continue;
+    }
+
+    if (ctx->row_callback != NULL) {
+      init_output_rows(ctx, pixels, mcu_row * row_lines, row_lines, &output);
+      convert_mcu_rows(ctx, &samples, mcu_row, mcu_row + 1, &output);
+      emit_mcu_row(ctx, &output);
+    } else {
+      convert_mcu_rows(ctx, &samples, mcu_row, mcu_row + 1, &output);
+    }
+  }
+
+  free_sample_planes(ctx, &samples);
+  return 0;
+}
+
+/**
+ * Free the decoded image unless it is the buffer of the caller
+ */
+static void free_output(JpegCpuContext *ctx, uint8_t *pixels) {
+  if (pixels != ctx->output_pixels) {
+    arena_free(&ctx->arena, pixels);
+  }
+}
+
+/**
+ * Decode the Huffman coded bitstream and convert it to RGB
+ * Images are decoded by several threads if the context allows it, by restart segment or speculatively if there are
+ * no restart markers, otherwise the image is decoded one row of MCUs at a time, pipelined across the threads if there
+ * are several. So are regions of images, which skip most of the work of the MCUs outside of them, and progressive
+ * images, whose scans are already entropy decoded
+ * Returns the image, the buffer of the caller if it set one. Pixels are laid out as output_bytes_per_pixel bytes in
+ * rows of output_stride bytes, planar YUV is followed by its U and V planes and coefficient output has a plane per
+ * component (see init_output_rows)
+ */
+static uint8_t *decompress_scanline(JpegCpuContext *ctx) {
+  uint32_t line_count = output_line_count(ctx);
+
+  uint8_t *pixels = ctx->output_pixels;
+  if (pixels == NULL) {
+    pixels = (uint8_t *) arena_alloc(&ctx->arena, output_size(ctx, line_count));
+  }
+  if (pixels == NULL) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    return NULL;
+  }
+
+  if (ctx->region.width == 0 && !ctx->progressive) {
+    OutputRows output;
+    init_output_rows(ctx, pixels, 0, line_count, &output);
+    if (ctx->jpegInfo.restart_interval != 0 && decompress_restart_segments(ctx, &output)) {
+      if (!ctx->jpegInfo.valid) {
+        free_output(ctx, pixels);
+        return NULL;
+      }
+      return pixels;
+    }
+    if (ctx->jpegInfo.restart_interval == 0 && ctx->num_threads > 1 && decompress_speculative(ctx, &output)) {
+      return pixels;
+    }
+  }
+
+  if (decompress_mcu_rows(ctx, pixels) != 0) {
+    free_output(ctx, pixels);
+    return NULL;
+  }
+  return pixels;
+}
+
+/**
+ * Check that the output format is made of packed pixels, which output buffers, regions and the resize stage need
+ * Returns 0 if it is, -1 otherwise
+ */
+static int check_packed_output(JpegCpuContext *ctx) {
+  if (ctx->output_format == JPEG_OUTPUT_YUV420 || is_coefficient_output(ctx->output_format)) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Output buffers, regions and resizing only take packed pixel formats\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check that the region to decode covers part of the image
+ * Returns 0 if it does, -1 otherwise
+ */
+static int check_region(JpegCpuContext *ctx) {
+  if (output_width(ctx) == 0 || output_height(ctx) == 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Region outside of the %ux%u image\n", ctx->jpegInfo.image_width,
+            ctx->jpegInfo.image_height);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check that the buffer of the caller can take a decoded image of width x height pixels
+ * Returns 0 if it can, -1 otherwise
+ */
+static int check_output_buffer(JpegCpuContext *ctx, uint32_t width, uint32_t height) {
+  size_t row_size = (size_t) width * output_bytes_per_pixel(ctx);
+  if (ctx->output_pixels_stride < row_size ||
+      ctx->output_pixels_size < (size_t) ctx->output_pixels_stride * (height - 1) + row_size) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Output buffer too small for a %ux%u image\n", width, height);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Decode the Huffman coded bitstream into a buffer of a single MCU row and pass every row to ctx->row_callback
+ * Memory use depends on the width of the image only. With several threads the rows are reconstructed in a pipeline
+ * (see decompress_pipelined)
+ * Returns 0 on success, -1 if the image is invalid or out of memory
+ */
+static int decompress_streaming(JpegCpuContext *ctx) {
+  uint32_t row_lines = ctx->jpegInfo.max_v_samp_factor * output_block_lines(ctx);
+  uint8_t *pixels = (uint8_t *) arena_alloc(&ctx->arena, output_size(ctx, row_lines));
+  if (pixels == NULL) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+
+  int result = decompress_mcu_rows(ctx, pixels);
+  arena_free(&ctx->arena, pixels);
+  return result;
+}
+
+/**
+ * Rectangle of the full size image kept by the resize stage
+ * Returns 0 on success, -1 if the crop rectangle lies outside of the image
+ */
+static int resize_crop(JpegCpuContext *ctx, double *x, double *y, double *width, double *height) {
+  JpegResize *resize = &ctx->resize;
+  double image_width = ctx->jpegInfo.image_width;
+  double image_height = ctx->jpegInfo.image_height;
+
+  if (resize->center_crop) {
+    // Keep the full width or height, whichever gives the aspect ratio of the output
+    if (image_width * resize->height > image_height * resize->width) {
+      *height = image_height;
+      *width = image_height * resize->width / resize->height;
+    } else {
+      *width = image_width;
+      *height = image_width * resize->height / resize->width;
+    }
+    *x = (image_width - *width) / 2;
+    *y = (image_height - *height) / 2;
+    return 0;
+  }
+
+  if (resize->crop_width == 0) {
+    *x = 0;
+    *y = 0;
+    *width = image_width;
+    *height = image_height;
+    return 0;
+  }
+
+  if (resize->crop_x >= image_width || resize->crop_y >= image_height || resize->crop_height == 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Crop rectangle outside of the %ux%u image\n", ctx->jpegInfo.image_width,
+            ctx->jpegInfo.image_height);
+    return -1;
+  }
+  *x = resize->crop_x;
+  *y = resize->crop_y;
+  *width = fmin(resize->crop_width, image_width - resize->crop_x);
+  *height = fmin(resize->crop_height, image_height - resize->crop_y);
+  return 0;
+}
+
+/**
+ * Decode the image at the smallest DCT scale that still has at least as many pixels as the output in the crop
+ * rectangle, and crop and resize its rows as they are decoded (see cpu-jpeg-resize.c). The rows go to the buffer of
+ * the caller, to the row callback, or else to a buffer of our own
+ * Only the region around the crop is decoded, in place of any region of the caller, and decoding stops after the last
+ * row the resize needs. Like streaming, several threads reconstruct the rows in a pipeline
+ * Returns 0 on success, -1 if the image is invalid or out of memory
+ */
+static int decompress_resized(JpegCpuContext *ctx) {
+  JpegResize *resize = &ctx->resize;
+  double crop_x, crop_y, crop_width, crop_height;
+  if (resize_crop(ctx, &crop_x, &crop_y, &crop_width, &crop_height) != 0) {
+    return -1;
+  }
+
+  uint32_t block_size = ctx->block_size;
+  JpegRegion region = ctx->region;
+  jpeg_cpu_row_callback row_callback = ctx->row_callback;
+  void *row_callback_data = ctx->row_callback_data;
+  uint8_t *image = NULL;
+  JpegCpuResizer resizer;
+  int result = -1;
+
+  ctx->block_size = 1;
+  while (ctx->block_size < 8 &&
+         (crop_width * ctx->block_size / 8 < resize->width || crop_height * ctx->block_size / 8 < resize->height)) {
+    ctx->block_size *= 2;
+  }
+  ctx->dc_only = ctx->block_size == 1;
+
+  // The filter taps stay within a pixel of the crop, past that the image is left out of the decoded region. Its
+  // edges are whole pixels of the scaled image, so they map back to the full size image exactly
+  double scale = ctx->block_size / 8.0;
+  uint32_t factor = 8 / ctx->block_size;
+  double left = fmax(floor(crop_x * scale) - 1, 0);
+  double top = fmax(floor(crop_y * scale) - 1, 0);
+  double right = ceil((crop_x + crop_width) * scale) + 1;
+  double bottom = ceil((crop_y + crop_height) * scale) + 1;
+  ctx->region.x = (uint32_t) left * factor;
+  ctx->region.y = (uint32_t) top * factor;
+  ctx->region.width = (uint32_t)(right - left) * factor;
+  ctx->region.height = (uint32_t)(bottom - top) * factor;
+
+  uint32_t pixel_size = output_bytes_per_pixel(ctx);
+  if (init_resizer(&resizer, resize, pixel_size, output_width(ctx), output_height(ctx), crop_x * scale - left,
+                   crop_y * scale - top, crop_width * scale, crop_height * scale) != 0) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    goto cleanup;
+  }
+
+  if (ctx->progressive && decode_progressive_scans(ctx) != 0) {
+    goto cleanup;
+  }
+
+  uint32_t row_length = resize->width * pixel_size;
+  if (ctx->output_pixels != NULL) {
+    if (check_output_buffer(ctx, resize->width, resize->height) != 0) {
+      goto cleanup;
+    }
+    resizer.pixels = ctx->output_pixels;
+    resizer.stride = ctx->output_pixels_stride;
+  } else {
+    image = (uint8_t *) arena_alloc(&ctx->arena,
+                                    row_callback != NULL ? row_length : (size_t) row_length * resize->height);
+    if (image == NULL) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Out of memory\n");
+      goto cleanup;
+    }
+    resizer.pixels = image;
+    resizer.stride = row_length;
+    resizer.row_callback = row_callback;
+    resizer.row_callback_data = row_callback_data;
+  }
+
+  // The decoder streams its rows to the resize stage, which produces the output rows
+  uint8_t *output_pixels = ctx->output_pixels;
+  ctx->output_pixels = NULL;
+  ctx->row_callback = resize_rows;
+  ctx->row_callback_data = &resizer;
+  ctx->line_limit = resizer_source_rows(&resizer);
+  result = decompress_streaming(ctx);
+  ctx->output_pixels = output_pixels;
+  ctx->row_callback = row_callback;
+  ctx->row_callback_data = row_callback_data;
+  ctx->line_limit = 0;
+
+  if (result == 0 && resizer.next_row != resize->height) {
+    ctx->jpegInfo.valid = 0;
+    result = -1;
+  }
+
+cleanup:
+  arena_free(&ctx->arena, image);
+  free_resizer(&resizer);
+  ctx->block_size = block_size;
+  ctx->region = region;
+  return result;
+}
+
+/**
+ * Decode every level of the pyramid in one pass over the bitstream: each MCU row is entropy decoded once, then its
+ * blocks are transformed at the block size of every level and converted into the buffer of the level
+ * Like streaming, this always decodes on a single thread
+ * Returns 0 on success, -1 if the image is invalid or out of memory
+ */
+static int decompress_pyramid(JpegCpuContext *ctx) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  uint32_t block_size = ctx->block_size;
+  uint32_t blocks_per_mcu = 0;
+  uint32_t largest_block_size = 1;
+  SamplePlanes samples[JPEG_PYRAMID_MAX_LEVELS];
+  short previous_dcs[3] = {0};
+  int result = -1;
+
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    blocks_per_mcu += component->h_samp_factor * component->v_samp_factor;
+  }
+  short *blocks = (short *) arena_alloc(&ctx->arena, (size_t) mcus_per_row * blocks_per_mcu * 64 * sizeof(short));
+  int *last_indices = (int *) arena_alloc(&ctx->arena, (size_t) mcus_per_row * blocks_per_mcu * sizeof(int));
+  memset(samples, 0, sizeof(samples));
+  if (blocks == NULL || last_indices == NULL) {
+    ctx->jpegInfo.valid = 0;
+    fprintf(stderr, "Error: Out of memory\n");
+    goto cleanup;
+  }
+
+  for (uint32_t i = 0; i < ctx->pyramid_levels; i++) {
+    JpegPyramidLevel *level = &ctx->pyramid[i];
+    ctx->block_size = scale_block_size(level->scale_denom);
+    ctx->output_pixels = level->pixels;
+    ctx->output_pixels_stride = level->stride;
+    ctx->output_pixels_size = level->size;
+    if (check_output_buffer(ctx, output_width(ctx), output_height(ctx)) != 0) {
+      goto cleanup;
+    }
+    if (alloc_sample_planes(ctx, &samples[i], 1) != 0) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Out of memory\n");
+      goto cleanup;
+    }
+    if (ctx->block_size > largest_block_size) {
+      largest_block_size = ctx->block_size;
+    }
+  }
+  // The blocks are entropy decoded in as much detail as the largest level needs
+  ctx->dc_only = largest_block_size == 1;
+  ctx->block_size = largest_block_size;
+  if (ctx->progressive && decode_progressive_scans(ctx) != 0) {
+    goto cleanup;
+  }
+
+  for (uint32_t mcu_row = 0; mcu_row < mcu_rows; mcu_row++) {
+    uint32_t row_start = mcu_row * mcus_per_row;
+    if (ctx->progressive) {
+      load_stored_mcus(ctx, row_start, row_start + mcus_per_row, blocks, last_indices);
+    } else if (entropy_decode_mcus(ctx, &ctx->decompressor, row_start, row_start + mcus_per_row, blocks, last_indices,
+                                   previous_dcs) != 0) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid MCU\n");
+      goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < ctx->pyramid_levels; i++) {
+      JpegPyramidLevel *level = &ctx->pyramid[i];
+      OutputRows output;
+      ctx->block_size = scale_block_size(level->scale_denom);
+      ctx->output_pixels = level->pixels;
+      ctx->output_pixels_stride = level->stride;
+      ctx->output_pixels_size = level->size;
+
+      samples[i].first_mcu_row = mcu_row;
+      transform_mcus(ctx, row_start, row_start + mcus_per_row, blocks, last_indices, &samples[i]);
+      init_output_rows(ctx, level->pixels, 0, output_line_count(ctx), &output);
+      convert_mcu_rows(ctx, &samples[i], mcu_row, mcu_row + 1, &output);
+    }
+  }
+  result = 0;
+
+cleanup:
+  for (uint32_t i = 0; i < JPEG_PYRAMID_MAX_LEVELS; i++) {
+    free_sample_planes(ctx, &samples[i]);
+  }
+  arena_free(&ctx->arena, blocks);
+  arena_free(&ctx->arena, last_indices);
+  ctx->block_size = block_size;
+  jpeg_cpu_set_output_buffer(ctx, NULL, 0, 0);
+  return result;
+}
+
+/**
+ * Read JPEG markers
+ * Return 0 when the SOS marker is found
+ * Otherwise return 1
+ *
+ * @param d JpegDecompressor struct that holds all information about the JPEG currently being decoded
+ */
+int read_next_marker(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
+  int marker;
+
+  marker = skip_to_next_marker(d);
+  switch (marker) {
+    case -1:
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Read past EOF\n");
+      break;
+
+    case M_APP_FIRST ... M_APP_LAST:
+      skip_marker(ctx);
+      break;
+
+    case M_DQT:
+      process_DQT(ctx);
+      break;
+
+    case M_DRI:
+      process_DRI(ctx);
+      break;
+
+    case M_SOF0:
+      // case M_SOF5 ... M_SOF7:
+      // case M_SOF9 ... M_SOF11:
+      // case M_SOF13 ... M_SOF15:
+      process_SOFn(ctx);
+      break;
+
+    case M_SOF2:
+      ctx->progressive = 1;
+      process_SOFn(ctx);
+      break;
+
+    case M_DHT:
+      process_DHT(ctx);
+      break;
+
+    case M_SOS:
+      process_SOS(ctx);
+      return 0;
+
+    case M_COM:
+    case M_EXT_FIRST ... M_EXT_LAST:
+    case M_DNL:
+    case M_DHP:
+    case M_EXP:
+      skip_marker(ctx);
+      break;
+
+    default:
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Unhandled marker: FF %X\n", marker);
       break;
   }
 
@@ -1028,44 +2350,45 @@ static int read_next_marker(JpegDecompressor *d) {
 }
 
 #if DEBUG
-static void print_jpeg_decompressor(JpegDecompressor *d) {
+static void print_jpeg_decompressor(JpegCpuContext *ctx) {
+  JpegDecompressor *d = &ctx->decompressor;
   printf("\n********** DQT **********\n");
   for (int i = 0; i < 4; i++) {
-    if (jpegInfo.quant_tables[i].exists) {
+    if (ctx->jpegInfo.quant_tables[i].exists) {
       printf("Table ID: %d", i);
       for (int j = 0; j < 64; j++) {
         if (j % 8 == 0) {
           printf("\n");
         }
-        printf("%d ", jpegInfo.quant_tables[i].table[j]);
+        printf("%d ", ctx->jpegInfo.quant_tables[i].table[j]);
       }
       printf("\n\n");
     }
   }
 
   printf("********** DRI **********\n");
-  printf("Restart Interval: %d\n", jpegInfo.restart_interval);
+  printf("Restart Interval: %d\n", ctx->jpegInfo.restart_interval);
 
   printf("\n********** SOF **********\n");
-  printf("Width: %d\n", jpegInfo.image_width);
-  printf("Height: %d\n", jpegInfo.image_height);
-  printf("Number of color components: %d\n\n", jpegInfo.num_color_components);
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
-    printf("Component ID: %d\n", jpegInfo.color_components[i].component_id);
-    printf("H-samp factor: %d\n", jpegInfo.color_components[i].h_samp_factor);
-    printf("V-samp factor: %d\n", jpegInfo.color_components[i].v_samp_factor);
-    printf("Quantization table ID: %d\n\n", jpegInfo.color_components[i].quant_table_id);
+  printf("Width: %d\n", ctx->jpegInfo.image_width);
+  printf("Height: %d\n", ctx->jpegInfo.image_height);
+  printf("Number of color components: %d\n\n", ctx->jpegInfo.num_color_components);
+  for (int i = 0; i < ctx->jpegInfo.num_color_components; i++) {
+    printf("Component ID: %d\n", ctx->jpegInfo.color_components[i].component_id);
+    printf("H-samp factor: %d\n", ctx->jpegInfo.color_components[i].h_samp_factor);
+    printf("V-samp factor: %d\n", ctx->jpegInfo.color_components[i].v_samp_factor);
+    printf("Quantization table ID: %d\n\n", ctx->jpegInfo.color_components[i].quant_table_id);
   }
 
   printf("\n********** DHT **********\n");
   for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.dc_huffman_tables[i].exists) {
+    if (ctx->jpegInfo.dc_huffman_tables[i].exists) {
       printf("DC Table ID: %d\n", i);
       for (int j = 0; j < 16; j++) {
         printf("%d: ", j + 1);
-        for (int k = jpegInfo.dc_huffman_tables[i].valoffset[j]; k < jpegInfo.dc_huffman_tables[i].valoffset[j + 1];
+        for (int k = ctx->jpegInfo.dc_huffman_tables[i].valoffset[j]; k < ctx->jpegInfo.dc_huffman_tables[i].valoffset[j + 1];
              k++) {
-          printf("%d ", jpegInfo.dc_huffman_tables[i].huffval[k]);
+          printf("%d ", ctx->jpegInfo.dc_huffman_tables[i].huffval[k]);
         }
         printf("\n");
       }
@@ -1073,13 +2396,13 @@ static void print_jpeg_decompressor(JpegDecompressor *d) {
     }
   }
   for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.ac_huffman_tables[i].exists) {
+    if (ctx->jpegInfo.ac_huffman_tables[i].exists) {
       printf("AC Table ID: %d\n", i);
       for (int j = 0; j < 16; j++) {
         printf("%d: ", j + 1);
-        for (int k = jpegInfo.ac_huffman_tables[i].valoffset[j]; k < jpegInfo.ac_huffman_tables[i].valoffset[j + 1];
+        for (int k = ctx->jpegInfo.ac_huffman_tables[i].valoffset[j]; k < ctx->jpegInfo.ac_huffman_tables[i].valoffset[j + 1];
              k++) {
-          printf("%d ", jpegInfo.ac_huffman_tables[i].huffval[k]);
+          printf("%d ", ctx->jpegInfo.ac_huffman_tables[i].huffval[k]);
         }
         printf("\n");
       }
@@ -1088,104 +2411,452 @@ static void print_jpeg_decompressor(JpegDecompressor *d) {
   }
 
   printf("\n********** SOS **********\n");
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
-    printf("Component ID: %d\n", jpegInfo.color_components[i].component_id);
-    printf("DC table ID: %d\n", jpegInfo.color_components[i].dc_huffman_table_id);
-    printf("AC table ID: %d\n\n", jpegInfo.color_components[i].ac_huffman_table_id);
+  for (int i = 0; i < ctx->jpegInfo.num_color_components; i++) {
+    printf("Component ID: %d\n", ctx->jpegInfo.color_components[i].component_id);
+    printf("DC table ID: %d\n", ctx->jpegInfo.color_components[i].dc_huffman_table_id);
+    printf("AC table ID: %d\n\n", ctx->jpegInfo.color_components[i].ac_huffman_table_id);
   }
-  printf("Start of selection: %d\n", jpegInfo.ss);
-  printf("End of selection: %d\n", jpegInfo.se);
-  printf("Successive approximation high: %d\n", jpegInfo.Ah);
-  printf("Successive approximation low: %d\n\n", jpegInfo.Al);
+  printf("Start of selection: %d\n", ctx->jpegInfo.ss);
+  printf("End of selection: %d\n", ctx->jpegInfo.se);
+  printf("Successive approximation high: %d\n", ctx->jpegInfo.Ah);
+  printf("Successive approximation low: %d\n\n", ctx->jpegInfo.Al);
 
   printf("\n********** BMP **********\n");
-  printf("MCU width: %d\n", jpegInfo.mcu_width);
-  printf("MCU height: %d\n", jpegInfo.mcu_height);
-  printf("BMP padding: %d\n", jpegInfo.padding);
+  printf("MCU width: %d\n", ctx->jpegInfo.mcu_width);
+  printf("MCU height: %d\n", ctx->jpegInfo.mcu_height);
+  printf("BMP padding: %d\n", ctx->jpegInfo.padding);
 }
 #endif
 
-static void init_jpeg_info() {
-  jpegInfo.valid = 1;
+static void init_jpeg_info(JpegCpuContext *ctx) {
+  ctx->jpegInfo.valid = 1;
 
   for (int i = 0; i < 4; i++) {
-    jpegInfo.quant_tables[i].exists = 0;
+    ctx->jpegInfo.quant_tables[i].exists = 0;
 
     if (i < 2) {
-      jpegInfo.color_components[i].exists = 0;
-      jpegInfo.dc_huffman_tables[i].exists = 0;
-      jpegInfo.ac_huffman_tables[i].exists = 0;
+      ctx->jpegInfo.color_components[i].exists = 0;
+      ctx->jpegInfo.dc_huffman_tables[i].exists = 0;
+      ctx->jpegInfo.ac_huffman_tables[i].exists = 0;
 
     } else if (i < 3) {
-      jpegInfo.color_components[i].exists = 0;
+      ctx->jpegInfo.color_components[i].exists = 0;
     }
   }
 
-  jpegInfo.restart_interval = 0;
-  jpegInfo.image_height = 0;
-  jpegInfo.image_width = 0;
-  jpegInfo.num_color_components = 0;
-  jpegInfo.ss = 0;
-  jpegInfo.se = 0;
-  jpegInfo.Ah = 0;
-  jpegInfo.Al = 0;
-
-  jpegInfo.mcu_width = 0;
-  jpegInfo.mcu_height = 0;
-  jpegInfo.padding = 0;
+  ctx->jpegInfo.restart_interval = 0;
+  ctx->jpegInfo.image_height = 0;
+  ctx->jpegInfo.image_width = 0;
+  ctx->jpegInfo.num_color_components = 0;
+  ctx->jpegInfo.ss = 0;
+  ctx->jpegInfo.se = 0;
+  ctx->jpegInfo.Ah = 0;
+  ctx->jpegInfo.Al = 0;
+
+  ctx->jpegInfo.mcu_width = 0;
+  ctx->jpegInfo.mcu_height = 0;
+  ctx->jpegInfo.padding = 0;
+  ctx->progressive = 0;
 }
 
 static void init_jpeg_decompressor(JpegDecompressor *d) {
   d->bit_buffer = 0;
+  d->bit_reservoir = 0;
   d->bits_left = 0;
+  d->padding_bits = 0;
+  d->quiet = 0;
+}
+
+/**
+ * One-time initialization of the CPU decoder, selects the SIMD kernels for the machine we are running on
+ */
+void jpeg_cpu_init(void) {
+  init_idct_dispatch();
+  init_color_dispatch();
+  init_destuff_dispatch();
+}
+
+/**
+ * Allocate the state for decoding one JPEG at a time with jpeg_cpu_scale
+ * A context can be reused for any number of files, but must not be shared between threads
+ */
+JpegCpuContext *jpeg_cpu_create_context(void) {
+  JpegCpuContext *ctx = (JpegCpuContext *) calloc(1, sizeof(JpegCpuContext));
+  if (ctx != NULL) {
+    ctx->num_threads = 1;
+    ctx->block_size = 8;
+    ctx->coefficient_count = 64;
+  }
+  return ctx;
+}
+
+/**
+ * Let the context decode a single image with up to num_threads threads (see decompress_restart_segments,
+ * decompress_speculative and decompress_pipelined)
+ */
+void jpeg_cpu_set_threads(JpegCpuContext *ctx, uint32_t num_threads) {
+  ctx->num_threads = num_threads > 0 ? num_threads : 1;
+}
+
+/**
+ * Let the context decode images at 1/scale_denom of their size, straight from the DCT coefficients
+ * Supported scales are 1, 2, 4 and 8, any other value is rounded down to one of them
+ */
+void jpeg_cpu_set_scale(JpegCpuContext *ctx, uint32_t scale_denom) {
+  ctx->block_size = scale_block_size(scale_denom);
+}
+
+/**
+ * Let callback set up the output of every image jpeg_cpu_scale decodes once its markers are read, NULL to stop
+ */
+void jpeg_cpu_set_header_callback(JpegCpuContext *ctx, jpeg_cpu_header_callback callback, void *user_data) {
+  ctx->header_callback = callback;
+  ctx->header_callback_data = user_data;
+}
+
+/**
+ * Make jpeg_cpu_scale stream the decoded image to callback instead of building it in memory, NULL to stop streaming
+ * The callback replaces any output buffer or pyramid
+ */
+void jpeg_cpu_set_row_callback(JpegCpuContext *ctx, jpeg_cpu_row_callback callback, void *user_data) {
+  ctx->row_callback = callback;
+  ctx->row_callback_data = user_data;
+  if (callback != NULL) {
+    jpeg_cpu_set_output_buffer(ctx, NULL, 0, 0);
+    ctx->pyramid_levels = 0;
+  }
+}
+
+/**
+ * Choose what the context decodes images to, RGB unless set (see JpegOutputFormat)
+ */
+void jpeg_cpu_set_output_format(JpegCpuContext *ctx, JpegOutputFormat format) {
+  ctx->output_format = format;
+}
+
+/**
+ * Keep the first count coefficients of every block in zigzag order with coefficient output, 64 unless set
+ * Counts outside 1 to 64 are clamped, with a single coefficient the AC coefficients are only skipped over
+ */
+void jpeg_cpu_set_coefficient_count(JpegCpuContext *ctx, uint32_t count) {
+  ctx->coefficient_count = count < 1 ? 1 : count > 64 ? 64 : count;
+}
+
+/**
+ * Make jpeg_cpu_scale decode the image into pixels, size bytes in rows stride bytes apart, instead of a buffer of its
+ * own. The pixel format is the output format (RGB, BGR, RGBA or luma for gray), only pixels within the image are
+ * written (see jpeg_cpu_output_geometry). The buffer replaces any row callback or pyramid, NULL goes back to decoder
+ * buffers
+ */
+void jpeg_cpu_set_output_buffer(JpegCpuContext *ctx, uint8_t *pixels, uint32_t stride, size_t size) {
+  ctx->output_pixels = pixels;
+  ctx->output_pixels_stride = stride;
+  ctx->output_pixels_size = size;
+  if (pixels != NULL) {
+    ctx->row_callback = NULL;
+    ctx->row_callback_data = NULL;
+    ctx->pyramid_levels = 0;
+  }
+}
+
+/**
+ * Make jpeg_cpu_scale crop and resize every image to resize->width x resize->height as it decodes it, with the DCT
+ * scale chosen for each image in place of the one set with jpeg_cpu_set_scale. Only packed pixel formats can be
+ * resized. NULL or a width of 0 decodes images as they are
+ */
+void jpeg_cpu_set_resize(JpegCpuContext *ctx, const JpegResize *resize) {
+  memset(&ctx->resize, 0, sizeof(JpegResize));
+  if (resize != NULL && resize->width != 0 && resize->height != 0) {
+    ctx->resize = *resize;
+  }
+}
+
+/**
+ * Make jpeg_cpu_scale decode only the rectangle region of every image, given in pixels of the full size image and
+ * scaled down with the image, as if the image had been cropped. Rows of MCUs above the region and MCUs to either side
+ * of it are only entropy decoded, and decoding stops after its last row. Only packed pixel formats can be decoded
+ * by region, and resizing picks a region of its own. NULL or a width of 0 decodes whole images
+ */
+void jpeg_cpu_set_region(JpegCpuContext *ctx, const JpegRegion *region) {
+  memset(&ctx->region, 0, sizeof(JpegRegion));
+  if (region != NULL && region->width != 0 && region->height != 0) {
+    ctx->region = *region;
+  }
+}
+
+/**
+ * Make jpeg_cpu_scale decode every image to count (at most JPEG_PYRAMID_MAX_LEVELS) sizes at once into the buffers of
+ * levels, in place of a single image: the bitstream is entropy decoded once and every block is transformed at the
+ * DCT scale of each level. Levels take packed pixel formats only (see jpeg_cpu_pyramid_geometry for their size), and
+ * replace any output buffer or row callback. Regions and resizing do not apply to them. NULL or 0 levels stops
+ */
+void jpeg_cpu_set_pyramid(JpegCpuContext *ctx, const JpegPyramidLevel *levels, uint32_t count) {
+  ctx->pyramid_levels = levels != NULL ? (count < JPEG_PYRAMID_MAX_LEVELS ? count : JPEG_PYRAMID_MAX_LEVELS) : 0;
+  for (uint32_t i = 0; i < ctx->pyramid_levels; i++) {
+    ctx->pyramid[i] = levels[i];
+  }
+  if (ctx->pyramid_levels != 0) {
+    jpeg_cpu_set_output_buffer(ctx, NULL, 0, 0);
+    jpeg_cpu_set_row_callback(ctx, NULL, NULL);
+  }
+}
+
+/**
+ * Let the context take the Huffman and quantization tables of a file from cache when an earlier file had the same
+ * ones, and add the tables it builds. The cache may be shared by contexts on different threads, NULL stops caching
+ */
+void jpeg_cpu_set_table_cache(JpegCpuContext *ctx, JpegCpuTableCache *cache) {
+  ctx->table_cache = cache;
+}
+
+/**
+ * Let the context back its scratch memory with transparent huge pages, which saves page faults and TLB misses on
+ * large images. Takes effect the next time the arena grows
+ */
+void jpeg_cpu_set_huge_pages(JpegCpuContext *ctx, uint32_t enable) {
+  ctx->arena.huge_pages = enable != 0;
+}
+
+/**
+ * Whether the marker segment at the read position lies within the data
+ * Segments normally follow each other directly, anything else is left for read_next_marker to deal with
+ */
+static int marker_segment_in_data(JpegDecompressor *d) {
+  const uint8_t *ptr = (const uint8_t *) d->ptr;
+  const uint8_t *end = (const uint8_t *) d->data + d->length;
+  if (end - ptr < 4) {
+    return 0;
+  }
+  if (ptr[0] != 0xFF) {
+    return 1;
+  }
+  return end - ptr >= 2 + ((ptr[2] << 8) | ptr[3]);
+}
+
+/**
+ * Report what the markers read so far say about the image
+ */
+static void fill_probe_info(JpegCpuContext *ctx, JpegProbeInfo *info) {
+  memset(info, 0, sizeof(JpegProbeInfo));
+  info->valid = ctx->jpegInfo.valid;
+  info->progressive = ctx->progressive;
+  info->image_width = ctx->jpegInfo.image_width;
+  info->image_height = ctx->jpegInfo.image_height;
+  info->num_color_components = ctx->jpegInfo.num_color_components;
+  for (uint32_t i = 0; i < ctx->jpegInfo.num_color_components && i < 3; i++) {
+    info->h_samp_factors[i] = ctx->jpegInfo.color_components[i].h_samp_factor;
+    info->v_samp_factors[i] = ctx->jpegInfo.color_components[i].v_samp_factor;
+  }
+  info->restart_interval = ctx->jpegInfo.restart_interval;
+  info->entropy_offset = ctx->decompressor.ptr - ctx->decompressor.data;
+}
+
+/**
+ * Parse the markers of a file up to the first SOS and report what they say, the entropy coded data is not touched
+ *
+ * @param ctx The decoder context, from jpeg_cpu_create_context
+ * @param file_length The number of bytes of the file in buffer, which may be just its start
+ * @param buffer The buffer containing the file data
+ * @param info Filled in with what was found, valid is 0 if the markers are broken
+ * @return JPEG_PROBE_NEED_MORE if the data ends before the SOS header, 0 otherwise
+ */
+int jpeg_cpu_probe(JpegCpuContext *ctx, uint64_t file_length, char *buffer, JpegProbeInfo *info) {
+  JpegDecompressor *d = &ctx->decompressor;
+  d->length = file_length;
+  ctx->jpegInfo.length = d->length;
+  d->data = buffer;
+  d->ptr = d->data;
+
+  init_jpeg_info(ctx);
+  init_jpeg_decompressor(d);
+  memset(info, 0, sizeof(JpegProbeInfo));
+
+  check_start_of_image(ctx);
+
+  int result = 1;
+  while (ctx->jpegInfo.valid && result) {
+    if (!marker_segment_in_data(d)) {
+      return JPEG_PROBE_NEED_MORE;
+    }
+    result = read_next_marker(ctx);
+  }
+
+  fill_probe_info(ctx, info);
+  return 0;
+}
+
+/**
+ * Size of the image described by info once the context decodes it, and the bytes per pixel of its rows, from which
+ * callers size the buffer given to jpeg_cpu_set_output_buffer
+ */
+void jpeg_cpu_output_geometry(JpegCpuContext *ctx, const JpegProbeInfo *info, uint32_t *width, uint32_t *height,
+                              uint32_t *pixel_size) {
+  if (ctx->resize.width != 0) {
+    *width = ctx->resize.width;
+    *height = ctx->resize.height;
+  } else {
+    uint32_t left, top, right, bottom;
+    scaled_region(&ctx->region, ctx->block_size, info->image_width, info->image_height, &left, &top, &right, &bottom);
+    *width = right - left;
+    *height = bottom - top;
+  }
+  *pixel_size = format_pixel_size(ctx->output_format, info->num_color_components);
+}
+
+/**
+ * Size of the pyramid level at 1/scale_denom of the image described by info, and the bytes per pixel of its rows
+ */
+void jpeg_cpu_pyramid_geometry(JpegCpuContext *ctx, const JpegProbeInfo *info, uint32_t scale_denom, uint32_t *width,
+                               uint32_t *height, uint32_t *pixel_size) {
+  uint32_t block_size = scale_block_size(scale_denom);
+  *width = (info->image_width * block_size + 7) / 8;
+  *height = (info->image_height * block_size + 7) / 8;
+  *pixel_size = format_pixel_size(ctx->output_format, info->num_color_components);
+}
+
+void jpeg_cpu_destroy_context(JpegCpuContext *ctx) {
+  free_coefficient_store(&ctx->coefficient_store);
+  free_entropy_segment(&ctx->entropy_segment);
+  free_arena(&ctx->arena);
+  free(ctx);
+}
+
+/**
+ * Scratch memory the decode of the image is expected to take from the arena, from its header: sample planes for every
+ * MCU row if the image may be decoded by restart segment, for one MCU row otherwise, and a buffer for the image when
+ * it is not decoded into the buffer of the caller or streamed. The arena also grows to what earlier images took
+ */
+static size_t arena_estimate(JpegCpuContext *ctx) {
+  uint32_t mcus_per_row = ctx->jpegInfo.mcu_width_real / ctx->jpegInfo.max_h_samp_factor;
+  uint32_t mcu_rows = ctx->jpegInfo.mcu_height_real / ctx->jpegInfo.max_v_samp_factor;
+  uint32_t block_width = is_coefficient_output(ctx->output_format) ? ctx->coefficient_count : ctx->block_size;
+  uint32_t block_height = is_coefficient_output(ctx->output_format) ? 1 : ctx->block_size;
+  size_t row_samples = 0;
+  for (uint32_t color_index = 0; color_index < ctx->jpegInfo.num_color_components; color_index++) {
+    ColorComponentInfo *component = &ctx->jpegInfo.color_components[color_index];
+    row_samples += (size_t) mcus_per_row * component->h_samp_factor * block_width * component->v_samp_factor *
+                   block_height;
+  }
+
+  int whole_image = ctx->num_threads > 1 && ctx->jpegInfo.restart_interval != 0 && ctx->region.width == 0 &&
+                    !ctx->progressive && ctx->resize.width == 0 && ctx->pyramid_levels == 0;
+  size_t size = row_samples * sizeof(short) * (whole_image ? mcu_rows : 1);
+  if (ctx->output_pixels == NULL && ctx->row_callback == NULL && ctx->resize.width == 0 && ctx->pyramid_levels == 0) {
+    size += output_size(ctx, output_line_count(ctx));
+  }
+  return size;
 }
 
 /**
  * Entry point for decoding JPEG using CPU
  *
+ * @param ctx The decoder context, from jpeg_cpu_create_context
  * @param file_length The total length of a file in bytes
  * @param filename The filename of the input file
  * @param buffer The buffer containing all file data
  */
-void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer) {
-  JpegDecompressor decompressor;
-  decompressor.length = file_length;
-  jpegInfo.length = decompressor.length;
+void jpeg_cpu_scale(JpegCpuContext *ctx, uint64_t file_length, char *filename, char *buffer) {
+  JpegDecompressor *decompressor = &ctx->decompressor;
+  decompressor->length = file_length;
+  ctx->jpegInfo.length = decompressor->length;
 
   int result = 1;
 
-  decompressor.data = buffer;
-  decompressor.ptr = decompressor.data;
+  decompressor->data = buffer;
+  decompressor->ptr = decompressor->data;
 
-  init_jpeg_info();
-  init_jpeg_decompressor(&decompressor);
+  init_jpeg_info(ctx);
+  init_jpeg_decompressor(decompressor);
 
   // Check whether file starts with SOI
-  check_start_of_image(&decompressor);
+  check_start_of_image(ctx);
 
   // Continuously read all markers until we reach Huffman coded bitstream
-  while (jpegInfo.valid && result) {
-    result = read_next_marker(&decompressor);
+  while (ctx->jpegInfo.valid && result) {
+    result = read_next_marker(ctx);
   }
 
-  if (!jpegInfo.valid) {
+  if (!ctx->jpegInfo.valid) {
     return;
   }
 
+  if (ctx->header_callback != NULL) {
+    JpegProbeInfo info;
+    fill_probe_info(ctx, &info);
+    ctx->header_callback(ctx->header_callback_data, ctx, &info);
+  }
+
 #if DEBUG
-  print_jpeg_decompressor(&decompressor);
+  print_jpeg_decompressor(ctx);
 #endif
 
+  // Scaling to 1/8 needs the DC coefficients alone, and so does coefficient output truncated to one coefficient
+  if (is_coefficient_output(ctx->output_format)) {
+    ctx->dc_only = ctx->coefficient_count == 1;
+  } else {
+    ctx->dc_only = ctx->block_size == 1;
+  }
+
+  if ((ctx->output_pixels != NULL || ctx->resize.width != 0 || ctx->region.width != 0 || ctx->pyramid_levels != 0) &&
+      check_packed_output(ctx) != 0) {
+    return;
+  }
+
+  // Progressive images destuff each of their scans as they decode them
+  if (!ctx->progressive && load_entropy_segment(ctx) == NULL) {
+    return;
+  }
+
+  // Nothing of the last image is left in the arena. Should it not grow, buffers are allocated one by one
+  arena_reset(&ctx->arena, arena_estimate(ctx));
+
+  if (ctx->pyramid_levels != 0) {
+    if (ctx->resize.width != 0 || ctx->region.width != 0) {
+      ctx->jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Pyramids are not resized or decoded by region\n");
+      return;
+    }
+    if (decompress_pyramid(ctx) != 0 || !ctx->jpegInfo.valid) {
+      fprintf(stderr, "Error: Invalid JPEG\n");
+    }
+    return;
+  }
+
+  if (ctx->resize.width != 0) {
+    if (decompress_resized(ctx) != 0 || !ctx->jpegInfo.valid) {
+      fprintf(stderr, "Error: Invalid JPEG\n");
+    }
+    return;
+  }
+
+  if (ctx->region.width != 0 && check_region(ctx) != 0) {
+    return;
+  }
+  if (ctx->output_pixels != NULL && check_output_buffer(ctx, output_width(ctx), output_height(ctx)) != 0) {
+    return;
+  }
+  if (ctx->progressive && decode_progressive_scans(ctx) != 0) {
+    fprintf(stderr, "Error: Invalid JPEG\n");
+    return;
+  }
+
   // Process Huffman coded bitstream, perform inverse DCT, and convert YCbCr to RGB
-  short *mcus = decompress_scanline(&decompressor);
-  if (mcus == NULL || !jpegInfo.valid) {
+  if (ctx->row_callback != NULL) {
+    if (decompress_streaming(ctx) != 0 || !ctx->jpegInfo.valid) {
+      fprintf(stderr, "Error: Invalid JPEG\n");
+    }
+    return;
+  }
+
+  uint8_t *pixels = decompress_scanline(ctx);
+  if (pixels == NULL || !ctx->jpegInfo.valid) {
     fprintf(stderr, "Error: Invalid JPEG\n");
     return;
   }
 
   // Now write the decoded data out as BMP
-  //write_bmp_cpu(filename, jpegInfo.image_width, jpegInfo.image_height, jpegInfo.padding, jpegInfo.mcu_width_real, mcus);
-  free(mcus);
+  //write_bmp_cpu(filename, output_width(ctx), output_height(ctx), output_width(ctx) % 4, output_stride(ctx), output_bytes_per_pixel(ctx), pixels);
+  free_output(ctx, pixels);
 
   return;
 }
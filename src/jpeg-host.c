@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,7 +31,18 @@
 
 #define TIME_NOW(_t) (clock_gettime(CLOCK_MONOTONIC, (_t)))
 
-const char options[] = "cdmn:k:r:s:Mw:f";
+const char options[] = "cdj:mn:k:p:r:s:Mw:f";
+static const struct option long_options[] = {
+    {"probe", no_argument, NULL, 'P'},
+    {"format", required_argument, NULL, 'O'},
+    {"coefficients", required_argument, NULL, 'K'},
+    {"resize", required_argument, NULL, 'Z'},
+    {"crop", required_argument, NULL, 'X'},
+    {"filter", required_argument, NULL, 'L'},
+    {"pyramid", required_argument, NULL, 'Y'},
+    {"huge-pages", no_argument, NULL, 'B'},
+    {NULL, 0, NULL, 0},
+};
 static uint32_t rank_count, dpu_count;
 static uint32_t dpus_per_rank;
 static char **input_files = NULL;
@@ -58,6 +70,8 @@ void scale_rank(struct dpu_set_t dpus, struct dpu_set_t dpu, uint32_t dpu_id, dp
   dpu_inputs.file_length = dpu_settings->file_length;
   dpu_inputs.scale_width = dpu_settings->scale_width;
   dpu_inputs.horizontal_flip = dpu_settings->horizontal_flip;
+  dpu_inputs.output_format = dpu_settings->output_format;
+  dpu_inputs.coefficient_count = dpu_settings->coefficient_count;
   int longest_length = 0;
 
   DPU_FOREACH(dpus, dpu, dpu_id) {
@@ -82,6 +96,19 @@ void scale_rank(struct dpu_set_t dpus, struct dpu_set_t dpu, uint32_t dpu_id, dp
   DPU_ASSERT(dpu_push_xfer(dpus, DPU_XFER_TO_DPU, "file_buffer", 0, ALIGN(longest_length, 8), DPU_XFER_DEFAULT));
 #endif
 }
+// Bytes of MCU_buffer holding the result of a DPU: the packed coefficients, the YUV planes, or a short per pixel and
+// component for every 8 pixel high row of blocks
+static uint32_t result_length(dpu_output_t *dpu_output) {
+  if (dpu_output->coefficient_bytes != 0) {
+    return dpu_output->coefficient_bytes;
+  }
+  if (dpu_output->plane_bytes != 0) {
+    return dpu_output->plane_bytes;
+  }
+  return sizeof(short) * ALIGN(dpu_output->image_height, 8) * (dpu_output->mcu_width_real * 8) *
+         dpu_output->num_color_components;
+}
+
 int read_results_dpu_rank(struct dpu_set_t dpus, dpu_output_t *dpu_outputs, short **MCU_buffer) {
 
   struct dpu_set_t dpu;
@@ -93,25 +120,22 @@ int read_results_dpu_rank(struct dpu_set_t dpus, dpu_output_t *dpu_outputs, shor
     DPU_ASSERT(dpu_push_xfer(dpus, DPU_XFER_FROM_DPU, "output", 0, sizeof(dpu_output_t), DPU_XFER_DEFAULT));
   }
 
-  int largest_pixel_count = 0;
+  uint32_t longest_result = 0;
   DPU_FOREACH(dpus, dpu, dpu_id) {
     DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) MCU_buffer[dpu_id]));
-    int pixel_count = ALIGN(dpu_outputs[dpu_id].image_height, 8) * ALIGN(dpu_outputs[dpu_id].image_width, 8);
-    if (pixel_count > largest_pixel_count) {
-      largest_pixel_count = pixel_count;
+    uint32_t length = result_length(&dpu_outputs[dpu_id]);
+    if (length > longest_result) {
+      longest_result = length;
     }
   }
-  DPU_ASSERT(dpu_push_xfer(dpus, DPU_XFER_FROM_DPU, "MCU_buffer", 0, sizeof(short) * largest_pixel_count * 3,
-                           DPU_XFER_DEFAULT));
+  DPU_ASSERT(dpu_push_xfer(dpus, DPU_XFER_FROM_DPU, "MCU_buffer", 0, longest_result, DPU_XFER_DEFAULT));
 
 #endif // BULK_TRANSFER
 
 #ifndef BULK_TRANSFER
   DPU_FOREACH(dpus, dpu, dpu_id) {
     DPU_ASSERT(dpu_copy_from(dpu, "output", 0, &dpu_outputs[dpu_id], sizeof(dpu_output_t)));
-    DPU_ASSERT(dpu_copy_from(dpu, "MCU_buffer", 0, MCU_buffer[dpu_id],
-                             sizeof(short) * ALIGN(dpu_outputs[dpu_id].image_height, 8) *
-                                 ALIGN(dpu_outputs[dpu_id].image_width, 8) * 3));
+    DPU_ASSERT(dpu_copy_from(dpu, "MCU_buffer", 0, MCU_buffer[dpu_id], result_length(&dpu_outputs[dpu_id])));
   }
 #endif // BULK_TRANSFER
 
@@ -249,6 +273,8 @@ static int dpu_main(struct jpeg_options *opts, host_results *results) {
     dpu_settings[dpu_id].filename = filename;
     dpu_settings[dpu_id].scale_width = opts->scale_width;
     dpu_settings[dpu_id].horizontal_flip = opts->horizontal_flip;
+    dpu_settings[dpu_id].output_format = opts->output_format;
+    dpu_settings[dpu_id].coefficient_count = opts->coefficient_count;
 
     // read the file into the descriptor
     if (read_input_host(filename, file_length, dpu_settings[dpu_id].buffer) < 0) {
@@ -274,7 +300,8 @@ static int dpu_main(struct jpeg_options *opts, host_results *results) {
 
   /* for (dpu_id = 0; dpu_id < dpu_count; dpu_id++) {
    write_bmp_dpu(dpu_settings[dpu_id].filename, dpu_outputs[dpu_id].image_width, dpu_outputs[dpu_id].image_height,
-                 dpu_outputs[dpu_id].padding, dpu_outputs[dpu_id].mcu_width_real, MCU_buffer[dpu_id]);
+                 dpu_outputs[dpu_id].padding, dpu_outputs[dpu_id].mcu_width_real,
+                 dpu_outputs[dpu_id].num_color_components, MCU_buffer[dpu_id]);
 
    dpu_output_t this_dpu_output = dpu_outputs[dpu_id];
  }
@@ -290,15 +317,203 @@ static int dpu_main(struct jpeg_options *opts, host_results *results) {
   return status;
 }
 
-static int cpu_main(struct jpeg_options *opts, host_results *results) {
-  struct timespec start, end;
+/**
+ * Range of input_files owned by one CPU worker. The owner takes files from the front, idle workers steal the back
+ * half of the range
+ */
+typedef struct cpu_work_queue {
+  pthread_mutex_t lock;
+  uint32_t next; // next file index to decode
+  uint32_t end;  // one past the last file index of this queue
+} cpu_work_queue;
+
+typedef struct cpu_worker {
+  pthread_t thread;
+  uint32_t id;
+  uint32_t worker_count;
+  uint32_t image_threads;
+  uint32_t scale_denom;           // decode at 1/scale_denom of the full size
+  uint32_t probe;                 // only report the markers of each file
+  uint32_t huge_pages;            // back the scratch memory of the decoder with transparent huge pages
+  uint32_t output_format;         // JpegOutputFormat of the decoded images
+  uint32_t coefficient_count;     // coefficients per block kept by coefficient output
+  JpegResize resize;              // crop and resize of the decoded images
+  JpegRegion region;              // part of the images to decode when they are not resized
+  JpegPyramidLevel pyramid[JPEG_PYRAMID_MAX_LEVELS]; // level buffers reused for every file, size is what is allocated
+  uint32_t pyramid_levels;
+  JpegCpuTableCache *table_cache; // decoded tables shared by all workers
+  uint8_t *pixels;                // image buffer reused for every file decoded to packed pixels
+  size_t pixels_size;
+  struct cpu_worker *workers;
+  cpu_work_queue queue;
+  uint64_t data_processed;
+} cpu_worker;
+
+static int cpu_take_file(cpu_work_queue *queue, uint32_t *file_index) {
+  int found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->next < queue->end) {
+    *file_index = queue->next++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return found;
+}
+
+/**
+ * Move the back half of another worker's remaining files into our own (empty) queue
+ * Returns 0 when every other queue is empty
+ */
+static int cpu_steal_files(cpu_worker *worker) {
+  for (uint32_t i = 1; i < worker->worker_count; i++) {
+    cpu_worker *victim = &worker->workers[(worker->id + i) % worker->worker_count];
+    uint32_t start = 0, end = 0;
+
+    pthread_mutex_lock(&victim->queue.lock);
+    uint32_t remaining = victim->queue.end - victim->queue.next;
+    if (remaining > 0) {
+      end = victim->queue.end;
+      start = end - (remaining + 1) / 2;
+      victim->queue.end = start;
+    }
+    pthread_mutex_unlock(&victim->queue.lock);
+
+    if (start != end) {
+      pthread_mutex_lock(&worker->queue.lock);
+      worker->queue.next = start;
+      worker->queue.end = end;
+      pthread_mutex_unlock(&worker->queue.lock);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Print what the markers of a file say about it, reading only the start of the file when the markers fit in it
+ */
+static void cpu_probe_file(cpu_worker *worker, JpegCpuContext *ctx, char *filename, uint64_t file_length,
+                           char *buffer) {
+  JpegProbeInfo info;
+  uint64_t read_length = file_length < PROBE_READ_LENGTH ? file_length : PROBE_READ_LENGTH;
+
+  if (read_input_host(filename, read_length, buffer) < 0) {
+    dbg_printf("Skipping invalid file %s\n", filename);
+    return;
+  }
+  int result = jpeg_cpu_probe(ctx, read_length, buffer, &info);
+  if (result == JPEG_PROBE_NEED_MORE && read_length < file_length) {
+    read_length = file_length;
+    if (read_input_host(filename, read_length, buffer) < 0) {
+      dbg_printf("Skipping invalid file %s\n", filename);
+      return;
+    }
+    result = jpeg_cpu_probe(ctx, read_length, buffer, &info);
+  }
+  worker->data_processed += read_length;
+
+  if (result == JPEG_PROBE_NEED_MORE || !info.valid) {
+    printf("%s: invalid\n", filename);
+    return;
+  }
+
+  char sampling[32] = "";
+  for (uint32_t i = 0; i < info.num_color_components && i < 3; i++) {
+    size_t used = strlen(sampling);
+    snprintf(sampling + used, sizeof(sampling) - used, "%s%ux%u", i > 0 ? "," : "", info.h_samp_factors[i],
+             info.v_samp_factors[i]);
+  }
+  // One printf per file, so lines of different workers do not mix
+  printf("%s: %ux%u components=%u sampling=%s restart=%u %s entropy_offset=%lu\n", filename, info.image_width,
+         info.image_height, info.num_color_components, sampling, info.restart_interval,
+         info.progressive ? "progressive" : "baseline", info.entropy_offset);
+}
+
+/**
+ * Header callback of the worker's context: let the context decode the file straight into the worker's image buffer,
+ * grown when the file needs more, so that images are not allocated file by file. Formats other than packed pixels are
+ * decoded into a buffer of the decoder
+ */
+static void cpu_prepare_output(void *user_data, JpegCpuContext *ctx, const JpegProbeInfo *info) {
+  cpu_worker *worker = (cpu_worker *) user_data;
+  jpeg_cpu_set_output_buffer(ctx, NULL, 0, 0);
+  jpeg_cpu_set_pyramid(ctx, NULL, 0);
+  if (!is_rgb_output(worker->output_format) && worker->output_format != JPEG_OUTPUT_LUMA) {
+    return;
+  }
+
+  if (worker->pyramid_levels != 0) {
+    JpegPyramidLevel levels[JPEG_PYRAMID_MAX_LEVELS];
+    for (uint32_t i = 0; i < worker->pyramid_levels; i++) {
+      JpegPyramidLevel *level = &worker->pyramid[i];
+      uint32_t width, height, pixel_size;
+      jpeg_cpu_pyramid_geometry(ctx, info, level->scale_denom, &width, &height, &pixel_size);
+      size_t size = (size_t) width * pixel_size * height;
+      if (size > level->size) {
+        uint8_t *pixels = realloc(level->pixels, size);
+        if (pixels == NULL) {
+          return;
+        }
+        level->pixels = pixels;
+        level->size = size;
+      }
+      levels[i] = *level;
+      levels[i].stride = width * pixel_size;
+    }
+    jpeg_cpu_set_pyramid(ctx, levels, worker->pyramid_levels);
+    return;
+  }
+
+  uint32_t width, height, pixel_size;
+  jpeg_cpu_output_geometry(ctx, info, &width, &height, &pixel_size);
+  uint32_t stride = width * pixel_size;
+  size_t size = (size_t) stride * height;
+  if (size > worker->pixels_size) {
+    uint8_t *pixels = realloc(worker->pixels, size);
+    if (pixels == NULL) {
+      return;
+    }
+    worker->pixels = pixels;
+    worker->pixels_size = size;
+  }
+  jpeg_cpu_set_output_buffer(ctx, worker->pixels, stride, worker->pixels_size);
+}
+
+static void *cpu_worker_main(void *arg) {
+  cpu_worker *worker = (cpu_worker *) arg;
+  JpegCpuContext *ctx = jpeg_cpu_create_context();
   char *buffer = malloc(MAX_INPUT_LENGTH);
-  uint32_t file_index = 0;
+  struct timespec start, end;
+  uint32_t file_index;
 
-  dbg_printf("Input file count=%u\n", opts->input_file_count);
+  if (ctx == NULL || buffer == NULL) {
+    fprintf(stderr, "Error: could not allocate CPU worker %u\n", worker->id);
+    jpeg_cpu_destroy_context(ctx);
+    free(buffer);
+    return NULL;
+  }
+  jpeg_cpu_set_threads(ctx, worker->image_threads);
+  jpeg_cpu_set_scale(ctx, worker->scale_denom);
+  jpeg_cpu_set_table_cache(ctx, worker->table_cache);
+  jpeg_cpu_set_huge_pages(ctx, worker->huge_pages);
+  jpeg_cpu_set_output_format(ctx, worker->output_format);
+  jpeg_cpu_set_coefficient_count(ctx, worker->coefficient_count);
+  jpeg_cpu_set_resize(ctx, &worker->resize);
+  jpeg_cpu_set_region(ctx, &worker->region);
+  jpeg_cpu_set_header_callback(ctx, cpu_prepare_output, worker);
+
+  // as long as there are still files to process, in our own queue or in someone else's
+  for (;;) {
+    if (!cpu_take_file(&worker->queue, &file_index)) {
+      if (cpu_steal_files(worker)) {
+        continue;
+      }
+      break;
+    }
 
-  // as long as there are still files to process
-  for (; file_index < opts->input_file_count; file_index++) {
     struct stat st;
     char *filename = input_files[file_index];
 
@@ -311,22 +526,106 @@ static int cpu_main(struct jpeg_options *opts, host_results *results) {
       continue;
     }
 
+    if (worker->probe) {
+      cpu_probe_file(worker, ctx, filename, file_length, buffer);
+      continue;
+    }
+
     // read the file into the descriptor
     if (read_input_host(filename, file_length, buffer) < 0) {
-      dbg_printf("Skipping invalid file %s\n", input_files[file_index]);
-      break;
+      dbg_printf("Skipping invalid file %s\n", filename);
+      continue;
     }
 
-    total_data_processed += file_length;
+    worker->data_processed += file_length;
 
-    jpeg_cpu_scale(file_length, filename, buffer);
+    jpeg_cpu_scale(ctx, file_length, filename, buffer);
     TIME_NOW(&end);
     float run_time = TIME_DIFFERENCE(start, end);
 
     printf("Total runtime: %fs\n\n", run_time);
   }
 
+  jpeg_cpu_destroy_context(ctx);
   free(buffer);
+  free(worker->pixels);
+  for (uint32_t i = 0; i < worker->pyramid_levels; i++) {
+    free(worker->pyramid[i].pixels);
+  }
+  return NULL;
+}
+
+static int cpu_main(struct jpeg_options *opts, host_results *results) {
+  uint32_t worker_count = opts->num_threads;
+  if (worker_count == 0) {
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (worker_count > opts->input_file_count) {
+    worker_count = opts->input_file_count;
+  }
+
+  dbg_printf("Input file count=%u\n", opts->input_file_count);
+  dbg_printf("CPU worker count=%u\n", worker_count);
+
+  jpeg_cpu_init();
+  // Files of a batch mostly share their Huffman and quantization tables, decoding still works if this fails
+  JpegCpuTableCache *table_cache = jpeg_cpu_create_table_cache();
+
+  // Split the input files evenly, stealing takes care of any imbalance
+  cpu_worker *workers = calloc(worker_count, sizeof(cpu_worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Error: could not allocate %u CPU workers\n", worker_count);
+    jpeg_cpu_destroy_table_cache(table_cache);
+    return PROG_FAULT;
+  }
+  for (uint32_t i = 0; i < worker_count; i++) {
+    workers[i].id = i;
+    workers[i].worker_count = worker_count;
+    workers[i].image_threads = opts->image_threads;
+    // The largest reduction that still gives at least the requested size
+    workers[i].scale_denom = opts->scale > 0 ? 100 / opts->scale : 1;
+    workers[i].probe = (opts->flags & (1 << OPTION_FLAG_PROBE)) != 0;
+    workers[i].huge_pages = (opts->flags & (1 << OPTION_FLAG_HUGE_PAGES)) != 0;
+    workers[i].table_cache = table_cache;
+    workers[i].output_format = opts->output_format;
+    workers[i].coefficient_count = opts->coefficient_count;
+    workers[i].resize = opts->resize;
+    workers[i].region = opts->region;
+    workers[i].pyramid_levels = opts->pyramid_levels;
+    for (uint32_t level = 0; level < opts->pyramid_levels; level++) {
+      workers[i].pyramid[level].scale_denom = opts->pyramid_denoms[level];
+    }
+    workers[i].workers = workers;
+    workers[i].queue.next = (uint64_t) opts->input_file_count * i / worker_count;
+    workers[i].queue.end = (uint64_t) opts->input_file_count * (i + 1) / worker_count;
+    pthread_mutex_init(&workers[i].queue.lock, NULL);
+  }
+
+  if (worker_count == 1) {
+    cpu_worker_main(&workers[0]);
+  } else {
+    uint32_t started = 0;
+    while (started < worker_count &&
+           pthread_create(&workers[started].thread, NULL, cpu_worker_main, &workers[started]) == 0) {
+      started++;
+    }
+    if (started < worker_count) {
+      // Workers steal from every queue, so this one also takes the files of those that were never started
+      fprintf(stderr, "Warning: could not start CPU worker %u, continuing with %u\n", started, started + 1);
+      cpu_worker_main(&workers[started]);
+    }
+    for (uint32_t i = 0; i < started; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  for (uint32_t i = 0; i < worker_count; i++) {
+    total_data_processed += workers[i].data_processed;
+    pthread_mutex_destroy(&workers[i].queue.lock);
+  }
+
+  free(workers);
+  jpeg_cpu_destroy_table_cache(table_cache);
   return 0;
 }
 
@@ -337,11 +636,29 @@ static void usage(const char *exe_name) {
   fprintf(stderr, "Scale a JPEG without decompression\nCan use either the host CPU or UPMEM DPU\n");
   fprintf(stderr, "usage: %s [-d] -s <scale percent> <filenames>\n", exe_name);
   fprintf(stderr, "d: use DPU\n");
+  fprintf(stderr, "j: decode on the CPU with j threads (0: one per core)\n");
   fprintf(stderr, "n: use n DPUs\n");
   fprintf(stderr, "k: use k Ranks\n");
   fprintf(stderr, "m: maximum number of files to process\n");
+  fprintf(stderr, "p: decode each image with up to p CPU threads\n");
   fprintf(stderr, "r: maximum number of ranks to use\n");
+  fprintf(stderr, "s: scale percent, the CPU decodes at the smallest of 1/2, 1/4 and 1/8 that is at least that big\n");
   fprintf(stderr, "t: term to search for\n");
+  fprintf(stderr, "--probe: only report the size, sampling, restart interval and entropy data offset of each file\n");
+  fprintf(stderr, "--format <rgb|bgr|rgba|luma|yuv420|coefficients|quantized>: decode to RGB (default), BGR, RGBA, "
+                  "luma only, planar YUV 4:2:0 (of 4:2:0 images only on the DPU), or stop at the DCT coefficients of "
+                  "every block, dequantized or as coded\n");
+  fprintf(stderr, "--coefficients <count>: keep the first count (1 to 64, default 64) zigzag coefficients of each "
+                  "block, the DPU rounds up to a multiple of 4\n");
+  fprintf(stderr, "--resize <width>x<height>: CPU only, resize the decoded images, decoding at the smallest DCT scale "
+                  "that is still at least that big\n");
+  fprintf(stderr, "--crop <center|x,y,width,height>: crop the middle of the image to the aspect ratio of --resize, or "
+                  "the given rectangle of the full size image, before resizing. Without --resize, only the rectangle "
+                  "is decoded\n");
+  fprintf(stderr, "--filter <area|bilinear>: resampling of --resize, area averaging (default) or bilinear\n");
+  fprintf(stderr, "--pyramid <denominators>: CPU only, decode each image to several scales out of 1, 2, 4 and 8 at "
+                  "once, e.g. 1,2,4,8\n");
+  fprintf(stderr, "--huge-pages: CPU only, back the scratch memory of each worker with transparent huge pages\n");
 }
 
 /**
@@ -372,17 +689,28 @@ int main(int argc, char **argv) {
   opts.horizontal_flip = 0; // no horizontal flip by default
   opts.num_dpus = 1;
   opts.num_ranks = 1;
+  opts.num_threads = 1;
+  opts.image_threads = 1;
+  opts.coefficient_count = 64;
 
-  while ((opt = getopt(argc, argv, options)) != -1) {
+  while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
     switch (opt) {
       case 'd':
         use_dpu = 1;
         break;
 
+      case 'j':
+        opts.num_threads = strtoul(optarg, NULL, 0);
+        break;
+
       case 'm':
         opts.max_files = strtoul(optarg, NULL, 0);
         break;
 
+      case 'p':
+        opts.image_threads = strtoul(optarg, NULL, 0);
+        break;
+
       case 'r':
         opts.max_ranks = strtoul(optarg, NULL, 0);
         break;
@@ -412,6 +740,90 @@ int main(int argc, char **argv) {
         opts.num_ranks = strtoul(optarg, NULL, 0);
         break;
 
+      case 'P':
+        opts.flags |= (1 << OPTION_FLAG_PROBE);
+        break;
+
+      case 'B':
+        opts.flags |= (1 << OPTION_FLAG_HUGE_PAGES);
+        break;
+
+      case 'O':
+        if (strcmp(optarg, "rgb") == 0) {
+          opts.output_format = JPEG_OUTPUT_RGB;
+        } else if (strcmp(optarg, "bgr") == 0) {
+          opts.output_format = JPEG_OUTPUT_BGR;
+        } else if (strcmp(optarg, "rgba") == 0) {
+          opts.output_format = JPEG_OUTPUT_RGBA;
+        } else if (strcmp(optarg, "luma") == 0) {
+          opts.output_format = JPEG_OUTPUT_LUMA;
+        } else if (strcmp(optarg, "yuv420") == 0) {
+          opts.output_format = JPEG_OUTPUT_YUV420;
+        } else if (strcmp(optarg, "coefficients") == 0) {
+          opts.output_format = JPEG_OUTPUT_COEFFICIENTS;
+        } else if (strcmp(optarg, "quantized") == 0) {
+          opts.output_format = JPEG_OUTPUT_QUANTIZED_COEFFICIENTS;
+        } else {
+          printf("Unknown output format %s\n", optarg);
+          usage(argv[0]);
+          return -2;
+        }
+        break;
+
+      case 'K':
+        opts.coefficient_count = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'Z':
+        if (sscanf(optarg, "%ux%u", &opts.resize.width, &opts.resize.height) != 2 || opts.resize.width == 0 ||
+            opts.resize.height == 0) {
+          printf("Invalid resize %s\n", optarg);
+          usage(argv[0]);
+          return -2;
+        }
+        break;
+
+      case 'X':
+        if (strcmp(optarg, "center") == 0) {
+          opts.resize.center_crop = 1;
+        } else if (sscanf(optarg, "%u,%u,%u,%u", &opts.resize.crop_x, &opts.resize.crop_y, &opts.resize.crop_width,
+                          &opts.resize.crop_height) != 4 ||
+                   opts.resize.crop_width == 0 || opts.resize.crop_height == 0) {
+          printf("Invalid crop %s\n", optarg);
+          usage(argv[0]);
+          return -2;
+        }
+        break;
+
+      case 'L':
+        if (strcmp(optarg, "area") == 0) {
+          opts.resize.filter = JPEG_RESIZE_AREA;
+        } else if (strcmp(optarg, "bilinear") == 0) {
+          opts.resize.filter = JPEG_RESIZE_BILINEAR;
+        } else {
+          printf("Unknown filter %s\n", optarg);
+          usage(argv[0]);
+          return -2;
+        }
+        break;
+
+      case 'Y': {
+        char *denom = strtok(optarg, ",");
+        opts.pyramid_levels = 0;
+        while (denom != NULL) {
+          uint32_t value = strtoul(denom, NULL, 0);
+          if (opts.pyramid_levels == JPEG_PYRAMID_MAX_LEVELS ||
+              (value != 1 && value != 2 && value != 4 && value != 8)) {
+            printf("Invalid pyramid level %s\n", denom);
+            usage(argv[0]);
+            return -2;
+          }
+          opts.pyramid_denoms[opts.pyramid_levels++] = value;
+          denom = strtok(NULL, ",");
+        }
+        break;
+      }
+
       case 'C':
       case 'D':
       case 'E':
@@ -432,6 +844,27 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (opts.pyramid_levels != 0 && (opts.resize.width != 0 || opts.resize.crop_width != 0 ||
+                                   opts.output_format == JPEG_OUTPUT_YUV420 ||
+                                   is_coefficient_output(opts.output_format))) {
+    printf("--pyramid does not combine with --resize, --crop or formats other than packed pixels\n");
+    usage(argv[0]);
+    return -2;
+  }
+  if (opts.resize.center_crop && opts.resize.width == 0) {
+    printf("--crop center needs --resize\n");
+    usage(argv[0]);
+    return -2;
+  }
+  if (opts.resize.crop_width != 0 && opts.resize.width == 0) {
+    // A crop on its own is a region of the image to decode
+    opts.region.x = opts.resize.crop_x;
+    opts.region.y = opts.resize.crop_y;
+    opts.region.width = opts.resize.crop_width;
+    opts.region.height = opts.resize.crop_height;
+    memset(&opts.resize, 0, sizeof(JpegResize));
+  }
+
   // at this point, all the rest of the arguments are files to search through
   int remain_arg_count = argc - optind;
   if (remain_arg_count && strcmp(argv[optind], "-") == 0) {
@@ -485,7 +918,8 @@ int main(int argc, char **argv) {
     dbg_printf("Limiting input files to %u\n", opts.input_file_count);
   }
 
-  if (use_dpu)
+  // Probing only reads headers, which is done on the CPU even for files that go to the DPUs
+  if (use_dpu && !(opts.flags & (1 << OPTION_FLAG_PROBE)))
     status = dpu_main(&opts, &results);
   else
     status = cpu_main(&opts, &results);